@@ -1,9 +1,10 @@
 #ifdef __GNUC__
-#define _GNU_SOURCE /* for strsignal() */
+#define _GNU_SOURCE /* for memfd_create(), accept4() and the affinity calls */
 #endif
 
 #include <math.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stddef.h>
@@ -14,10 +15,52 @@
 #include <signal.h>
 #include <syslog.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sched.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <dirent.h>
+#include <poll.h>
 #include <netinet/in.h>
+#include <linux/netlink.h>
+#include <sound/asound.h>
+
+/* the io_uring engine is built when the headers know about it; liburing
+   is not needed */
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define PS_HAVE_IO_URING 1
+#endif
+#endif
+
+/* the build for one board, see "Hardware profiles". The default is the
+   build configured entirely at run time. What a profile fixes is in its
+   HardwareProfile<>; only what its kernel lacks has to go here, before
+   the code that uses it */
+#define PS_PROFILE_GENERIC      0
+#define PS_PROFILE_TEGRA        1
+
+#ifndef PS_PROFILE
+#define PS_PROFILE              PS_PROFILE_GENERIC
+#endif
+
+#if PS_PROFILE == PS_PROFILE_TEGRA
+#undef PS_HAVE_IO_URING         /* the board's kernel predates it */
+#endif
+
+#include "prime-sensors.h"
 
 /*************************************************************************/
 
@@ -26,17 +69,476 @@
 volatile sig_atomic_t	gGracefulShutdown=0;
 volatile sig_atomic_t	gCaughtHupSignal=0;
 
-int                     gLockFileDesc=-1;
-int                     gMasterSocket=-1;
+int                     gListenSocket=-1;   /* from the service manager */
+int                     gNotifySocket=-1;   /* sd_notify, -1 = not asked to */
+struct sockaddr_un      gNotifyAddr;
+socklen_t               gNotifyAddrLen=0;
 
-const char *const       gLockFilePath = "/var/run/prime-sensors.pid";
-const char *const       gLightSensorPath = "/sys/devices/platform/tegra-i2c.2/i2c-2/2-001c/show_lux";
-//const char *const       gDisplayPowerPath = "/sys/devices/platform/tegra-i2c.2/i2c-2/2-001c/bl_power";
-const char *const       gDisplayRegulatorPath = "/sys/class/backlight/pwm-backlight/brightness";
+const char              *gCrashFilePath = "/var/run/prime-sensors.crash";
+const char *const       gLearnedCurvePath = "/var/lib/prime-sensors.curve";
 int const               gDisplayMinBrightness = 4;
-bool                    gAutoLightOn = true;
-const char *const       gAudioJackPath = "/sys/class/switch/h2w/name";
-bool                    gAudioJackPlugged = false;
+int const               gDisplayMaxBrightness = 255;
+bool                    gStatsEnabled = false;
+long long               gWakeNs = 0;            /* 0 unless stats are on */
+bool                    gVirtualClock = false;  /* replaying a trace */
+long long               gVirtualNowMs = 0;
+
+int const               gSamplePeriodMs = 1000;
+int const               gLightSamplePeriodMs = 500;
+int const               gMaxSamplePeriodMs = 8000;   /* backed off while stable */
+int const               gMaxMedianWindow = 9;
+int const               gRampDurationMs = 300;
+int const               gRampFrameMs = 20;
+int const               gMaxCurvePoints = 16;
+int const               gMaxRules = 32;
+int const               gMaxPathLen = 128;
+int const               gMaxControlClients = 8;
+int const               gQueryThreads = 2;           /* on the state socket */
+int const               gQueryIdleMs = 5000;         /* then a state client is dropped */
+int const               gTimerSlackMs = 10;
+int const               gMaxEvents = 8;
+int const               gTelemetryRecords = 4096;    /* a power of two */
+int const               gHistSubBits = 3;            /* 8 buckets per octave */
+int const               gHistBuckets = (64 - gHistSubBits + 1) << gHistSubBits;
+int const               gIoRingEntries = 16;         /* a power of two */
+int const               gIoCloseTimeoutMs = 200;     /* for requests to cancel */
+int const               gWorkerQueueSize = 8;        /* a power of two */
+int const               gSensorTimeoutMs = 2000;
+int const               gResumeMinMs = 100;          /* less is clock jitter */
+int const               gLearnedPoints = 16;         /* lux 0, 1, 2, 4 .. 16384 */
+unsigned int const      gLearnedMagic = 0x434c5350u; /* "PSLC" */
+int const               gLearnedVersion = 1;
+int const               gCurveSaveIntervalMs = 60000;
+int const               gCrashRecordSize = 256;
+int const               gAltStackSize = 65536;
+int const               gLogRecords = 128;           /* a power of two */
+int const               gLogTextSize = 240;
+int const               gLogLimits = 64;             /* messages rate limited per thread, a
+                                                        power of two */
+int const               gLogLimitProbes = 8;         /* slots a message may be in */
+int const               gLogBurst = 5;               /* messages of one format in a row */
+int const               gLogRefillMs = 1000;         /* then one this often */
+int const               gLogFlushMs = 50;            /* gathering a batch */
+
+/* filled in by FatalSigHandler, which can't allocate or format with
+   stdio; see "Crash records" */
+
+char                    gCrashRecord[gCrashRecordSize];
+char                    gAltStack[gAltStackSize];
+int                     gCrashFileDesc=-1;
+
+int                     gEpollDesc=-1;
+int                     gSignalDesc=-1;
+int                     gUeventSocket=-1;
+int                     gWatchdogTimerDesc=-1;
+
+/* every descriptor watched by the main loop is wrapped in an EventSource,
+   which epoll hands back to us in epoll_event.data.ptr */
+
+struct EventSource;
+struct Engine;
+typedef void (*EventHandler)(EventSource *src, unsigned int events);
+
+struct EventSource
+{
+    int                 fd;
+    EventHandler        handler;
+    void                *ctx;
+    Engine              *engine;            /* set by WatchEventSource */
+};
+
+/* a sensor source is a sysfs attribute we sample. It is read whenever the
+   kernel notifies a change (sysfs_notify or a matching uevent) and, if it
+   cannot notify, every periodMs milliseconds from the sample timer */
+
+struct SensorSource;
+struct SensorWorker;
+typedef int (*SensorParser)(SensorSource *sensor, char *text, int len, int *value);
+typedef bool (*SensorGate)(SensorSource *sensor);
+
+struct SensorSource
+{
+    const char          *name;
+    const char          *path;
+    int                 periodMs;
+    SensorParser        parse;
+    const char          *ueventMatch; /* devpath that announces changes */
+    bool                everySample;  /* report every sample, not just changes */
+    int                 maxPeriodMs;  /* longest period while stable */
+    int                 stableDelta;  /* change that still counts as stable */
+    SensorGate          needed;       /* 0, or false when a sample is wasted */
+    bool                threaded;     /* read on a worker thread of its own */
+    int                 cpu;          /* the worker's CPU, -1 = any */
+    int                 timeoutMs;    /* a worker read this long has hung */
+    bool                alsoPolled;   /* its uevents don't announce every change */
+
+    int                 fd;
+    bool                enabled;
+    bool                polled;
+    bool                valid;
+    int                 value;
+    char                text[32];
+    long long           dueMs;
+    int                 curPeriodMs;  /* periodMs..maxPeriodMs */
+    int                 stableValue;  /* value when the period was reset */
+    bool                reading;      /* a read of text is in flight */
+    long long           readStartNs;
+    long long           readSinceMs;  /* when the worker was asked to read */
+    bool                stalled;      /* the worker's read has timed out */
+    SensorWorker        *worker;      /* 0 = read on the main loop */
+    EventSource         event;
+};
+
+/* an actuator sink is a sysfs attribute we write integer levels to. We
+   remember what we last wrote so the level only has to be read back when
+   something announces a change to it */
+
+struct ActuatorSink
+{
+    const char          *name;
+    const char          *path;
+    const char          *ueventMatch; /* devpath that announces changes */
+
+    int                 fd;
+    int                 value;        /* last value written, -1 = unknown */
+    long long           checkedMs;    /* when value was last read back */
+    bool                queued;       /* queuedValue is waiting for a flush */
+    int                 queuedValue;
+    bool                writing;      /* writeBuf is in flight */
+    char                writeBuf[16];
+    int                 writeLen;
+    long long           writeStartNs;
+};
+
+/* corrections to the lux -> backlight curve learned from the levels the
+   user sets. This is the file as it is on disk, see "Learned curve" */
+
+struct LearnedCurve
+{
+    uint32_t            magic;              /* gLearnedMagic */
+    uint16_t            version;            /* gLearnedVersion */
+    uint16_t            numPoints;          /* gLearnedPoints */
+    uint32_t            deviceHash;         /* of the backlight's path */
+    uint32_t            overrides;          /* levels learned from */
+    int16_t             offset[gLearnedPoints]; /* levels, at lux 0, 1, 2, 4 .. */
+};
+
+struct CurveStore
+{
+    LearnedCurve        *curve;             /* 0 = closed */
+    size_t              mapSize;            /* 0 = curve is blank */
+    LearnedCurve        blank;
+    char                path[gMaxPathLen];  /* "" = kept in memory only */
+    int                 saveIntervalMs;
+    bool                dirty;
+    bool                armed;              /* a deferred save is due */
+    long long           savedMs;
+    EventSource         event;              /* timerfd for the deferred save */
+};
+
+/* the lux -> backlight filter, see "Auto-brightness filter" below */
+
+struct CurvePoint
+{
+    int                 lux;
+    int                 level;
+};
+
+struct LuxFilter
+{
+    int                 medianWindow;       /* samples, 1 = no median */
+    int                 riseWeight;         /* EMA weight of a new sample /256 */
+    int                 fallWeight;
+    int                 riseThreshold;      /* levels before we brighten */
+    int                 fallThreshold;      /* levels before we dim */
+    int                 minWriteIntervalMs;
+    const CurvePoint    *curve;
+    int                 curvePoints;
+    const unsigned short *table;            /* the curve by lux, board builds */
+    int                 tableSize;
+    LearnedCurve        *learned;           /* 0 = not learning */
+
+    int                 window[gMaxMedianWindow];
+    int                 windowHead;
+    int                 windowCount;
+    int                 smoothed;           /* lux * 256 */
+    bool                primed;
+    long long           lastWriteMs;
+};
+
+/* a compiled "when ... set ..." rule, see "Rules" below */
+
+enum
+{
+    RULE_EQ,
+    RULE_NE,
+    RULE_LT,
+    RULE_LE,
+    RULE_GT,
+    RULE_GE
+};
+
+enum
+{
+    RULE_SET_AUDIO,             /* value = PS_AUDIO_SPEAKER/HEADPHONE */
+    RULE_SET_MIXER,             /* target = Engine mixerElements entry, value = on */
+    RULE_SET_ACTUATOR,          /* target = Engine actuators entry, value = level */
+    RULE_SET_AUTO_LIGHT         /* value = on */
+};
+
+struct Rule
+{
+    unsigned char       sensor;
+    unsigned char       op;
+    unsigned char       action;
+    unsigned char       target;
+    int                 operand;            /* compared with the sensor value */
+    int                 value;
+};
+
+/* a transition of an actuator to a new level, see "Brightness ramps" */
+
+struct BrightnessRamp
+{
+    int                 durationMs;         /* 0 = jump straight there */
+    int                 frameMs;
+
+    ActuatorSink        *sink;
+    int                 from;
+    int                 to;
+    long long           startMs;
+    bool                active;
+    EventSource         event;
+};
+
+/* settings are kept in an immutable Config snapshot, see "Configuration"
+   below. Config itself is defined after the registry it describes */
+
+struct Config;
+
+enum
+{
+    CONFIG_INT,
+    CONFIG_STRING,
+    CONFIG_CURVE,
+    CONFIG_RULE
+};
+
+struct ConfigKey
+{
+    const char          *key;
+    int                 type;
+    int                 offset;             /* into Config */
+    int                 min;
+    int                 max;                /* for strings, the buffer size */
+};
+
+struct ConfigSetting
+{
+    int                 type;
+    void                *target;
+    int                 min;
+    int                 max;
+};
+
+/* the state as clients see it, see "State snapshot" below */
+
+struct SensorSnapshot
+{
+    unsigned int        seq;                /* the engine's stateSeq when it last changed */
+    int                 lux;                /* -1 = not sampled */
+    int                 brightness;         /* -1 = unknown */
+    int                 targetBrightness;
+    bool                autoLight;
+    bool                jackPlugged;
+    int                 audioRoute;
+    int                 audioOverride;
+    long long           luxMs;              /* CLOCK_MONOTONIC of last change */
+    long long           brightnessMs;
+    long long           jackMs;
+    long long           updatedMs;
+};
+
+int const               gSnapshotWords = (sizeof(SensorSnapshot) + 3)/4;
+
+struct SnapshotLatch
+{
+    unsigned int        seq;
+    unsigned int        copies[2][gSnapshotWords];
+};
+
+/* the threads that answer the state socket, see "State snapshot" */
+
+struct QueryServer
+{
+    const SnapshotLatch *latch;             /* the engine's */
+    int                 listenFd;
+    int                 stopFd;             /* eventfd, main loop to threads */
+    int                 numThreads;
+    pthread_t           threads[gQueryThreads];
+};
+
+/* a connection on the control socket, see "Control socket" below */
+
+struct ControlClient
+{
+    EventSource         event;
+    unsigned int        subscriptions;      /* PS_EVENT_* mask */
+    bool                overrun;
+};
+
+/* the shared-memory telemetry ring, see "Telemetry ring" below */
+
+struct TelemetryRing
+{
+    PsRingHeader        *header;
+    PsRingRecord        *records;
+    size_t              mapSize;
+};
+
+/* the io_uring submission and completion rings, see "io_uring engine"
+   below. The ring pointers point into the mappings shared with the
+   kernel */
+
+struct IoRing
+{
+    int                 fd;                 /* -1 = plain syscalls */
+    void                *sqMap;
+    size_t              sqMapSize;
+    void                *cqMap;             /* == sqMap if mapped once */
+    size_t              cqMapSize;
+    void                *sqes;
+    size_t              sqesSize;
+    unsigned int        *sqTail;
+    unsigned int        *sqMask;
+    unsigned int        *sqArray;
+    unsigned int        *cqHead;
+    unsigned int        *cqTail;
+    unsigned int        *cqMask;
+    void                *cqes;
+    unsigned int        pending;            /* queued, not yet submitted */
+    unsigned int        inFlight;           /* submitted, not yet reaped */
+    bool                expired;            /* CancelIo's timeout went off */
+    EventSource         event;
+};
+
+/* a thread that reads one sensor for the main loop, see "Sensor
+   workers" below. Samples come back through a single-producer,
+   single-consumer ring */
+
+struct WorkerSample
+{
+    int                 len;                /* -1 = the read failed */
+    char                text[32];
+};
+
+struct SensorWorker
+{
+    pthread_t           thread;
+    int                 fd;                 /* the worker's own descriptor */
+    int                 cpu;                /* -1 = not pinned */
+    int                 wakeFd;             /* eventfd, main loop to worker */
+    int                 refs;               /* the main loop and the thread */
+    bool                stop;
+    unsigned int        head;               /* next sample to take, main loop */
+    unsigned int        tail;               /* next slot to fill, worker */
+    WorkerSample        samples[gWorkerQueueSize];
+    EventSource         event;              /* eventfd, worker to main loop */
+};
+
+/* messages waiting for the log flusher, see "Log queue" below. The
+   thread that started the flusher is the only one that adds to it. The
+   rate limits are kept by each thread for itself */
+
+struct LogRecord
+{
+    int                 priority;
+    char                text[gLogTextSize];
+};
+
+struct LogLimit
+{
+    const char          *format;            /* 0 = free slot */
+    unsigned int        hash;               /* of the formatted text */
+    int                 tokens;             /* messages it may send now */
+    long long           refillMs;           /* tokens last topped up */
+    long long           lastMs;             /* last logged or suppressed */
+    unsigned int        suppressed;         /* since the last one sent */
+};
+
+struct LogQueue
+{
+    pthread_t           thread;
+    pthread_t           owner;
+    int                 wakeFd;             /* eventfd, owner to flusher */
+    bool                running;
+    bool                stop;
+    bool                pending;            /* a wakeup is on its way */
+    unsigned int        head;               /* next slot to fill, owner */
+    unsigned int        tail;               /* next slot to send, flusher */
+    unsigned int        dropped;
+    LogRecord           records[gLogRecords];
+};
+
+/* running totals of what the main loop has done. Always counted, they
+   are what the replay benchmark reports */
+
+struct LoopCounters
+{
+    unsigned long long  wakeups;
+    unsigned long long  sensorReads;
+    unsigned long long  sensorSkips;        /* samples a gate said to skip */
+    unsigned long long  decisions;          /* policy runs */
+    unsigned long long  actuatorWrites;
+    unsigned long long  mixerSwitches;
+    unsigned long long  syscalls;           /* through the Loop* calls */
+    unsigned long long  writesCoalesced;
+    unsigned long long  writesDropped;
+    unsigned long long  sensorTimeouts;     /* worker reads that hung */
+    unsigned long long  overrides;          /* backlight levels learned from */
+};
+
+/* timings of one loop stage, see "Statistics" below */
+
+struct StageStats
+{
+    unsigned long long  count;
+    unsigned long long  totalNs;
+    unsigned long long  maxNs;
+    unsigned int        buckets[gHistBuckets];
+};
+
+/* mixer elements are switched through a pluggable MixerBackend, see
+   "Mixer backends" below */
+
+struct MixerElement
+{
+    const char          *name;
+
+    unsigned int        numid;        /* control id, 0 = not found */
+    int                 channels;
+    bool                on;
+    bool                known;        /* on is what the hardware has */
+    bool                queued;       /* queuedOn is waiting for a flush */
+    bool                queuedOn;
+};
+
+struct MixerSwitch
+{
+    int                 element;
+    bool                on;
+};
+
+struct MixerBackend
+{
+    const char          *name;
+    int                 (*open)(MixerBackend *mixer);
+    int                 (*apply)(MixerBackend *mixer, const MixerSwitch *switches, int count);
+    void                (*close)(MixerBackend *mixer);
+
+    int                 fd;
+    int                 batches;
+};
 /*************************************************************************/
 
 /* prototypes */
@@ -47,145 +549,7988 @@ int BecomeDaemonProcess(const char *const lockFileName,
                                 int *const lockFileDesc,
                                 int *const thisPID);
 
-int ConfigureSignalHandlers(void);
-int BindPassiveSocket(const int portNum, int *const boundSocket);
-void FatalSigHandler(int sig);
-void TermHandler(int sig);
-void HupHandler(int sig);
-void Usr1Handler(int sig);
-void TidyUp(void);
+int BecomeServiceProcess(const char *const logPrefix, const int logLevel);
+void CloseOpenFiles(int keep);
+int TakeListenSocket(void);
+int OpenNotifySocket(void);
+int NotifyServiceManager(const char *state);
+int StartServiceWatchdog(void);
+void OnWatchdogTimer(EventSource *src, unsigned int events);
+
+int ConfigureSignalHandlers(void);
+int ConfigureControlSignals(void);
+int BindPassiveSocket(const char *const socketPath, int *const boundSocket);
+void FatalSigHandler(int sig, siginfo_t *info, void *context);
+int OpenCrashRecord(const char *path);
+void TidyUp(void);
+
+int ParseDecimal(const char *text, int len, int *value);
+int ParseInteger(SensorSource *sensor, char *text, int len, int *value);
+int ParseSwitchName(SensorSource *sensor, char *text, int len, int *value);
+int ParseJackState(SensorSource *sensor, char *text, int len, int *value);
+int ParseHdmiState(SensorSource *sensor, char *text, int len, int *value);
+int ParseDockState(SensorSource *sensor, char *text, int len, int *value);
+int LookupSwitchName(const char *text, int len);
+constexpr unsigned int HashSwitchName(const char *text, int len);
+bool BacklightLit(SensorSource *sensor);
+void CheckBacklight(void);
+
+int OpenSensor(SensorSource *sensor);
+int OpenActuator(ActuatorSink *sink);
+void CloseSensor(SensorSource *sensor);
+void CloseActuator(ActuatorSink *sink);
+void CloseSensors(void);
+void CloseActuators(void);
+int RefreshActuator(ActuatorSink *sink);
+bool SampleSensor(SensorSource *sensor);
+void SetSensorEnabled(SensorSource *sensor, bool enabled);
+void RescheduleSampling(void);
+int WriteActuator(ActuatorSink *sink, int value);
+void FinishWrite(ActuatorSink *sink);
+int QueueActuator(ActuatorSink *sink, int value);
+void FlushActuators(void);
+bool FinishSample(SensorSource *sensor, int len);
+void RunPolicy(unsigned int changed);
+long long NowMs(void);
+long long NowNs(void);
+
+Engine *CreateEngine(const char *dir);
+void DestroyEngine(Engine *engine);
+int StartEngine(Engine *engine, Config *config);
+void StopEngine(Engine *engine);
+int LockEngine(Engine *engine);
+void ForEachEngine(void (*fn)(void));
+void PublishEngineState(void);
+int CreateEventLoop(void);
+int WatchEventSource(EventSource *src, unsigned int events);
+int WaitForEvents(int timeoutMs);
+void DispatchEvent(EventSource *src, unsigned int events);
+
+int LoopEpollWait(struct epoll_event *events, int maxEvents, int timeoutMs);
+int LoopTimerSettime(int fd, const struct itimerspec *spec);
+ssize_t LoopRead(int fd, void *buf, size_t len);
+ssize_t LoopWrite(int fd, const void *buf, size_t len);
+ssize_t LoopPread(int fd, void *buf, size_t len, off_t offset);
+ssize_t LoopPwrite(int fd, const void *buf, size_t len, off_t offset);
+ssize_t LoopRecv(int fd, void *buf, size_t len, int flags);
+ssize_t LoopSend(int fd, const void *buf, size_t len, int flags);
+ssize_t LoopSendTo(int fd, const void *buf, size_t len, int flags,
+                   const struct sockaddr *addr, socklen_t addrLen);
+ssize_t LoopSendmsg(int fd, const struct msghdr *msg, int flags);
+int LoopAccept(int fd, int flags);
+int LoopIoctl(int fd, unsigned long request, void *arg);
+int LoopIoUringEnter(int fd, unsigned int toSubmit, unsigned int minComplete,
+                     unsigned int flags);
+int OpenUeventSocket(void);
+int ArmSampleTimer(int periodMs);
+int ReadSysfsAttr(int fd, char *buf, int size);
+void UpdateBacklight(void);
+void UpdateSwitch(SensorSource *sensor);
+void UpdateAudioJack(void);
+int ApplyAudioRoute(void);
+int ParseRule(Config *config, const char *text, char *err, int errLen);
+void CompileRules(Config *config);
+void RunRules(const Config *config, unsigned int changed);
+void SetAutoLight(bool on);
+void SetLightSampling(void);
+unsigned int UpdateDisplayPower(void);
+long long SuspendedMs(void);
+void CheckResume(void);
+void ToggleAutoLight(void);
+void OnControlSignal(EventSource *src, unsigned int events);
+void OnSampleTimer(EventSource *src, unsigned int events);
+void OnSensorAttr(EventSource *src, unsigned int events);
+void OnUevent(EventSource *src, unsigned int events);
+
+void ResetLuxFilter(LuxFilter *filter);
+int FilterLux(LuxFilter *filter, int lux);
+constexpr int LookupCurve(const CurvePoint *curve, int numPoints, int lux);
+int ParseSample(SensorSource *sensor, int len, int *value);
+int LookupBrightness(LuxFilter *filter, int lux);
+bool PassesHysteresis(LuxFilter *filter, int current, int target, long long now);
+
+int OpenCurveStore(CurveStore *store, const char *path, const char *device);
+void CloseCurveStore(CurveStore *store);
+int SaveCurveStore(CurveStore *store);
+void ScheduleCurveSave(CurveStore *store);
+void OnCurveSaveTimer(EventSource *src, unsigned int events);
+int LearnedOffset(const LearnedCurve *curve, int lux);
+void LearnOverride(LuxFilter *filter, int level);
+
+int OpenRamp(BrightnessRamp *ramp, ActuatorSink *sink);
+void CloseRamp(BrightnessRamp *ramp);
+int StartRamp(BrightnessRamp *ramp, int target);
+void StopRamp(BrightnessRamp *ramp);
+int RampTarget(BrightnessRamp *ramp);
+void OnRampFrame(EventSource *src, unsigned int events);
+
+MixerBackend *OpenMixer(const char *name);
+void CloseMixer(MixerBackend *mixer);
+void QueueMixerSwitch(int element, bool on);
+void FlushMixer(void);
+
+int OpenControlSocket(void);
+void CloseControlSocket(void);
+void OnControlConnect(EventSource *src, unsigned int events);
+void OnControlRequest(EventSource *src, unsigned int events);
+void PublishState(void);
+int RunControlCommand(int argc, char *argv[]);
+
+int OpenTelemetryRing(TelemetryRing *ring, const char *path, unsigned int capacity);
+void CloseTelemetryRing(TelemetryRing *ring, const char *path);
+void RecordTelemetry(TelemetryRing *ring, int type, int source, int value, int value2);
+
+void LogMessage(int priority, const char *format, ...) __attribute__((format(printf, 2, 3)));
+int StartLogFlusher(void);
+void StopLogFlusher(void);
+
+long long StatStart(void);
+void StatStop(int stat, long long start);
+void SetStatsEnabled(bool on);
+void ResetStats(void);
+void FillStats(PsStats *stats);
+
+int OpenIoRing(IoRing *ring, unsigned int entries);
+void CloseIoRing(IoRing *ring);
+int QueueIoRead(IoRing *ring, SensorSource *sensor);
+int QueueIoWrite(IoRing *ring, ActuatorSink *sink);
+int QueueIo(IoRing *ring, bool write, int fd, void *buf, int len, unsigned long long userData);
+int SubmitIo(IoRing *ring);
+unsigned int WaitIo(IoRing *ring);
+unsigned int CancelIo(IoRing *ring, int timeoutMs);
+unsigned int ReapIo(IoRing *ring);
+void OnIoCompletion(EventSource *src, unsigned int events);
+void SetIoEngine(const char *name);
+
+int StartSensorWorker(SensorSource *sensor);
+void StopSensorWorker(SensorSource *sensor);
+int PostSensorRead(SensorSource *sensor);
+void CheckSensorWorker(SensorSource *sensor, long long now);
+void OnWorkerSample(EventSource *src, unsigned int events);
+
+void WriteSnapshot(SnapshotLatch *latch, const SensorSnapshot *data);
+int ReadSnapshot(const SnapshotLatch *latch, SensorSnapshot *data);
+void UpdateSnapshot(void);
+int StartQueryThreads(void);
+void StopQueryThreads(void);
+int RunBenchmark(int argc, char *argv[]);
+int RunReplay(int argc, char *argv[]);
+int SelfCheck(bool ok, const char *format, ...) __attribute__((format(printf, 2, 3)));
+int RunSelfTest(int argc, char *argv[]);
+
+void DefaultConfig(Config *config);
+Config *LoadConfig(const char *path, char *err, int errLen);
+void ApplyConfig(Config *next);
+void ReloadConfig(void);
+
+/*************************************************************************/
+
+/* sensor and actuator registry. To drive another device add an entry to
+   one of these tables; the main loop needs no changes */
+
+enum
+{
+    SENSOR_LIGHT,
+    SENSOR_AUDIO_JACK,
+    SENSOR_HDMI,
+    SENSOR_DOCK,
+    SENSOR_DISPLAY_POWER,
+    NUM_SENSORS
+};
+
+/* the switch class devices, whose values are PS_SWITCH_* states */
+
+unsigned int const      gSwitchSensors =
+    1u << SENSOR_AUDIO_JACK | 1u << SENSOR_HDMI | 1u << SENSOR_DOCK;
+
+/* the parser of each sensor. gSensorTable takes its parsers from here, and
+   a board build calls them from here directly, see "Hardware profiles" */
+
+constexpr SensorParser  gSensorParsers[NUM_SENSORS] =
+{
+    ParseInteger,       /* light */
+    ParseJackState,     /* audio-jack */
+    ParseHdmiState,     /* hdmi */
+    ParseDockState,     /* dock */
+    ParseInteger,       /* display-power */
+};
+
+/* each entry is the sensor's description, then its run time state, which
+   starts out closed, disabled and never sampled */
+
+const SensorSource      gSensorTable[NUM_SENSORS] =
+{
+    { "light", "/sys/devices/platform/tegra-i2c.2/i2c-2/2-001c/show_lux",
+      gLightSamplePeriodMs, gSensorParsers[SENSOR_LIGHT], 0, true, gMaxSamplePeriodMs, 10,
+      BacklightLit, true, -1, gSensorTimeoutMs, false,
+      -1, false, false, false, 0, "", 0, 0, 0, false, 0, 0, false, 0, { -1, 0, 0, 0 } },
+    { "audio-jack", "/sys/class/switch/h2w/state",
+      gSamplePeriodMs, gSensorParsers[SENSOR_AUDIO_JACK], "/switch/h2w", false, gMaxSamplePeriodMs,
+      0, 0, false, -1, gSensorTimeoutMs, false,
+      -1, false, false, false, 0, "", 0, 0, 0, false, 0, 0, false, 0, { -1, 0, 0, 0 } },
+    { "hdmi", "/sys/class/switch/hdmi/state",
+      gSamplePeriodMs, gSensorParsers[SENSOR_HDMI], "/switch/hdmi", false, gMaxSamplePeriodMs,
+      0, 0, false, -1, gSensorTimeoutMs, false,
+      -1, false, false, false, 0, "", 0, 0, 0, false, 0, 0, false, 0, { -1, 0, 0, 0 } },
+    { "dock", "/sys/class/switch/dock/state",
+      gSamplePeriodMs, gSensorParsers[SENSOR_DOCK], "/switch/dock", false, gMaxSamplePeriodMs,
+      0, 0, false, -1, gSensorTimeoutMs, false,
+      -1, false, false, false, 0, "", 0, 0, 0, false, 0, 0, false, 0, { -1, 0, 0, 0 } },
+    { "display-power", "/sys/devices/platform/tegra-i2c.2/i2c-2/2-001c/bl_power",
+      gSamplePeriodMs, gSensorParsers[SENSOR_DISPLAY_POWER], "/backlight/", false, gMaxSamplePeriodMs,
+      0, 0, false, -1, gSensorTimeoutMs, true,
+      -1, false, false, false, 0, "", 0, 0, 0, false, 0, 0, false, 0, { -1, 0, 0, 0 } },
+};
+
+enum
+{
+    ACTUATOR_BACKLIGHT,
+    NUM_ACTUATORS
+};
+
+const ActuatorSink      gActuatorTable[NUM_ACTUATORS] =
+{
+    { "backlight", "/sys/class/backlight/pwm-backlight/brightness", "/backlight/",
+      -1, -1, 0, false, 0, false, "", 0, 0 },
+};
+
+/* the default curve is the original min + lux/1.5 rule */
+
+CurvePoint              gDefaultCurve[] =
+{
+    { 0, gDisplayMinBrightness },
+    { 377, gDisplayMaxBrightness },
+};
+
+/* what each build fixes, see "Hardware profiles". There is no profile
+   for a PS_PROFILE that is not one of these, so the build fails */
+
+template<int Profile> struct HardwareProfile;
+
+template<> struct HardwareProfile<PS_PROFILE_GENERIC>
+{
+    static constexpr const char *name = "generic";
+    static constexpr bool fixedParsers = false;     /* through each sensor's parse */
+    static constexpr bool fixedCurve = false;       /* no table */
+    static constexpr const CurvePoint *curve = gDefaultCurve;
+    static constexpr int curvePoints = sizeof(gDefaultCurve)/sizeof(gDefaultCurve[0]);
+};
+
+template<> struct HardwareProfile<PS_PROFILE_TEGRA>
+{
+    static constexpr const char *name = "tegra";
+    static constexpr bool fixedParsers = true;      /* from gSensorParsers */
+    static constexpr bool fixedCurve = true;        /* turned into gProfileTable */
+    static constexpr CurvePoint curve[] =           /* what the panel ships with */
+    {
+        { 0, gDisplayMinBrightness },
+        { 377, gDisplayMaxBrightness },
+    };
+    static constexpr int curvePoints = sizeof(curve)/sizeof(curve[0]);
+};
+
+typedef HardwareProfile<PS_PROFILE> BuildProfile;
+
+const LuxFilter         gDefaultLuxFilter =
+{
+    3,                  /* median of 3 */
+    128,                /* rise: half way per sample */
+    48,                 /* fall: about a fifth per sample */
+    10,
+    20,
+    1000,
+    BuildProfile::curve,
+    BuildProfile::curvePoints,
+    0, 0,               /* no table until ApplyConfig */
+    0,                  /* not learning */
+    {}, 0, 0, 0, false, 0,
+};
+
+const BrightnessRamp    gDefaultRamp =
+    { gRampDurationMs, gRampFrameMs, 0, 0, 0, 0, false, { -1, 0, 0, 0 } };
+
+/* the built-in rules route audio by the headset jack, see "Rules" */
+
+const char *const       gDefaultRules[] =
+{
+    "when audio-jack == 'No Device' set audio speaker",
+    "when audio-jack != 'No Device' set audio headphone",
+};
+
+enum
+{
+    MIXER_INT_SPK,
+    MIXER_HEADPHONE,
+    NUM_MIXER_ELEMENTS
+};
+
+const MixerElement      gMixerElementTable[NUM_MIXER_ELEMENTS] =
+{
+    { "Int Spk", 0, 0, false, false, false, false },
+    { "Headphone Jack", 0, 0, false, false, false, false },
+};
+
+const char *const       gMixerDevicePath = "/dev/snd/controlC0";
+const char *const       gMixerBackendName = "alsa";
+
+LogQueue                gLogQueue = { 0, 0, -1, false, false, false, 0, 0, 0, {} };
+StageStats              gStats[PS_NUM_STATS];
+long long               gStartMs;
+long long               gStartNs;
+unsigned int            gStartupUs;         /* main() to ready */
+long long               gStatsSinceMs;
+
+/* one instance of the daemon: its devices, filter, ramp and rules, the
+   state it has reached, its clients and the files it keeps. Everything
+   above is the process's and shared by all of them, see "Engines" */
+
+struct Engine
+{
+    Engine              *next;              /* in gEngines */
+
+    SensorSource        sensors[NUM_SENSORS];
+    ActuatorSink        actuators[NUM_ACTUATORS];
+    LuxFilter           luxFilter;
+    BrightnessRamp      backlightRamp;
+    CurveStore          curveStore;
+    MixerElement        mixerElements[NUM_MIXER_ELEMENTS];
+    MixerBackend        mixerBackend;       /* its copy of a gMixerBackends entry */
+    MixerBackend        *mixer;             /* 0 = none open */
+    Config              *config;            /* the one in use */
+    int                 switchStates[NUM_SENSORS];  /* as UpdateSwitch last saw them */
+    unsigned int        ueventChanged;      /* sensors a batch of uevents changed */
+
+    bool                autoLightOn;
+    bool                displayOn;          /* the panel is powered */
+    bool                lightWake;          /* next light sample is the first */
+    long long           suspendedMs;        /* CLOCK_BOOTTIME - CLOCK_MONOTONIC */
+    bool                audioJackPlugged;
+    int                 audioRoute;
+    int                 audioAutoRoute;     /* chosen by the rules */
+    int                 audioRouteOverride;
+    long long           backlightEventNs;   /* wakeup awaiting a write */
+    long long           jackEventNs;        /* wakeup awaiting the mixer */
+
+    EventSource         sampleTimer;        /* timerfd, see RescheduleSampling */
+    int                 sampleTimerPeriodMs;
+    IoRing              ioRing;
+    LoopCounters        counters;
+
+    unsigned int        stateSeq;
+    SensorSnapshot      snapshot;           /* the main loop's own copy */
+    SnapshotLatch       snapshotLatch;      /* for any other thread */
+    QueryServer         queryServer;
+    PsState             published;          /* as PublishState last sent it */
+    bool                havePublished;
+    int                 masterSocket;
+    bool                masterSocketInherited;  /* not ours to unlink */
+    EventSource         listenSource;
+    ControlClient       controlClients[gMaxControlClients];
+    TelemetryRing       telemetry;
+
+    int                 lockFileDesc;
+    char                configFilePath[gMaxPathLen];
+    char                lockFilePath[gMaxPathLen];
+    char                controlSocketPath[gMaxPathLen];
+    char                stateSocketPath[gMaxPathLen];
+    char                telemetryRingPath[gMaxPathLen];
+};
+
+Engine                  *gEngines = 0;          /* all of them, by next */
+Engine                  *gEngine = 0;           /* the one being run */
+
+/* a configuration snapshot. The built-in one is filled in from the tables
+   above by DefaultConfig; an engine's config is the one it runs */
+
+struct Config
+{
+    char                sensorPath[NUM_SENSORS][gMaxPathLen];
+    int                 sensorPeriodMs[NUM_SENSORS];
+    int                 sensorMaxPeriodMs[NUM_SENSORS];
+    int                 sensorStableDelta[NUM_SENSORS];
+    int                 sensorThread[NUM_SENSORS];
+    int                 sensorCpu[NUM_SENSORS];
+    int                 sensorTimeoutMs[NUM_SENSORS];
+    char                actuatorPath[NUM_ACTUATORS][gMaxPathLen];
+
+    int                 medianWindow;
+    int                 riseWeight;
+    int                 fallWeight;
+    int                 riseThreshold;
+    int                 fallThreshold;
+    int                 minWriteIntervalMs;
+    CurvePoint          curve[gMaxCurvePoints];
+    int                 curvePoints;
+
+    Rule                rules[gMaxRules];   /* by sensor once compiled */
+    int                 numRules;
+    int                 firstRule[NUM_SENSORS+1];  /* a sensor's rules */
+    bool                fileRules;          /* the built-in ones are replaced */
+
+    int                 rampDurationMs;
+    int                 rampFrameMs;
+
+    int                 learnEnabled;
+    char                learnPath[gMaxPathLen];
+    int                 learnSaveIntervalMs;
+
+    int                 statsEnabled;
+    char                ioEngine[16];
+
+    char                mixerBackend[16];
+    char                mixerDevice[gMaxPathLen];
+};
+
+Config                  gBuiltinConfig;
+
+ConfigKey               gConfigKeys[] =
+{
+    { "filter.median_window", CONFIG_INT, offsetof(Config, medianWindow), 1, gMaxMedianWindow },
+    { "filter.rise_weight", CONFIG_INT, offsetof(Config, riseWeight), 1, 256 },
+    { "filter.fall_weight", CONFIG_INT, offsetof(Config, fallWeight), 1, 256 },
+    { "filter.rise_threshold", CONFIG_INT, offsetof(Config, riseThreshold), 0, gDisplayMaxBrightness },
+    { "filter.fall_threshold", CONFIG_INT, offsetof(Config, fallThreshold), 0, gDisplayMaxBrightness },
+    { "filter.min_write_interval_ms", CONFIG_INT, offsetof(Config, minWriteIntervalMs), 0, 3600000 },
+    { "curve", CONFIG_CURVE, offsetof(Config, curve), 0, 0 },
+    { "rule", CONFIG_RULE, offsetof(Config, rules), 0, 0 },
+    { "ramp.duration_ms", CONFIG_INT, offsetof(Config, rampDurationMs), 0, 10000 },
+    { "ramp.frame_ms", CONFIG_INT, offsetof(Config, rampFrameMs), 1, 1000 },
+    { "learn.enabled", CONFIG_INT, offsetof(Config, learnEnabled), 0, 1 },
+    { "learn.path", CONFIG_STRING, offsetof(Config, learnPath), 0, gMaxPathLen },
+    { "learn.save_interval_ms", CONFIG_INT, offsetof(Config, learnSaveIntervalMs), 1000, 86400000 },
+    { "stats.enabled", CONFIG_INT, offsetof(Config, statsEnabled), 0, 1 },
+    { "io.engine", CONFIG_STRING, offsetof(Config, ioEngine), 0, 16 },
+    { "mixer.backend", CONFIG_STRING, offsetof(Config, mixerBackend), 0, 16 },
+    { "mixer.device", CONFIG_STRING, offsetof(Config, mixerDevice), 0, gMaxPathLen },
+};
+
+/*************************************************************************/
+
+int main(int argc,char *argv[])
+{
+    static char crashPath[gMaxPathLen];
+    int   result, numEngines = 0, i;
+    pid_t daemonPID;
+    bool  foreground;
+    Engine *engine;
+
+    /* each "--dir <dir>" is an instance of the daemon that keeps its
+        files in dir, so that several can run side by side, or in one
+        process, see "Engines". A client talks to the first */
+
+    while (argc > 2 && !strcmp(argv[1], "--dir")){
+        if (!CreateEngine(argv[2])){
+            fprintf(stderr, "%s: not an absolute path short enough for a socket\n", argv[2]);
+            exit(EXIT_FAILURE);
+        }
+        if (!crashPath[0]){
+            snprintf(crashPath, sizeof(crashPath), "%s/prime-sensors.crash", argv[2]);
+            gCrashFilePath = crashPath;
+        }
+        argv[2] = argv[0];
+        argc -= 2;
+        argv += 2;
+    }
+    if (!gEngines && !CreateEngine(0)){
+        perror("prime-sensors");
+        exit(EXIT_FAILURE);
+    }
+    gEngine = gEngines;
+    foreground = argc > 1 && !strcmp(argv[1], "foreground");
+
+    /* with arguments we are a client of the running daemon, unless we
+        are asked to run in the foreground under a service manager */
+
+    if (argc > 1 && !strcmp(argv[1], "bench"))
+        exit(RunBenchmark(argc-2, argv+2));
+    if (argc > 1 && !strcmp(argv[1], "replay"))
+        exit(RunReplay(argc-2, argv+2));
+    if (argc > 1 && !strcmp(argv[1], "selftest"))
+        exit(RunSelfTest(argc-2, argv+2));
+    if (argc > 1 && !foreground)
+        exit(RunControlCommand(argc, argv));
+
+    gStartMs=NowMs();
+    gStartNs=NowNs();
+
+    /* read the configuration files while we can still report errors on
+        the terminal */
+
+    char configErr[256];
+
+    for(engine=gEngines;engine;engine=engine->next)
+        numEngines++;
+    Config **configs = (Config **)calloc(numEngines, sizeof(Config *));
+
+    DefaultConfig(&gBuiltinConfig);
+    for(engine=gEngines, i=0;engine;engine=engine->next, i++){
+        if(!configs ||
+           (configs[i]=LoadConfig(engine->configFilePath,configErr,sizeof(configErr)))==0)
+        {
+            fprintf(stderr,"%s\n",configs ? configErr : strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* the first task is to put ourself into the background (i.e
+        become a daemon. Under a service manager it has done that for us */
+
+    if(foreground)
+        result=BecomeServiceProcess("prime-sensors",LOG_DEBUG);
+    else
+        result=BecomeDaemonProcess(gEngine->lockFilePath,"prime-sensors",
+                                   LOG_DEBUG,&gEngine->lockFileDesc,&daemonPID);
+    if(result<0)
+    {
+        perror("Failed to become daemon process");
+        exit(result);
+    }
+
+    /* report a crash of the last run, and be ready to record one of
+        this run */
+
+    OpenCrashRecord(gCrashFilePath);
+
+    /* set up signal processing */
+
+    if((result=ConfigureSignalHandlers())<0)
+        {
+        LogMessage(LOG_INFO,"ConfigureSignalHandlers failed, errno=%d",errno);
+        TidyUp();
+        exit(result);
+        }
+
+
+    /* control signals (TERM, INT, USR1, USR2, HUP) are delivered through
+        a signalfd so that they are handled as ordinary events by the main
+        loop */
+
+    if((result=ConfigureControlSignals())<0)
+        {
+        LogMessage(LOG_INFO,"ConfigureControlSignals failed, errno=%d",errno);
+        TidyUp();
+        exit(result);
+        }
+
+    if((result=CreateEventLoop())<0)
+        {
+        LogMessage(LOG_INFO,"CreateEventLoop failed, errno=%d",errno);
+        TidyUp();
+        exit(result);
+        }
+
+    /* from here on the main loop only queues its log messages; a thread
+        sends them, see "Log queue" */
+
+    if(StartLogFlusher()<0)
+        LogMessage(LOG_INFO,"can't start the log flusher, errno=%d",errno);
+
+    static EventSource signalSource = { gSignalDesc, OnControlSignal, 0, 0 };
+    static EventSource ueventSource = { -1, OnUevent, 0, 0 };
+
+    WatchEventSource(&signalSource, EPOLLIN);
+    StartServiceWatchdog();
+
+    /* the switch class announces jack changes with a uevent, to every
+        engine, attributes that use sysfs_notify() wake us through
+        POLLPRI/POLLERR */
+
+    if(OpenUeventSocket() >= 0){
+        ueventSource.fd = gUeventSocket;
+        WatchEventSource(&ueventSource, EPOLLIN);
+    }
+
+    /* then each instance opens its devices, its sockets and its ring.
+        The first one's lock file is the daemon's; the others take theirs
+        now */
+
+    for(engine=gEngines, i=0;engine;engine=engine->next, i++){
+        gEngine = engine;
+        if(!foreground && engine != gEngines && LockEngine(engine) < 0){
+            free(configs[i]);
+            continue;
+        }
+        StartEngine(engine, configs[i]);
+        OpenControlSocket();
+        if(StartQueryThreads() < 0)
+            LogMessage(LOG_INFO,"can't serve the state socket %s, errno=%d",
+                       engine->stateSocketPath, errno);
+        OpenTelemetryRing(&engine->telemetry, engine->telemetryRingPath, gTelemetryRecords);
+    }
+    free(configs);
+
+    /* everything is open: tell the service manager we are up */
+
+    char ready[80];
+
+    gStartupUs = (NowNs() - gStartNs)/1000;
+    LogMessage(LOG_INFO,"ready in %u us, %s build, %d instance%s", gStartupUs,
+               BuildProfile::name, numEngines, numEngines == 1 ? "" : "s");
+    snprintf(ready, sizeof(ready), "READY=1\nMAINPID=%d\nSTATUS=ready in %u us",
+             (int)getpid(), gStartupUs);
+    NotifyServiceManager(ready);
+
+    /* now sleep until something happens */
+    do{
+        WaitForEvents(-1);
+        ForEachEngine(PublishEngineState);
+        StatStop(PS_STAT_LOOP, gWakeNs);
+
+        /* the next conditional will be true if we caught signal SIGUSR1 */
+        if(gGracefulShutdown==1)
+            break;
+
+        /* if we caught SIGHUP, swap in the new configurations now that no
+            event is being handled */
+        if(gCaughtHupSignal==1){
+            gCaughtHupSignal=0;
+            snprintf(ready, sizeof(ready), "RELOADING=1\nMONOTONIC_USEC=%llu",
+                     (unsigned long long)NowNs()/1000);
+            NotifyServiceManager(ready);
+            ForEachEngine(ReloadConfig);
+            NotifyServiceManager("READY=1");
+        }
+    }while(1);
+
+    NotifyServiceManager("STOPPING=1");
+
+    for(engine=gEngines;engine;engine=engine->next)
+        StopEngine(engine); /* saves learned curves still unsaved */
+    close(gUeventSocket);
+    close(gWatchdogTimerDesc);
+    close(gNotifySocket);
+    close(gSignalDesc);
+    close(gEpollDesc);
+    StopLogFlusher(); /* sends what is still queued */
+
+    TidyUp(); /* close the sockets and kill the lock files */
+
+    return 0;
+}
+
+/**************************************************************************/
+/***************************************************************************
+
+   Engines
+
+    An Engine is one instance of the daemon: its sensors, actuators,
+   filter, ramp, rules and mixer, the state they have reached, its
+   clients, and the files it keeps. The code that runs an instance
+   works on gEngine, which the main loop points at the engine an event
+   source belongs to before it calls the source's handler, so handlers
+   neither know nor care how many engines there are. What belongs to
+   the process, the epoll instance, signals, the uevent socket, the log
+   queue, the crash record and the latency statistics, all of them
+   share.
+
+    main() runs an engine for each --dir, or one with its files in /etc
+   and /var/run, on the one loop. They share the process, so a signal,
+   or "stop" on any of their control sockets, is for all of them.
+   "bench fleet" runs thousands of them on the virtual clock.
+
+***************************************************************************/
+/**************************************************************************/
+
+/* a new engine in its initial state, at the end of gEngines, keeping
+   its files in dir, or where a lone daemon does for 0. Returns 0 if dir
+   is not an absolute path short enough for a socket, or there is no
+   memory */
+
+Engine *CreateEngine(const char *dir)
+{
+    static const char *const defaults[] =
+        { "/etc/prime-sensors.conf", "/var/run/prime-sensors.pid",
+          PS_CONTROL_SOCKET_PATH, PS_STATE_SOCKET_PATH, PS_RING_PATH };
+    static const char *const names[] =
+        { "prime-sensors.conf", "prime-sensors.pid", "prime-sensors.sock",
+          "state.sock", "telemetry.ring" };
+    struct sockaddr_un addr;
+    Engine *engine, **last;
+    int i;
+
+    if(dir && (dir[0] != '/' ||
+               strlen(dir) + sizeof("/prime-sensors.crash") > sizeof(addr.sun_path)))
+        return 0;
+    if(!(engine = (Engine *)calloc(1, sizeof(Engine))))
+        return 0;
+
+    char *paths[] = { engine->configFilePath, engine->lockFilePath,
+                      engine->controlSocketPath, engine->stateSocketPath,
+                      engine->telemetryRingPath };
+    for(i=0;i<5;i++){
+        if(dir)
+            snprintf(paths[i], gMaxPathLen, "%s/%s", dir, names[i]);
+        else
+            snprintf(paths[i], gMaxPathLen, "%s", defaults[i]);
+    }
+
+    memcpy(engine->sensors, gSensorTable, sizeof(engine->sensors));
+    memcpy(engine->actuators, gActuatorTable, sizeof(engine->actuators));
+    engine->luxFilter = gDefaultLuxFilter;
+    engine->backlightRamp = gDefaultRamp;
+    engine->curveStore.event.fd = -1;
+    memcpy(engine->mixerElements, gMixerElementTable, sizeof(engine->mixerElements));
+
+    engine->autoLightOn = true;
+    engine->displayOn = true;
+    engine->audioRoute = PS_AUDIO_SPEAKER;
+    engine->audioAutoRoute = PS_AUDIO_SPEAKER;
+    engine->audioRouteOverride = PS_AUDIO_AUTO;
+
+    engine->sampleTimer.fd = -1;
+    engine->sampleTimer.handler = OnSampleTimer;
+    engine->ioRing.fd = -1;
+    engine->ioRing.event.fd = -1;
+    engine->queryServer.latch = &engine->snapshotLatch;
+    engine->queryServer.listenFd = -1;
+    engine->queryServer.stopFd = -1;
+    engine->masterSocket = -1;
+    engine->listenSource.fd = -1;
+    engine->listenSource.handler = OnControlConnect;
+    for(i=0;i<gMaxControlClients;i++)
+        engine->controlClients[i].event.fd = -1;
+    engine->lockFileDesc = -1;
+
+    for(last=&gEngines;*last;last=&(*last)->next)
+        ;
+    *last = engine;
+    return engine;
+}
+
+/* take an engine out of gEngines and free it. It must be stopped */
+
+void DestroyEngine(Engine *engine)
+{
+    Engine **link;
+
+    for(link=&gEngines;*link;link=&(*link)->next){
+        if(*link == engine){
+            *link = engine->next;
+            break;
+        }
+    }
+    if(gEngine == engine)
+        gEngine = gEngines;
+    free(engine);
+}
+
+/**************************************************************************/
+/***************************************************************************
+
+   StartEngine
+
+    Open an engine's devices with a configuration and start sampling.
+   Its sockets and telemetry ring are left to the caller, so that an
+   engine can run without any.
+
+    Inputs:
+
+   engine		 I					  the engine, which becomes gEngine
+
+   config		 I					  the configuration, which the engine
+										  takes
+
+    Returns:
+
+    status code indicating success - 0 = success
+
+***************************************************************************/
+/**************************************************************************/
+
+int StartEngine(Engine *engine, Config *config)
+{
+    gEngine = engine;
+
+    /* sensors that cannot notify us are sampled from a timerfd, which is
+        only armed while at least one of them is enabled. It runs on
+        CLOCK_BOOTTIME so that it fires as soon as we resume from a
+        system suspend, see CheckResume */
+
+    engine->sampleTimer.fd = timerfd_create(CLOCK_BOOTTIME, TFD_NONBLOCK|TFD_CLOEXEC);
+    engine->suspendedMs = SuspendedMs();
+    if(engine->sampleTimer.fd < 0 || WatchEventSource(&engine->sampleTimer, EPOLLIN) < 0){
+        free(config);
+        return -1;
+    }
+
+    for(int i=0;i<NUM_SENSORS;i++)
+        SetSensorEnabled(&engine->sensors[i], true);
+    SetSensorEnabled(&engine->sensors[SENSOR_LIGHT], engine->autoLightOn);
+    ResetLuxFilter(&engine->luxFilter);
+
+    OpenRamp(&engine->backlightRamp, &engine->actuators[ACTUATOR_BACKLIGHT]);
+    ApplyConfig(config); /* opens the devices */
+    return 0;
+}
+
+/* close everything an engine has open, sockets and ring included */
+
+void StopEngine(Engine *engine)
+{
+    gEngine = engine;
+    CloseTelemetryRing(&engine->telemetry, engine->telemetryRingPath);
+    StopQueryThreads();
+    CloseControlSocket();
+    CloseIoRing(&engine->ioRing);
+    CloseSensors();
+    CloseActuators();
+    CloseMixer(engine->mixer);
+    engine->mixer = 0;
+    CloseRamp(&engine->backlightRamp);
+    CloseCurveStore(&engine->curveStore); /* saves what is still unsaved */
+    engine->luxFilter.learned = 0;
+    free(engine->config);
+    engine->config = 0;
+    if(engine->sampleTimer.fd >= 0)
+        close(engine->sampleTimer.fd);
+    engine->sampleTimer.fd = -1;
+    engine->sampleTimerPeriodMs = 0;
+}
+
+/* take the pid file of an engine after the first, which the daemon
+   took before it forked. An engine that can't is not run */
+
+int LockEngine(Engine *engine)
+{
+    struct flock exclusiveLock;
+    char pidStr[16];
+    int fd;
+
+    memset(&exclusiveLock, 0, sizeof(exclusiveLock));
+    exclusiveLock.l_type = F_WRLCK;
+    exclusiveLock.l_whence = SEEK_SET;
+
+    fd = open(engine->lockFilePath, O_RDWR|O_CREAT|O_EXCL|O_CLOEXEC, 0644);
+    if(fd < 0 || fcntl(fd, F_SETLK, &exclusiveLock) < 0){
+        LogMessage(LOG_INFO,"can't take lock file %s, errno=%d - not running it",
+                   engine->lockFilePath, errno);
+        if(fd >= 0)
+            close(fd);
+        return -1;
+    }
+
+    snprintf(pidStr, sizeof(pidStr), "%d\n", (int)getpid());
+    write(fd, pidStr, strlen(pidStr));
+    engine->lockFileDesc = fd;
+    return 0;
+}
+
+/* call fn with gEngine at each engine in turn */
+
+void ForEachEngine(void (*fn)(void))
+{
+    Engine *current = gEngine;
+
+    for(gEngine=gEngines;gEngine;gEngine=gEngine->next)
+        fn();
+    gEngine = current;
+}
+
+/**************************************************************************/
+/***************************************************************************
+
+   CreateEventLoop
+
+    Create the epoll instance that the main loop sleeps on. Sensors,
+   timers and control signals are all registered with it, so the daemon
+   only wakes when one of them has something to report.
+
+    Returns:
+
+    status code indicating success - 0 = success
+
+***************************************************************************/
+/**************************************************************************/
+
+int CreateEventLoop(void)
+{
+    gEpollDesc=epoll_create1(EPOLL_CLOEXEC);
+    if(gEpollDesc<0)
+        return -1;
+
+    return 0;
+}
+
+/**************************************************************************/
+/***************************************************************************
+
+   WatchEventSource
+
+    Register an event source with the main loop, on behalf of gEngine,
+   which is current again whenever its handler is called.
+
+    Inputs:
+
+   src			 I					  the source to watch. It must stay
+                                          valid while it is registered
+
+   events		 I					  the epoll events of interest. Use
+                                          EPOLLPRI|EPOLLERR for sysfs
+                                          attributes (sysfs_notify)
+
+    Returns:
+
+    status code indicating success - 0 = success
+
+***************************************************************************/
+/**************************************************************************/
+
+int WatchEventSource(EventSource *src, unsigned int events)
+{
+    struct epoll_event      ev;
+
+    if(src->fd<0)
+        return -1;
+
+    src->engine=gEngine;
+    memset(&ev,0,sizeof(ev));
+    ev.events=events;
+    ev.data.ptr=src;
+
+    return epoll_ctl(gEpollDesc,EPOLL_CTL_ADD,src->fd,&ev);
+}
+
+/**************************************************************************/
+/***************************************************************************
+
+   System calls
+
+    Everything the main loop asks of the kernel once it is running goes
+   through one of these: waiting for events, reading and re-arming its
+   timers and eventfds, reading sensors and writing actuators, switching
+   the mixer, the io_uring engine, the uevent socket, its clients and
+   the service manager. Each makes the call and counts it in the
+   counters of gEngine, so the count is what the loop really did, not
+   what its call sites say it did. Opening and closing devices and
+   files, and saving the learned curve, are not counted; none of them
+   happen tick by tick.
+
+    Only the main loop may call these. Sensor workers, the log flusher
+   and the query threads make their calls directly, uncounted.
+
+***************************************************************************/
+/**************************************************************************/
+
+int LoopEpollWait(struct epoll_event *events, int maxEvents, int timeoutMs)
+{
+    gEngine->counters.syscalls++;
+    return epoll_wait(gEpollDesc, events, maxEvents, timeoutMs);
+}
+
+int LoopTimerSettime(int fd, const struct itimerspec *spec)
+{
+    gEngine->counters.syscalls++;
+    return timerfd_settime(fd, 0, spec, 0);
+}
+
+ssize_t LoopRead(int fd, void *buf, size_t len)
+{
+    gEngine->counters.syscalls++;
+    return read(fd, buf, len);
+}
+
+ssize_t LoopWrite(int fd, const void *buf, size_t len)
+{
+    gEngine->counters.syscalls++;
+    return write(fd, buf, len);
+}
+
+ssize_t LoopPread(int fd, void *buf, size_t len, off_t offset)
+{
+    gEngine->counters.syscalls++;
+    return pread(fd, buf, len, offset);
+}
+
+ssize_t LoopPwrite(int fd, const void *buf, size_t len, off_t offset)
+{
+    gEngine->counters.syscalls++;
+    return pwrite(fd, buf, len, offset);
+}
+
+ssize_t LoopRecv(int fd, void *buf, size_t len, int flags)
+{
+    gEngine->counters.syscalls++;
+    return recv(fd, buf, len, flags);
+}
+
+ssize_t LoopSend(int fd, const void *buf, size_t len, int flags)
+{
+    gEngine->counters.syscalls++;
+    return send(fd, buf, len, flags);
+}
+
+ssize_t LoopSendTo(int fd, const void *buf, size_t len, int flags,
+                   const struct sockaddr *addr, socklen_t addrLen)
+{
+    gEngine->counters.syscalls++;
+    return sendto(fd, buf, len, flags, addr, addrLen);
+}
+
+ssize_t LoopSendmsg(int fd, const struct msghdr *msg, int flags)
+{
+    gEngine->counters.syscalls++;
+    return sendmsg(fd, msg, flags);
+}
+
+int LoopAccept(int fd, int flags)
+{
+    gEngine->counters.syscalls++;
+    return accept4(fd, 0, 0, flags);
+}
+
+int LoopIoctl(int fd, unsigned long request, void *arg)
+{
+    gEngine->counters.syscalls++;
+    return ioctl(fd, request, arg);
+}
+
+int LoopIoUringEnter(int fd, unsigned int toSubmit, unsigned int minComplete,
+                     unsigned int flags)
+{
+    gEngine->counters.syscalls++;
+    return syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, 0, 0);
+}
+
+/**************************************************************************/
+/***************************************************************************
+
+   WaitForEvents
+
+    Sleep until at least one registered source is ready, then dispatch
+   every ready source to its engine, see DispatchEvent. The wait itself
+   is counted against the engine current at the time.
+
+    Inputs:
+
+   timeoutMs	 I					  how long to wait, -1 = forever
+
+    Returns:
+
+    the number of events handled, or -1 on error
+
+***************************************************************************/
+/**************************************************************************/
+
+int WaitForEvents(int timeoutMs)
+{
+    struct epoll_event      ready[gMaxEvents];
+    int                     numReady,i;
+
+    ForEachEngine(FlushActuators); /* anything queued outside a tick */
+
+    numReady=LoopEpollWait(ready,gMaxEvents,timeoutMs);
+    gWakeNs=StatStart();
+    gEngine->counters.wakeups++;
+    if(numReady<0){
+        if(errno!=EINTR)
+            LogMessage(LOG_INFO,"epoll_wait failed, errno=%d",errno);
+        return -1;
+    }
+
+    for(i=0;i<numReady;i++)
+        DispatchEvent((EventSource *)ready[i].data.ptr,ready[i].events);
+
+    return numReady;
+}
+
+/* call the handler of a ready source with gEngine at the engine it
+   belongs to, then write out what the handler decided. The sources of
+   the whole process, signals, the uevent socket and the watchdog, were
+   watched for the first engine and see to the others themselves */
+
+void DispatchEvent(EventSource *src, unsigned int events)
+{
+    if(src->engine)
+        gEngine=src->engine;
+    src->handler(src,events);
+    FlushActuators();
+}
+
+/**************************************************************************/
+/***************************************************************************
+
+   ArmSampleTimer
+
+    Start or stop the periodic timer used for sensors that cannot notify.
+
+    Inputs:
+
+   periodMs		 I					  the sample period, 0 = disarm
+
+    Returns:
+
+    status code indicating success - 0 = success
+
+***************************************************************************/
+/**************************************************************************/
+
+int ArmSampleTimer(int periodMs)
+{
+    struct itimerspec       spec;
+
+    if(gEngine->sampleTimer.fd<0)
+        return -1;
+
+    if(periodMs==gEngine->sampleTimerPeriodMs)
+        return 0; /* keep the current phase */
+
+    spec.it_interval.tv_sec=periodMs/1000;
+    spec.it_interval.tv_nsec=(periodMs%1000)*1000000L;
+    spec.it_value=spec.it_interval;
+
+    if(LoopTimerSettime(gEngine->sampleTimer.fd,&spec)<0)
+        return -1;
+
+    gEngine->sampleTimerPeriodMs=periodMs;
+    return 0;
+}
+
+/**************************************************************************/
+/***************************************************************************
+
+   OpenUeventSocket
+
+    Open a netlink socket on the kernel uevent multicast group. The switch
+   class (h2w headset jack) reports state changes this way instead of with
+   sysfs_notify().
+
+    Returns:
+
+    status code indicating success - 0 = success
+
+***************************************************************************/
+/**************************************************************************/
+
+int OpenUeventSocket(void)
+{
+    struct sockaddr_nl      addr;
+
+    gUeventSocket=socket(AF_NETLINK,SOCK_DGRAM|SOCK_NONBLOCK|SOCK_CLOEXEC,
+                         NETLINK_KOBJECT_UEVENT);
+    if(gUeventSocket<0)
+        return -1;
+
+    memset(&addr,0,sizeof(addr));
+    addr.nl_family=AF_NETLINK;
+    addr.nl_pid=0;
+    addr.nl_groups=1; /* kernel uevents */
+
+    if(bind(gUeventSocket,(struct sockaddr *)&addr,sizeof(addr))<0){
+        close(gUeventSocket);
+        gUeventSocket=-1;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* read a sysfs attribute from the beginning with a single pread, so the
+   descriptor can stay open and never needs an lseek. Reading also re-arms
+   POLLPRI notification on the descriptor. Returns the length or -1 */
+
+int ReadSysfsAttr(int fd, char *buf, int size)
+{
+    int len;
+
+    len = LoopPread(fd, buf, size-1, 0);
+    if(len < 0){
+        buf[0] = 0;
+        return -1;
+    }
+    buf[len] = 0;
+
+    return len;
+}
+
+/* CLOCK_MONOTONIC, or the virtual clock while a trace is replayed */
+
+long long NowMs(void)
+{
+    struct timespec now;
+
+    if(gVirtualClock)
+        return gVirtualNowMs;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec*1000 + now.tv_nsec/1000000;
+}
+
+long long NowNs(void)
+{
+    struct timespec now;
+
+    if(gVirtualClock)
+        return gVirtualNowMs*1000000;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec*1000000000 + now.tv_nsec;
+}
+
+/**************************************************************************/
+/***************************************************************************
+
+   ParseDecimal
+
+    Parse a decimal integer as printed by a sysfs show() method: an
+   optional sign, at least one digit and nothing after it but whitespace.
+   Unlike atoi() it reports empty, malformed and out of range text.
+
+    Inputs:
+
+   text			 I					  the text to parse
+
+   len			 I					  its length
+
+   value		 O					  the parsed value
+
+    Returns:
+
+    status code indicating success - 0 = success
+
+***************************************************************************/
+/**************************************************************************/
+
+int ParseDecimal(const char *text, int len, int *value)
+{
+    const char *p = text, *end = text + len;
+    unsigned int result = 0, limit = 0x7fffffffu;
+    bool negative = false;
+
+    if(p < end && (*p == '-' || *p == '+')){
+        negative = *p == '-';
+        if(negative)
+            limit++;
+        p++;
+    }
+
+    if(p == end || (unsigned)(*p - '0') > 9)
+        return -1;
+
+    for(; p < end && (unsigned)(*p - '0') <= 9; p++){
+        unsigned int digit = *p - '0';
+        if(result > (limit - digit) / 10)
+            return -1;
+        result = result*10 + digit;
+    }
+
+    for(; p < end; p++){
+        if(*p != '\n' && *p != ' ' && *p != '\t')
+            return -1;
+    }
+
+    *value = negative ? (int)(0u - result) : (int)result;
+    return 0;
+}
+
+/* sensor parsers turn the attribute text into an integer value */
+
+int ParseInteger(SensorSource *sensor, char *text, int len, int *value)
+{
+    return ParseDecimal(text, len, value);
+}
+
+/* the "name" attribute of a switch device, read through the table of
+   known names, see "Switch states". Only a driver that sets print_name
+   puts what is plugged in there; the others give their own name */
+
+int ParseSwitchName(SensorSource *sensor, char *text, int len, int *value)
+{
+    if(len > 0 && text[len-1] == '\n')
+        text[--len] = 0;
+
+    *value = LookupSwitchName(text, len);
+    return *value < 0 ? -1 : 0;
+}
+
+/* the "state" attribute of a switch device is a number whose meaning
+   depends on the device. A known name is taken as well, so that rules
+   can say 'Car' */
+
+int ParseSwitchState(const int *states, int numStates, char *text, int len, int *value)
+{
+    int state;
+
+    if(ParseDecimal(text, len, &state) < 0)
+        return ParseSwitchName(0, text, len, value);
+    if(state < 0 || state >= numStates)
+        return -1;
+
+    *value = states[state];
+    return 0;
+}
+
+/* the h2w headset jack: a bit for a headset, one for headphones
+   without a microphone */
+
+int ParseJackState(SensorSource *sensor, char *text, int len, int *value)
+{
+    static const int states[] = { PS_SWITCH_NONE, PS_SWITCH_HEADSET, PS_SWITCH_HEADPHONE };
+
+    return ParseSwitchState(states, sizeof(states)/sizeof(states[0]), text, len, value);
+}
+
+int ParseHdmiState(SensorSource *sensor, char *text, int len, int *value)
+{
+    static const int states[] = { PS_SWITCH_NONE, PS_SWITCH_HDMI };
+
+    return ParseSwitchState(states, sizeof(states)/sizeof(states[0]), text, len, value);
+}
+
+/* Android dock states: undocked, desk, car, low-end and high-end desk */
+
+int ParseDockState(SensorSource *sensor, char *text, int len, int *value)
+{
+    static const int states[] = { PS_SWITCH_NONE, PS_SWITCH_DESK_DOCK, PS_SWITCH_CAR_DOCK,
+                                  PS_SWITCH_DESK_DOCK, PS_SWITCH_DESK_DOCK };
+
+    return ParseSwitchState(states, sizeof(states)/sizeof(states[0]), text, len, value);
+}
+
+/**************************************************************************/
+/***************************************************************************
+
+   OpenSensor
+
+    Open a sensor and register it with the main loop. Attributes are
+   always watched for POLLPRI, which costs nothing if they never notify.
+   A sensor with a ueventMatch is not polled as long as the uevent socket
+   is open.
+
+    Inputs:
+
+   sensor		 I					  the sensor, with its path set
+
+    Returns:
+
+    status code indicating success - 0 = success
+
+***************************************************************************/
+/**************************************************************************/
+
+int OpenSensor(SensorSource *sensor)
+{
+    sensor->fd = open(sensor->path, O_RDONLY|O_CLOEXEC);
+    sensor->valid = false;
+    sensor->polled = !(sensor->ueventMatch && gUeventSocket >= 0) || sensor->alsoPolled;
+    sensor->dueMs = 0;
+    sensor->event.fd = sensor->fd;
+    sensor->event.handler = OnSensorAttr;
+    sensor->event.ctx = sensor;
+
+    if(sensor->fd < 0){
+        LogMessage(LOG_INFO,"sensor %s: can't open %s, errno=%d",
+                   sensor->name, sensor->path, errno);
+        return -1;
+    }
+
+    WatchEventSource(&sensor->event, EPOLLPRI|EPOLLERR);
+    return 0;
+}
+
+/* closing the descriptor also removes it from the epoll set. A worker
+   reading the sensor is let go first */
+
+void CloseSensor(SensorSource *sensor)
+{
+    StopSensorWorker(sensor);
+    if(sensor->fd >= 0)
+        close(sensor->fd);
+    sensor->fd = -1;
+    sensor->valid = false;
+}
+
+void CloseSensors(void)
+{
+    int i;
+
+    for(i=0;i<NUM_SENSORS;i++)
+        CloseSensor(&gEngine->sensors[i]);
+}
+
+/* open an actuator. The current level is read once here; after that we
+   rely on the value we last wrote */
+
+int OpenActuator(ActuatorSink *sink)
+{
+    sink->fd = open(sink->path, O_RDWR|O_CLOEXEC);
+    sink->value = -1;
+    sink->queued = false;
+
+    if(sink->fd < 0){
+        LogMessage(LOG_INFO,"actuator %s: can't open %s, errno=%d",
+                   sink->name, sink->path, errno);
+        return -1;
+    }
+
+    RefreshActuator(sink);
+    return 0;
+}
+
+/* read an actuator's level back, in case something else has changed it */
+
+int RefreshActuator(ActuatorSink *sink)
+{
+    char data_buf[16];
+    int len, value;
+
+    if(sink->fd < 0)
+        return -1;
+
+    len = ReadSysfsAttr(sink->fd, data_buf, sizeof(data_buf));
+    if(len < 0 || ParseDecimal(data_buf, len, &value) < 0)
+        return -1;
+
+    sink->value = value;
+    sink->checkedMs = NowMs();
+    return 0;
+}
+
+void CloseActuator(ActuatorSink *sink)
+{
+    if(sink->fd >= 0)
+        close(sink->fd);
+    sink->fd = -1;
+}
+
+void CloseActuators(void)
+{
+    int i;
+
+    for(i=0;i<NUM_ACTUATORS;i++)
+        CloseActuator(&gEngine->actuators[i]);
+}
+
+/**************************************************************************/
+/***************************************************************************
+
+   SampleSensor
+
+    Read and parse one sensor. A sensor with a worker thread is read
+   there instead, and OnWorkerSample acts on the sample; with the
+   io_uring engine the read is queued, and OnIoCompletion acts on it.
+
+    Inputs:
+
+   sensor		 I					  the sensor to sample
+
+    Returns:
+
+    true if the value changed (or became valid); always false when the
+    read was handed to a worker or queued
+
+***************************************************************************/
+/**************************************************************************/
+
+bool SampleSensor(SensorSource *sensor)
+{
+    long long start;
+    int len;
+
+    if(sensor->fd < 0 || !sensor->enabled)
+        return false;
+
+    if(sensor->worker){
+        PostSensorRead(sensor);
+        return false;
+    }
+
+    /* with the io_uring engine the read is only queued here, and the
+       sample is finished when it completes */
+    if(gEngine->ioRing.fd >= 0 && QueueIoRead(&gEngine->ioRing, sensor) == 0)
+        return false;
+
+    start = StatStart();
+    gEngine->counters.sensorReads++;
+    len = ReadSysfsAttr(sensor->fd, sensor->text, sizeof(sensor->text));
+    StatStop(PS_STAT_SENSOR_READ, start);
+
+    return FinishSample(sensor, len);
+}
+
+/* parse the len bytes read into sensor->text and update the sensor.
+   Returns true if its value changed */
+
+bool FinishSample(SensorSource *sensor, int len)
+{
+    int value;
+
+    if(len < 0)
+        return false;
+
+    if(ParseSample(sensor, len, &value) < 0){
+        LogMessage(LOG_DEBUG,"sensor %s: can't parse \"%s\"",
+                   sensor->name, sensor->text);
+        return false;
+    }
+
+    /* back off while the readings are stable, and come straight back to
+       the full rate when they move */
+    if(!sensor->valid || abs(value - sensor->stableValue) > sensor->stableDelta){
+        sensor->stableValue = value;
+        sensor->curPeriodMs = sensor->periodMs;
+    }else if(sensor->curPeriodMs < sensor->maxPeriodMs){
+        sensor->curPeriodMs *= 2;
+        if(sensor->curPeriodMs > sensor->maxPeriodMs)
+            sensor->curPeriodMs = sensor->maxPeriodMs;
+    }
+
+    RecordTelemetry(&gEngine->telemetry,
+                    sensor == &gEngine->sensors[SENSOR_LIGHT] ? PS_RECORD_LUX : PS_RECORD_SAMPLE,
+                    sensor - gEngine->sensors, value, 0);
+
+    if(sensor->valid && sensor->value == value && !sensor->everySample)
+        return false;
+
+    sensor->value = value;
+    sensor->valid = true;
+    return true;
+}
+
+/* a disabled sensor is neither polled nor acted on. Enabling it makes it
+   due at the next tick so its first sample is fresh */
+
+void SetSensorEnabled(SensorSource *sensor, bool enabled)
+{
+    sensor->enabled = enabled;
+    sensor->valid = false;
+    sensor->dueMs = 0;
+    sensor->curPeriodMs = sensor->periodMs;
+}
+
+/* the period for the sample timer: the shortest current period of the
+   enabled sensors that have to be polled, or 0 if there are none */
+
+int SamplePeriodMs(void)
+{
+    int i, periodMs = 0;
+
+    for(i=0;i<NUM_SENSORS;i++){
+        SensorSource *sensor = &gEngine->sensors[i];
+
+        if(sensor->fd < 0 || !sensor->enabled || !sensor->polled)
+            continue;
+        if(periodMs == 0 || sensor->curPeriodMs < periodMs)
+            periodMs = sensor->curPeriodMs;
+    }
+
+    return periodMs;
+}
+
+/**************************************************************************/
+/***************************************************************************
+
+   RescheduleSampling
+
+    Arm the sample timer at the shortest current period of the enabled
+   sensors that have to be polled, or disarm it if there are none, and
+   sample any sensor that is due right away.
+
+    Each polled sensor starts at its periodMs. Every sample that stays
+   within stableDelta of the value that started the run doubles its
+   period, up to maxPeriodMs; a bigger change drops it back to periodMs
+   at once. A sensor with a needed() gate is not read at all while the
+   gate says its samples would be wasted, only checked at maxPeriodMs.
+
+    Returns: none
+
+***************************************************************************/
+/**************************************************************************/
+
+void RescheduleSampling(void)
+{
+    ArmSampleTimer(SamplePeriodMs());
+    OnSampleTimer(0, 0);
+}
+
+/**************************************************************************/
+/***************************************************************************
+
+   Actuator queue
+
+    Handlers never write to an actuator or switch the mixer directly.
+   They queue the level or switch, and WaitForEvents flushes everything
+   queued in one pass once every handler of the tick has run. A level
+   queued twice in one tick is only written once, the last one, and a
+   level that is already set is not written at all, so slow I2C and PWM
+   drivers only see writes that change something. The flush goes
+   through the actuators in gActuatorTable order and then switches the mixer
+   off-before-on, so related writes always reach the hardware in the same
+   order, whatever order the handlers ran in.
+
+***************************************************************************/
+/**************************************************************************/
+
+int QueueActuator(ActuatorSink *sink, int value)
+{
+    if(sink->fd < 0)
+        return -1;
+
+    if(sink->queued)
+        gEngine->counters.writesCoalesced++;
+
+    if(value == sink->value){
+        if(!sink->queued)
+            gEngine->counters.writesDropped++;
+        sink->queued = false;
+        return 0;
+    }
+
+    sink->queued = true;
+    sink->queuedValue = value;
+    return 0;
+}
+
+/* the level an actuator will have after the next flush */
+
+int ActuatorLevel(const ActuatorSink *sink)
+{
+    return sink->queued ? sink->queuedValue : sink->value;
+}
+
+void FlushActuators(void)
+{
+    int i;
+
+    for(i=0;i<NUM_ACTUATORS;i++){
+        ActuatorSink *sink = &gEngine->actuators[i];
+
+        /* a level queued while the last write is still in flight
+           waits for the next flush */
+        if(!sink->queued || sink->writing)
+            continue;
+        sink->queued = false;
+        WriteActuator(sink, sink->queuedValue);
+    }
+
+    FlushMixer();
+    SubmitIo(&gEngine->ioRing);
+}
+
+/* write an integer level to an actuator now, or queue the write on the
+   io_uring engine. Only the flush calls this */
+
+int WriteActuator(ActuatorSink *sink, int value)
+{
+    if(sink->fd < 0)
+        return -1;
+
+    sink->writeStartNs = StatStart();
+    sink->writeLen = sprintf(sink->writeBuf, "%d", value);
+    gEngine->counters.actuatorWrites++;
+    if(gEngine->ioRing.fd < 0 || QueueIoWrite(&gEngine->ioRing, sink) < 0){
+        if(LoopPwrite(sink->fd, sink->writeBuf, sink->writeLen, 0) != sink->writeLen){
+            LogMessage(LOG_INFO,"actuator %s: write failed, errno=%d",
+                       sink->name, errno);
+            return -1;
+        }
+        FinishWrite(sink);
+    }
+
+    sink->value = value;
+    RecordTelemetry(&gEngine->telemetry, PS_RECORD_BRIGHTNESS, sink - gEngine->actuators, value,
+                    sink == &gEngine->actuators[ACTUATOR_BACKLIGHT] ?
+                    RampTarget(&gEngine->backlightRamp) : value);
+    return 0;
+}
+
+/* account for a write that reached the actuator */
+
+void FinishWrite(ActuatorSink *sink)
+{
+    StatStop(PS_STAT_ACTUATOR_WRITE, sink->writeStartNs);
+
+    if(sink == &gEngine->actuators[ACTUATOR_BACKLIGHT] && gEngine->backlightEventNs){
+        StatStop(PS_STAT_BACKLIGHT_LATENCY, gEngine->backlightEventNs);
+        gEngine->backlightEventNs = 0;
+    }
+}
+
+/* event handlers */
+
+/* sample every polled sensor that is due, then run the policy once for
+   the whole batch */
+
+void OnSampleTimer(EventSource *src, unsigned int events)
+{
+    unsigned long long expirations;
+    unsigned int changed = 0;
+    long long now;
+    int i;
+
+    if(src){
+        LoopRead(src->fd, &expirations, sizeof(expirations));
+        CheckResume();
+    }
+
+    now = NowMs();
+    for(i=0;i<NUM_SENSORS;i++){
+        SensorSource *sensor = &gEngine->sensors[i];
+
+        if(sensor->fd < 0 || !sensor->enabled)
+            continue;
+        if(sensor->worker)
+            CheckSensorWorker(sensor, now);
+        if(sensor->polled ? now < sensor->dueMs - gTimerSlackMs : sensor->valid)
+            continue;
+
+        if(sensor->needed && !sensor->needed(sensor)){
+            /* wasted now; look again at the longest period and start
+               afresh when it is needed */
+            gEngine->counters.sensorSkips++;
+            sensor->valid = false;
+            sensor->curPeriodMs = sensor->maxPeriodMs;
+        }else if(SampleSensor(sensor)){
+            changed |= 1u << i;
+        }
+        sensor->dueMs = now + sensor->curPeriodMs;
+    }
+
+    ArmSampleTimer(SamplePeriodMs());
+
+    if(changed)
+        RunPolicy(changed);
+}
+
+void OnSensorAttr(EventSource *src, unsigned int events)
+{
+    SensorSource *sensor = (SensorSource *)src->ctx;
+
+    if(SampleSensor(sensor))
+        RunPolicy(1u << (sensor - gEngine->sensors));
+}
+
+/* the uevent socket is the process's: every engine looks at each
+   message for its own devices, and the policy of each runs once on all
+   the message changed for it */
+
+void OnUevent(EventSource *src, unsigned int events)
+{
+    Engine *current = gEngine, *engine;
+    char msg[2048];
+    int len, i;
+
+    for(;;){
+        if((len = LoopRecv(src->fd, msg, sizeof(msg)-1, 0)) <= 0)
+            break;
+        msg[len] = 0;
+        /* first line is "<action>@<devpath>" */
+        for(engine=gEngines;engine;engine=engine->next){
+            gEngine = engine;
+            for(i=0;i<NUM_SENSORS;i++){
+                if(engine->sensors[i].ueventMatch && strstr(msg, engine->sensors[i].ueventMatch)
+                   && SampleSensor(&engine->sensors[i]))
+                    engine->ueventChanged |= 1u << i;
+            }
+            if(strstr(msg, engine->actuators[ACTUATOR_BACKLIGHT].ueventMatch))
+                CheckBacklight();
+        }
+        gEngine = current;
+    }
+
+    for(engine=gEngines;engine;engine=engine->next){
+        if(engine->ueventChanged){
+            gEngine = engine;
+            RunPolicy(engine->ueventChanged);
+            engine->ueventChanged = 0;
+            FlushActuators();
+        }
+    }
+    gEngine = current;
+}
+
+/* act on the sensors whose bit is set in changed: display power, the
+   built-in auto-brightness filter and switch bookkeeping, then the
+   rules */
+
+void RunPolicy(unsigned int changed)
+{
+    long long start = StatStart();
+
+    gEngine->counters.decisions++;
+    if(changed & (1u << SENSOR_DISPLAY_POWER))
+        changed |= UpdateDisplayPower();
+    if(changed & (1u << SENSOR_LIGHT))
+        UpdateBacklight();
+
+    for(unsigned int switches = changed & gSwitchSensors; switches; switches &= switches - 1)
+        UpdateSwitch(&gEngine->sensors[__builtin_ctz(switches)]);
+
+    if(gEngine->config)
+        RunRules(gEngine->config, changed);
+
+    StatStop(PS_STAT_POLICY, start);
+}
+
+/**************************************************************************/
+/***************************************************************************
+
+   UpdateBacklight
+
+    Feed the latest light sample through the auto-brightness filter and
+   ramp to the resulting level if it passes the hysteresis check. While a
+   ramp is running the check is made against where it is heading. The
+   first sample after the panel comes on or the system resumes is
+   written at once.
+
+    Returns: none
+
+***************************************************************************/
+/**************************************************************************/
+
+void UpdateBacklight(void)
+{
+    SensorSource *light = &gEngine->sensors[SENSOR_LIGHT];
+    ActuatorSink *regulator = &gEngine->actuators[ACTUATOR_BACKLIGHT];
+
+    if(!gEngine->autoLightOn || !light->valid || regulator->value < 0)
+        return;
+
+    int curBrightness = RampTarget(&gEngine->backlightRamp);
+    LuxFilter *filter = &gEngine->luxFilter;
+
+    if(curBrightness > 0){
+        int lux = FilterLux(filter, light->value);
+        int calcBrightness = LookupBrightness(filter, lux);
+        long long now = NowMs();
+
+        if(gEngine->lightWake){
+            /* the first sample since the panel came on: go straight to
+               the level, so the first frame is right */
+            gEngine->lightWake = false;
+            StopRamp(&gEngine->backlightRamp);
+            filter->lastWriteMs = now;
+            QueueActuator(regulator, calcBrightness);
+        }else if(PassesHysteresis(filter, curBrightness, calcBrightness, now)){
+            /* timed to the first write of the ramp, unless an earlier
+               sample already started one that hasn't written yet */
+            if(!gEngine->backlightEventNs)
+                gEngine->backlightEventNs = gWakeNs;
+            if(StartRamp(&gEngine->backlightRamp, calcBrightness) == 0)
+                filter->lastWriteMs = now;
+            if(!gEngine->backlightRamp.active)
+                gEngine->backlightEventNs = 0;
+        }
+    }
+}
+
+/**************************************************************************/
+/***************************************************************************
+
+   Auto-brightness filter
+
+    Raw lux samples go through three stages before they reach the
+   regulator:
+
+   1. a median over the last medianWindow samples, which rejects single
+      sample spikes such as a flickering lamp or a hand passing over the
+      sensor
+   2. an exponential moving average with separate weights for rising and
+      falling light, so the screen brightens quickly and dims slowly
+   3. a piecewise-linear transfer curve from lux to backlight level
+
+   The result is only written when it differs from the current level by
+   more than riseThreshold (brightening) or fallThreshold (dimming), and
+   no more often than once per minWriteIntervalMs. The light sensor can
+   therefore be sampled faster than the regulator is written.
+
+***************************************************************************/
+/**************************************************************************/
+
+void ResetLuxFilter(LuxFilter *filter)
+{
+    filter->windowHead = 0;
+    filter->windowCount = 0;
+    filter->smoothed = 0;
+    filter->primed = false;
+    filter->lastWriteMs = 0;
+}
+
+/* add a sample and return the filtered lux */
+
+int FilterLux(LuxFilter *filter, int lux)
+{
+    int sorted[gMaxMedianWindow];
+    int i, j, n, median, weight;
+
+    filter->window[filter->windowHead] = lux;
+    filter->windowHead = (filter->windowHead + 1) % filter->medianWindow;
+    if(filter->windowCount < filter->medianWindow)
+        filter->windowCount++;
+
+    /* insertion sort, the window is tiny */
+    n = filter->windowCount;
+    for(i=0;i<n;i++){
+        int v = filter->window[i];
+        for(j=i;j>0 && sorted[j-1]>v;j--)
+            sorted[j] = sorted[j-1];
+        sorted[j] = v;
+    }
+    median = sorted[n/2];
+
+    if(!filter->primed){
+        filter->smoothed = median << 8;
+        filter->primed = true;
+    }else{
+        weight = (median << 8) > filter->smoothed ? filter->riseWeight
+                                                  : filter->fallWeight;
+        filter->smoothed += (int)(((long long)(median << 8) - filter->smoothed)
+                                  * weight >> 8);
+    }
+
+    return (filter->smoothed + 128) >> 8;
+}
+
+/* map lux to a backlight level by linear interpolation between curve
+   points, which must be sorted by lux. Beyond either end the curve is
+   flat */
+
+constexpr int LookupCurve(const CurvePoint *curve, int numPoints, int lux)
+{
+    int i = 0;
+
+    if(lux <= curve[0].lux)
+        return curve[0].level;
+
+    for(i=1;i<numPoints;i++){
+        if(lux < curve[i].lux){
+            const CurvePoint *a = &curve[i-1], *b = &curve[i];
+            return a->level + (b->level - a->level)*(lux - a->lux)/(b->lux - a->lux);
+        }
+    }
+
+    return curve[numPoints-1].level;
+}
+
+/**************************************************************************/
+/***************************************************************************
+
+   Hardware profiles
+
+    The usual build reads its devices, curve and everything else from
+   the configuration. A build for one board fixes what that board never
+   changes, and the compiler works from it. What each build fixes is the
+   HardwareProfile<> specialisation for its PS_PROFILE, which the code
+   reaches as BuildProfile, and each profile is a binary of its own.
+   There is no makefile; the binaries are built with
+
+   g++ -O2 -o prime-sensors prime-sensors.cpp -lpthread
+   g++ -O2 -DPS_PROFILE=PS_PROFILE_TEGRA -o prime-sensors-tegra \
+       prime-sensors.cpp -lpthread
+
+   and each names its profile in its "ready" log line and in "bench
+   profile". In a board build
+
+    - the profile's curve is the default curve. As long as the
+      configuration does not replace it, lux is turned into a level by
+      indexing gProfileTable, which the compiler fills in from the
+      curve.
+
+    - ParseSample calls each sensor's parser from gSensorParsers, the
+      table gSensorTable is filled in from, so the calls are direct and the
+      compiler can inline them, rather than through each sensor's parse.
+
+    - what the board's kernel lacks, such as io_uring, is left out. This
+      one still takes the preprocessor, at the top of the file, as the
+      code that uses it must not be compiled at all.
+
+   Everything else, device paths included, can still be set in the
+   configuration. "bench profile" compares two builds.
+
+    A board build is smaller, and its curve and parsers are fixed; it is
+   not faster. The loop itself, sampling, policy and actuator writes, is
+   the same runtime loop in every build, and is not generated from the
+   profile's sensors and actuators. A tick is about three system calls,
+   some 5 us on the machine it was measured on, while a light sample
+   from its text to the write decision, the part a profile could
+   specialise, is some 25 ns in either build. Unrolling the loop over a
+   fixed sensor list would save a few branches of that, far inside what
+   one run of "bench profile" differs from the next.
+
+***************************************************************************/
+/**************************************************************************/
+
+/* a profile with a fixed curve gets a table made from it; the others
+   get a table of one level that is never used */
+
+int const               gProfileTableSize = BuildProfile::fixedCurve ?
+                            BuildProfile::curve[BuildProfile::curvePoints-1].lux + 1 : 1;
+
+struct ProfileTable
+{
+    unsigned short      level[gProfileTableSize];
+};
+
+constexpr ProfileTable MakeProfileTable(void)
+{
+    ProfileTable table = {};
+
+    if constexpr(BuildProfile::fixedCurve){
+        for(int lux=0;lux<gProfileTableSize;lux++)
+            table.level[lux] = LookupCurve(BuildProfile::curve, BuildProfile::curvePoints, lux);
+    }
+    return table;
+}
+
+constexpr ProfileTable  gProfileTable = MakeProfileTable();
+
+static_assert(BuildProfile::curvePoints <= gMaxCurvePoints, "the profile curve has too many points");
+static_assert(gProfileTableSize <= 4096, "the profile curve is too long for a table");
+
+/* whether a curve is the one gProfileTable was made from */
+
+bool IsProfileCurve(const CurvePoint *curve, int numPoints)
+{
+    return BuildProfile::fixedCurve && numPoints == BuildProfile::curvePoints &&
+           memcmp(curve, BuildProfile::curve, numPoints*sizeof(CurvePoint)) == 0;
+}
+
+/* the parsers of gSensorTable[Sensor] and on, called straight from
+   gSensorParsers; past the last sensor, through the sensor's pointer */
+
+template<int Sensor>
+int ParseSensorSample(SensorSource *sensor, int len, int *value)
+{
+    if(sensor == &gEngine->sensors[Sensor])
+        return gSensorParsers[Sensor](sensor, sensor->text, len, value);
+    return ParseSensorSample<Sensor + 1>(sensor, len, value);
+}
+
+template<>
+int ParseSensorSample<NUM_SENSORS>(SensorSource *sensor, int len, int *value)
+{
+    return sensor->parse(sensor, sensor->text, len, value);
+}
+
+/* parse what a sensor read, with its parser called directly in a board
+   build */
+
+int ParseSample(SensorSource *sensor, int len, int *value)
+{
+    if(BuildProfile::fixedParsers)
+        return ParseSensorSample<0>(sensor, len, value);
+    return sensor->parse(sensor, sensor->text, len, value);
+}
+
+/* decide whether the target is far enough from the current level, and
+   enough time has passed, to be worth a regulator write */
+
+bool PassesHysteresis(LuxFilter *filter, int current, int target, long long now)
+{
+    if(target > current + filter->riseThreshold ||
+       target < current - filter->fallThreshold)
+        return now - filter->lastWriteMs >= filter->minWriteIntervalMs;
+
+    return false;
+}
+
+/**************************************************************************/
+/***************************************************************************
+
+   Learned curve
+
+    When the backlight level we read back, on a backlight uevent or once
+   per learn.save_interval_ms, is not the one we last wrote, someone set
+   it by hand, and that is taken as the level they want at the current
+   (filtered) lux. Rather than ramp back to the curve, the daemon
+   corrects the curve there so that it gives that level, and keeps the
+   correction.
+
+    Corrections are offsets in levels at gLearnedPoints lux points, lux 0
+   and then every power of two, and are interpolated between them. A
+   setting moves the two points either side of its lux as little as
+   will make the curve pass through it, so one setting at night leaves daylight
+   alone and a repeated setting is learned no further.
+
+    A LearnedCurve is kept in learn.path exactly as it is in memory, in
+   host byte order, tied to the backlight's path by deviceHash. It is
+   mapped private at startup, checked and used where it lies: nothing is
+   parsed. A curve that changes is saved as a whole to a temporary file
+   that is then renamed over the old one, so the file is always either
+   the old curve or the new one, and no more often than once per
+   learn.save_interval_ms, from a timerfd of its own.
+
+***************************************************************************/
+/**************************************************************************/
+
+/* the pair of points lux lies between, and how far along it is, 0..256 */
+
+int LearnedPosition(int lux, int *frac)
+{
+    int point;
+
+    *frac = 0;
+    if(lux <= 0)
+        return 0;
+
+    point = 32 - __builtin_clz(lux);    /* lux is in [2^(point-1), 2^point) */
+    if(point >= gLearnedPoints - 1)
+        return gLearnedPoints - 1;
+
+    *frac = ((lux - (1 << (point - 1))) << 8) >> (point - 1);
+    return point;
+}
+
+int LearnedOffset(const LearnedCurve *curve, int lux)
+{
+    int frac, point = LearnedPosition(lux, &frac);
+
+    if(point == gLearnedPoints - 1)
+        return curve->offset[point];
+    return (curve->offset[point]*(256 - frac) + curve->offset[point+1]*frac) / 256;
+}
+
+/* the filter's curve with what has been learned */
+
+int LookupBrightness(LuxFilter *filter, int lux)
+{
+    int level = lux >= 0 && lux < filter->tableSize ? filter->table[lux]
+              : LookupCurve(filter->curve, filter->curvePoints, lux);
+
+    if(!filter->learned)
+        return level;
+
+    level += LearnedOffset(filter->learned, lux);
+    if(level < gDisplayMinBrightness)
+        return gDisplayMinBrightness;
+    if(level > gDisplayMaxBrightness)
+        return gDisplayMaxBrightness;
+    return level;
+}
+
+int ClampOffset(int offset)
+{
+    if(offset < -gDisplayMaxBrightness)
+        return -gDisplayMaxBrightness;
+    if(offset > gDisplayMaxBrightness)
+        return gDisplayMaxBrightness;
+    return offset;
+}
+
+/* the user set level at the current lux: bend the curve through it.
+   With weights a and b on the two points, moving them by err*a and
+   err*b over a*a + b*b moves the curve at lux by exactly err, and is
+   the smallest move that does, so settings at different lux converge
+   rather than undo each other */
+
+void LearnOverride(LuxFilter *filter, int level)
+{
+    LearnedCurve *curve = filter->learned;
+    int lux, err, frac, point, a, b;
+
+    if(!curve || !filter->primed)
+        return;
+
+    lux = (filter->smoothed + 128) >> 8;
+    err = level - LookupBrightness(filter, lux);
+    point = LearnedPosition(lux, &frac);
+    a = 256 - frac;
+    b = point == gLearnedPoints - 1 ? 0 : frac;
+
+    curve->offset[point] = ClampOffset(curve->offset[point] + err*256*a/(a*a + b*b));
+    if(b)
+        curve->offset[point+1] = ClampOffset(curve->offset[point+1] + err*256*b/(a*a + b*b));
+    curve->overrides++;
+    gEngine->counters.overrides++;
+
+    /* don't fight the user over the sample that is already under way */
+    filter->lastWriteMs = NowMs();
+    LogMessage(LOG_INFO,"backlight set to %d at %d lux, curve corrected by %d",
+               level, lux, err);
+
+    ScheduleCurveSave(&gEngine->curveStore);
+}
+
+/**************************************************************************/
+/***************************************************************************
+
+   OpenCurveStore
+
+    Load the learned curve for a backlight, or start a blank one.
+
+    Inputs:
+
+   store		 I/O				  the store, closed
+
+   path			 I					  the curve file, "" to keep the
+                                          curve in memory only
+
+   device		 I					  the backlight's sysfs path. A
+                                          file learned on another one is
+                                          not used
+
+    Returns:
+
+    0, or -1 if the file could not be read. The store is open, with a
+   blank curve, either way
+
+***************************************************************************/
+/**************************************************************************/
+
+int OpenCurveStore(CurveStore *store, const char *path, const char *device)
+{
+    LearnedCurve *blank = &store->blank;
+    struct stat st;
+    void *map = MAP_FAILED;
+    int fd;
+
+    memset(blank, 0, sizeof(*blank));
+    blank->magic = gLearnedMagic;
+    blank->version = gLearnedVersion;
+    blank->numPoints = gLearnedPoints;
+    blank->deviceHash = HashSwitchName(device, strlen(device));
+
+    store->curve = blank;
+    store->mapSize = 0;
+    store->dirty = false;
+    store->armed = false;
+    store->savedMs = 0;
+    store->event.fd = -1;
+    snprintf(store->path, sizeof(store->path), "%s", path);
+
+    if(!path[0])
+        return 0;
+
+    store->event.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+    store->event.handler = OnCurveSaveTimer;
+    store->event.ctx = store;
+    WatchEventSource(&store->event, EPOLLIN);
+
+    fd = open(path, O_RDONLY|O_CLOEXEC);
+    if(fd < 0){
+        if(errno == ENOENT)
+            return 0;
+        LogMessage(LOG_INFO,"can't open learned curve %s, errno=%d", path, errno);
+        return -1;
+    }
+    if(fstat(fd, &st) == 0 && st.st_size == sizeof(LearnedCurve))
+        map = mmap(0, sizeof(LearnedCurve), PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if(map == MAP_FAILED){
+        LogMessage(LOG_INFO,"ignoring learned curve %s: wrong size", path);
+        return -1;
+    }
+
+    LearnedCurve *curve = (LearnedCurve *)map;
+    if(curve->magic != gLearnedMagic || curve->version != gLearnedVersion ||
+       curve->numPoints != gLearnedPoints || curve->deviceHash != blank->deviceHash){
+        LogMessage(LOG_INFO,"ignoring learned curve %s: another version or backlight", path);
+        munmap(map, sizeof(LearnedCurve));
+        return -1;
+    }
+
+    store->curve = curve;
+    store->mapSize = sizeof(LearnedCurve);
+    LogMessage(LOG_INFO,"learned curve %s: %u settings", path, curve->overrides);
+    return 0;
+}
+
+/* save anything not yet saved and close the store */
+
+void CloseCurveStore(CurveStore *store)
+{
+    if(!store->curve)
+        return;
+
+    if(store->dirty)
+        SaveCurveStore(store);
+    if(store->mapSize)
+        munmap(store->curve, store->mapSize);
+    if(store->event.fd >= 0)
+        close(store->event.fd);
+    store->event.fd = -1;
+    store->curve = 0;
+    store->mapSize = 0;
+}
+
+/* write the curve to path.tmp and rename it over path. The temporary
+   file is always a new one, so a link left in its place is never
+   followed, and the directory is synced after the rename so that the
+   new name survives a power cut as well as the data */
+
+int SaveCurveStore(CurveStore *store)
+{
+    char tmp[gMaxPathLen + 8], dir[gMaxPathLen];
+    const char *slash;
+    bool ok;
+    int fd;
+
+    store->dirty = false;
+    store->savedMs = NowMs();
+    if(!store->path[0])
+        return 0;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", store->path);
+    unlink(tmp);    /* left by a save that was cut short */
+    fd = open(tmp, O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW|O_CLOEXEC, 0644);
+    ok = fd >= 0 && write(fd, store->curve, sizeof(LearnedCurve)) == sizeof(LearnedCurve) &&
+         fsync(fd) == 0;
+    if(fd >= 0)
+        close(fd);
+
+    if(!ok || rename(tmp, store->path) < 0){
+        LogMessage(LOG_INFO,"can't save learned curve %s, errno=%d",
+                   store->path, errno);
+        if(fd >= 0)
+            unlink(tmp);
+        return -1;
+    }
+
+    slash = strrchr(store->path, '/');
+    snprintf(dir, sizeof(dir), "%.*s", slash ? (int)(slash - store->path) + 1 : 1,
+             slash ? store->path : ".");
+    fd = open(dir, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if(fd < 0 || fsync(fd) < 0)
+        LogMessage(LOG_INFO,"learned curve %s: can't sync %s, errno=%d",
+                   store->path, dir, errno);
+    if(fd >= 0)
+        close(fd);
+    return 0;
+}
+
+/* save the curve now if the last save was long enough ago, or else
+   when it will have been */
+
+void ScheduleCurveSave(CurveStore *store)
+{
+    struct itimerspec its;
+    long long wait;
+
+    store->dirty = true;
+    if(!store->path[0] || store->armed)
+        return;
+
+    wait = store->savedMs + store->saveIntervalMs - NowMs();
+    if(store->savedMs == 0 || wait <= 0){
+        SaveCurveStore(store);
+        return;
+    }
+
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = wait / 1000;
+    its.it_value.tv_nsec = (wait % 1000) * 1000000;
+    if(LoopTimerSettime(store->event.fd, &its) == 0)
+        store->armed = true;
+}
+
+void OnCurveSaveTimer(EventSource *src, unsigned int events)
+{
+    CurveStore *store = (CurveStore *)src->ctx;
+    unsigned long long expirations;
+
+    LoopRead(src->fd, &expirations, sizeof(expirations));
+    store->armed = false;
+    if(store->dirty)
+        SaveCurveStore(store);
+}
+
+/**************************************************************************/
+/***************************************************************************
+
+   Brightness ramps
+
+    Instead of jumping to a new level, the backlight is moved there over
+   durationMs in frames of frameMs, driven by a timerfd of its own. The
+   timer is only armed while a ramp is running, so an idle daemon takes
+   no extra wakeups, and frames are ordinary events in the main loop, so
+   jack changes are still handled while a ramp is in progress. Starting
+   a new ramp takes over from whatever level the current one reached.
+
+***************************************************************************/
+/**************************************************************************/
+
+int OpenRamp(BrightnessRamp *ramp, ActuatorSink *sink)
+{
+    ramp->sink = sink;
+    ramp->active = false;
+    ramp->event.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+    ramp->event.handler = OnRampFrame;
+    ramp->event.ctx = ramp;
+
+    if(ramp->event.fd < 0)
+        return -1;
+
+    return WatchEventSource(&ramp->event, EPOLLIN);
+}
+
+void CloseRamp(BrightnessRamp *ramp)
+{
+    if(ramp->event.fd >= 0)
+        close(ramp->event.fd);
+    ramp->event.fd = -1;
+    ramp->active = false;
+}
+
+/* arm (frameMs > 0) or disarm (0) the frame timer */
+
+int SetRampTimer(BrightnessRamp *ramp, int frameMs)
+{
+    struct itimerspec spec;
+
+    spec.it_interval.tv_sec = frameMs/1000;
+    spec.it_interval.tv_nsec = (frameMs%1000)*1000000L;
+    spec.it_value = spec.it_interval;
+
+    return LoopTimerSettime(ramp->event.fd, &spec);
+}
+
+/* the level a running ramp is heading for, or the current level */
+
+int RampTarget(BrightnessRamp *ramp)
+{
+    return ramp->active ? ramp->to : ActuatorLevel(ramp->sink);
+}
+
+/**************************************************************************/
+/***************************************************************************
+
+   StartRamp
+
+    Move the sink towards a new level. A ramp that is already running is
+   retargeted from the level it has reached.
+
+    Inputs:
+
+   ramp			 I					  the ramp to start
+
+   target		 I					  the level to end at
+
+    Returns:
+
+    status code indicating success - 0 = success
+
+***************************************************************************/
+/**************************************************************************/
+
+int StartRamp(BrightnessRamp *ramp, int target)
+{
+    ActuatorSink *sink = ramp->sink;
+
+    if(sink->value < 0 || ramp->durationMs <= 0 || ramp->event.fd < 0){
+        StopRamp(ramp);
+        return QueueActuator(sink, target);
+    }
+
+    if(ActuatorLevel(sink) == target){
+        StopRamp(ramp);
+        return QueueActuator(sink, target);
+    }
+
+    ramp->from = ActuatorLevel(sink);
+    ramp->to = target;
+    ramp->startMs = NowMs();
+
+    if(!ramp->active){
+        if(SetRampTimer(ramp, ramp->frameMs) < 0)
+            return QueueActuator(sink, target);
+        ramp->active = true;
+    }
+
+    return 0;
+}
+
+void StopRamp(BrightnessRamp *ramp)
+{
+    if(ramp->active)
+        SetRampTimer(ramp, 0);
+    ramp->active = false;
+}
+
+void OnRampFrame(EventSource *src, unsigned int events)
+{
+    BrightnessRamp *ramp = (BrightnessRamp *)src->ctx;
+    unsigned long long expirations;
+    long long elapsed;
+    int level;
+
+    LoopRead(src->fd, &expirations, sizeof(expirations));
+
+    if(!ramp->active)
+        return;
+
+    elapsed = NowMs() - ramp->startMs;
+    if(elapsed >= ramp->durationMs){
+        level = ramp->to;
+        StopRamp(ramp);
+    }else{
+        level = ramp->from + (int)((ramp->to - ramp->from)*elapsed/ramp->durationMs);
+    }
+
+    QueueActuator(ramp->sink, level);
+}
+
+/**************************************************************************/
+/***************************************************************************
+
+   Switch states
+
+    Switch class devices report what is plugged in as a device specific
+   number in their "state" attribute, and some as text in "name" ("No
+   Device", "Headset"). Only a driver with a print_name callback does
+   the latter; for the rest "name" reads the device's own name, "h2w" or
+   "hdmi", plugged in or not, so the built-in sensors all read "state"
+   and the device names are deliberately not in the table. The parsers
+   turn either into a PS_SWITCH_* state,
+   so from then on a switch is compared and dispatched as an integer
+   like any other sensor. Names are looked up in gSwitchNames through
+   gSwitchNameTable, a perfect hash the compiler builds: it tries
+   multipliers until one sends the hash of every name to a slot of its
+   own, and the build fails if none does. A lookup is one hash of the
+   text, one slot and at most one memcmp. A name that isn't in the table
+   is not a valid sample, rather than being taken for "plugged in".
+
+    UpdateSwitch then passes on only real transitions, each as a
+   PS_RECORD_SWITCH record with the old and the new state, and hands
+   the headset jack on to UpdateAudioJack. Where audio goes from there
+   is up to the rules, which run next.
+
+***************************************************************************/
+/**************************************************************************/
+
+struct SwitchName
+{
+    const char          *text;
+    int                 state;
+};
+
+constexpr SwitchName    gSwitchNames[] =
+{
+    { "No Device", PS_SWITCH_NONE },
+    { "None", PS_SWITCH_NONE },
+    { "Headset", PS_SWITCH_HEADSET },
+    { "Headphone", PS_SWITCH_HEADPHONE },
+    { "Headphones", PS_SWITCH_HEADPHONE },
+    { "HDMI", PS_SWITCH_HDMI },
+    { "Desk", PS_SWITCH_DESK_DOCK },
+    { "Car", PS_SWITCH_CAR_DOCK },
+};
+
+const char *const       gSwitchStateNames[PS_NUM_SWITCH_STATES] =
+{
+    "none", "headset", "headphone", "hdmi", "desk dock", "car dock"
+};
+
+int const               gNumSwitchNames = sizeof(gSwitchNames)/sizeof(gSwitchNames[0]);
+int const               gSwitchNameBits = 5;         /* 32 slots */
+
+struct SwitchNameTable
+{
+    unsigned int        seed;               /* the multiplier, 0 = none found */
+    unsigned char       slots[1 << gSwitchNameBits];  /* gSwitchNames index + 1 */
+    unsigned char       lengths[gNumSwitchNames];
+};
+
+constexpr unsigned int HashSwitchName(const char *text, int len)
+{
+    unsigned int hash = 2166136261u; /* FNV-1a */
+
+    while(len-- > 0)
+        hash = (hash ^ (unsigned char)*text++)*16777619u;
+    return hash;
+}
+
+/* the top bits of the hash times the multiplier. Masking off the low
+   bits won't do: "HDMI" and the device name "hdmi" share them */
+
+constexpr unsigned int SwitchNameSlot(unsigned int hash, unsigned int seed)
+{
+    return hash*seed >> (32 - gSwitchNameBits);
+}
+
+/* try odd multipliers from the golden ratio up until every name has a
+   slot of its own. Evaluated by the compiler */
+
+constexpr SwitchNameTable MakeSwitchNameTable(void)
+{
+    for(unsigned int seed = 2654435769u; seed < 2654435769u + 4096; seed += 2){
+        SwitchNameTable table = {};
+        bool clash = false;
+
+        for(int i=0;i<gNumSwitchNames && !clash;i++){
+            int len = 0;
+
+            while(gSwitchNames[i].text[len])
+                len++;
+            unsigned int slot = SwitchNameSlot(HashSwitchName(gSwitchNames[i].text, len), seed);
+            clash = table.slots[slot] != 0;
+            table.slots[slot] = i + 1;
+            table.lengths[i] = len;
+        }
+        if(!clash){
+            table.seed = seed;
+            return table;
+        }
+    }
+    return SwitchNameTable {};
+}
+
+constexpr SwitchNameTable gSwitchNameTable = MakeSwitchNameTable();
+
+static_assert(gSwitchNameTable.seed != 0,
+              "no multiplier gives every switch name a slot of its own: "
+              "raise gSwitchNameBits");
+
+/* the PS_SWITCH_* state for a name, or -1 if it isn't known */
+
+int LookupSwitchName(const char *text, int len)
+{
+    int i = gSwitchNameTable.slots[SwitchNameSlot(HashSwitchName(text, len),
+                                                  gSwitchNameTable.seed)] - 1;
+
+    if(i < 0 || gSwitchNameTable.lengths[i] != len ||
+       memcmp(gSwitchNames[i].text, text, len) != 0)
+        return -1;
+    return gSwitchNames[i].state;
+}
+
+void UpdateSwitch(SensorSource *sensor)
+{
+    int i = sensor - gEngine->sensors, from = gEngine->switchStates[i], to = sensor->value;
+
+    if(!sensor->valid || to == from)
+        return;
+
+    gEngine->switchStates[i] = to;
+    RecordTelemetry(&gEngine->telemetry, PS_RECORD_SWITCH, i, to, from);
+    LogMessage(LOG_INFO, "%s: %s -> %s", sensor->name,
+               gSwitchStateNames[from], gSwitchStateNames[to]);
+
+    if(i == SENSOR_AUDIO_JACK)
+        UpdateAudioJack();
+}
+
+/* note whether the headset jack is plugged, whatever into */
+
+void UpdateAudioJack(void)
+{
+    bool plugged = gEngine->switchStates[SENSOR_AUDIO_JACK] != PS_SWITCH_NONE;
+
+    if(plugged == gEngine->audioJackPlugged)
+        return;
+
+    gEngine->audioJackPlugged = plugged;
+    RecordTelemetry(&gEngine->telemetry, PS_RECORD_JACK, SENSOR_AUDIO_JACK, plugged, 0);
+
+    /* timed to when the mixer is switched */
+    gEngine->jackEventNs = gWakeNs;
+}
+
+/* switch the mixer to the headphone or the speaker, as chosen by a
+   client override or else by the rules. The output being switched off
+   always goes first, so the two are never on together */
+
+int ApplyAudioRoute(void)
+{
+    static const MixerSwitch toSpeaker[] =
+        { { MIXER_HEADPHONE, false }, { MIXER_INT_SPK, true } };
+    static const MixerSwitch toHeadphone[] =
+        { { MIXER_INT_SPK, false }, { MIXER_HEADPHONE, true } };
+    int route;
+
+    if(gEngine->audioRouteOverride != PS_AUDIO_AUTO)
+        route = gEngine->audioRouteOverride;
+    else
+        route = gEngine->audioAutoRoute;
+
+    if(route == gEngine->audioRoute)
+        return 0;
+    gEngine->audioRoute = route;
+    RecordTelemetry(&gEngine->telemetry, PS_RECORD_AUDIO_ROUTE, 0, route, gEngine->audioRouteOverride);
+
+    if(!gEngine->mixer)
+        return -1;
+
+    const MixerSwitch *switches = route == PS_AUDIO_HEADPHONE ? toHeadphone : toSpeaker;
+    for(int i=0;i<2;i++)
+        QueueMixerSwitch(switches[i].element, switches[i].on);
+    return 0;
+}
+
+/* read the backlight level back, in case something other than us has
+   set it. A level that differs from what we wrote, and isn't the screen
+   going off or on, was set by the user. Called for the uevent a write to
+   the backlight raises, ours included, and at the latest once per
+   learn.save_interval_ms, since not every driver raises one */
+
+void CheckBacklight(void)
+{
+    ActuatorSink *sink = &gEngine->actuators[ACTUATOR_BACKLIGHT];
+    int written = sink->value;
+
+    if(gEngine->backlightRamp.active || sink->writing || sink->queued)
+        return;
+
+    RefreshActuator(sink);
+    if(written > 0 && sink->value > 0 && sink->value != written)
+        LearnOverride(&gEngine->luxFilter, sink->value);
+}
+
+/* gate for the light sensor: its samples are no use while the backlight
+   is off. That is decided from the panel power and the level we last
+   wrote or read back, without touching the backlight */
+
+bool BacklightLit(SensorSource *sensor)
+{
+    ActuatorSink *sink = &gEngine->actuators[ACTUATOR_BACKLIGHT];
+
+    if(NowMs() - sink->checkedMs >= gEngine->curveStore.saveIntervalMs)
+        CheckBacklight();
+    return gEngine->displayOn && sink->value != 0;
+}
+
+/* turn automatic backlight control on or off. The light sensor is not
+   sampled at all while it is off */
+
+void SetAutoLight(bool on)
+{
+    if(on == gEngine->autoLightOn)
+        return;
+
+    gEngine->autoLightOn = on;
+    LogMessage(LOG_INFO,"auto light %s",gEngine->autoLightOn?"on":"off");
+    SetLightSampling();
+}
+
+/* the light sensor is sampled while auto light is on and the panel is
+   powered, and only then */
+
+void SetLightSampling(void)
+{
+    SensorSource *light = &gEngine->sensors[SENSOR_LIGHT];
+    bool on = gEngine->autoLightOn && gEngine->displayOn;
+
+    if(on == light->enabled)
+        return;
+
+    SetSensorEnabled(light, on);
+    ResetLuxFilter(&gEngine->luxFilter);
+    RescheduleSampling();
+}
+
+/**************************************************************************/
+/***************************************************************************
+
+   Display power
+
+    bl_power holds the panel's FB_BLANK_* state: 0 while it is lit,
+   anything else while it is blanked or powered down. A blanked panel
+   usually keeps its brightness, so the backlight level alone doesn't
+   show it. The attribute doesn't notify, so the display-power sensor is
+   polled, backing off while it is stable, and also read on any uevent
+   from the backlight class, which is what most unblank paths send when
+   they restore the level.
+
+    While the panel is off the light sensor is disabled, as it is with
+   auto light off: no reads, no sample timer for it, no ramp. When it
+   comes back the light sensor is read at once and its first sample goes
+   straight to the regulator, without a ramp or the hysteresis check.
+
+    A system suspend stops everything, and CLOCK_MONOTONIC with it, but
+   CLOCK_BOOTTIME runs on. The sample timer is a CLOCK_BOOTTIME timer, so
+   it fires as soon as we resume, and CheckResume sees the gap between
+   the two clocks grow. Every sensor is then read afresh in the same
+   tick, since anything may have changed while we slept.
+
+***************************************************************************/
+/**************************************************************************/
+
+/* act on a new display-power sample. Returns the bits of the sensors
+   read because of it, for RunPolicy to act on as well */
+
+unsigned int UpdateDisplayPower(void)
+{
+    SensorSource *power = &gEngine->sensors[SENSOR_DISPLAY_POWER];
+    SensorSource *light = &gEngine->sensors[SENSOR_LIGHT];
+    bool on = power->valid ? power->value == 0 : true;
+
+    if(on == gEngine->displayOn)
+        return 0;
+
+    gEngine->displayOn = on;
+    LogMessage(LOG_INFO,"display %s",on?"on":"off");
+
+    if(!on){
+        StopRamp(&gEngine->backlightRamp);
+        gEngine->backlightEventNs = 0;
+        gEngine->lightWake = false;
+        SetLightSampling();
+        return 0;
+    }
+
+    SetLightSampling();
+    if(!light->enabled)
+        return 0;
+    gEngine->lightWake = true;
+    light->dueMs = NowMs() + light->curPeriodMs;
+    return SampleSensor(light) ? 1u << SENSOR_LIGHT : 0;
+}
+
+long long SuspendedMs(void)
+{
+    struct timespec boot, mono;
+
+    clock_gettime(CLOCK_BOOTTIME, &boot);
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    return (boot.tv_sec - mono.tv_sec)*1000LL + (boot.tv_nsec - mono.tv_nsec)/1000000;
+}
+
+/* called when the sample timer fires: if we have been suspended since
+   the last time, make every sensor due now */
+
+void CheckResume(void)
+{
+    long long suspended = SuspendedMs(), asleepMs = suspended - gEngine->suspendedMs;
+    int i;
+
+    gEngine->suspendedMs = suspended;
+    if(asleepMs < gResumeMinMs)
+        return;
+
+    LogMessage(LOG_INFO,"resumed after %lld ms suspended", asleepMs);
+    for(i=0;i<NUM_SENSORS;i++){
+        SensorSource *sensor = &gEngine->sensors[i];
+
+        if(!sensor->enabled)
+            continue;
+        sensor->valid = false;  /* read uevent sensors too */
+        sensor->dueMs = 0;
+        sensor->curPeriodMs = sensor->periodMs;
+    }
+
+    if(gEngine->sensors[SENSOR_LIGHT].enabled){
+        ResetLuxFilter(&gEngine->luxFilter);
+        gEngine->lightWake = true;
+    }
+}
+
+/**************************************************************************/
+/***************************************************************************
+
+   Rules
+
+    What the daemon does when a sensor changes, beyond the auto-brightness
+   filter, is given by rules in the configuration, one per "rule" line:
+
+   rule = when <sensor> <op> <value> set <target> <value>
+
+   sensor   a gSensorTable name
+   op       == != < <= > >=, comparing the sensor's value with the value
+            after it. A quoted value is read the way the sensor's own
+            attribute is, so "when audio-jack != 'No Device'" compares
+            with what "No Device" stands for
+   target   audio speaker|headphone    route audio unless a client has
+                                       overridden it
+            mixer '<element>' on|off   switch a gEngine->mixerElements element
+            <actuator> <level>         set a gEngine->actuators level, ramped for
+                                       the backlight
+            auto-light on|off
+
+    The rules in a file replace the built-in gDefaultRules. LoadConfig
+   compiles them into a table ordered by sensor, with firstRule giving
+   where each sensor's rules start, so a change of one sensor only looks
+   at the rules that depend on it and no rule text is touched after
+   loading. Rules for the same sensor run in file order, so the last one
+   that matches wins.
+
+***************************************************************************/
+/**************************************************************************/
+
+/* read one word, or a string in single or double quotes, from a rule.
+   Returns where it ends, or 0 if there is none or it is too long */
+
+const char *RuleWord(const char *p, char *word, int size, bool *quoted)
+{
+    const char *start, *end;
+
+    while(*p == ' ' || *p == '\t')
+        p++;
+
+    *quoted = *p == '\'' || *p == '"';
+    if(*quoted){
+        start = p + 1;
+        if(!(end = strchr(start, *p)))
+            return 0;
+    }else{
+        start = p;
+        end = p + strcspn(p, " \t");
+        if(end == start)
+            return 0;
+    }
+
+    if(end - start >= size)
+        return 0;
+    memcpy(word, start, end - start);
+    word[end - start] = 0;
+
+    return *quoted ? end + 1 : end;
+}
+
+/**************************************************************************/
+/***************************************************************************
+
+   ParseRule
+
+    Compile the text of one rule and add it to a snapshot. The first rule
+   added to a snapshot drops the built-in ones. CompileRules must be
+   called once they are all in.
+
+    Inputs:
+
+   config		 I/O				  the snapshot
+
+   text			 I					  "when <sensor> <op> <value> set
+                                          <target> <value>"
+
+   err			 O					  a description of the error
+
+   errLen		 I					  the size of err
+
+    Returns:
+
+    status code indicating success - 0 = success
+
+***************************************************************************/
+/**************************************************************************/
+
+int ParseRule(Config *config, const char *text, char *err, int errLen)
+{
+    static const char *const ops[] = { "==", "!=", "<", "<=", ">", ">=" };
+    char word[gMaxPathLen];
+    const char *p = text;
+    bool quoted;
+    Rule rule;
+    int i;
+
+    memset(&rule, 0, sizeof(rule));
+
+    if(!(p = RuleWord(p, word, sizeof(word), &quoted)) || strcmp(word, "when") != 0){
+        snprintf(err, errLen, "a rule starts with when");
+        return -1;
+    }
+
+    if(!(p = RuleWord(p, word, sizeof(word), &quoted))){
+        snprintf(err, errLen, "rule has no sensor");
+        return -1;
+    }
+    for(i=0;i<NUM_SENSORS && strcmp(gSensorTable[i].name, word) != 0;i++)
+        ;
+    if(i == NUM_SENSORS){
+        snprintf(err, errLen, "no sensor called %s", word);
+        return -1;
+    }
+    rule.sensor = i;
+
+    if(!(p = RuleWord(p, word, sizeof(word), &quoted))){
+        snprintf(err, errLen, "rule has no comparison");
+        return -1;
+    }
+    for(i=0;i<(int)(sizeof(ops)/sizeof(ops[0])) && strcmp(ops[i], word) != 0;i++)
+        ;
+    if(i == (int)(sizeof(ops)/sizeof(ops[0])) || quoted){
+        snprintf(err, errLen, "%s is not one of == != < <= > >=", word);
+        return -1;
+    }
+    rule.op = i;
+
+    /* a quoted value goes through the sensor's parser, once, here */
+    if(!(p = RuleWord(p, word, sizeof(word), &quoted)) ||
+       (quoted ? gEngine->sensors[rule.sensor].parse(&gEngine->sensors[rule.sensor], word,
+                                             strlen(word), &rule.operand)
+               : ParseDecimal(word, strlen(word), &rule.operand)) < 0){
+        snprintf(err, errLen, "rule needs a number or a quoted %s reading",
+                 gEngine->sensors[rule.sensor].name);
+        return -1;
+    }
+
+    if(!(p = RuleWord(p, word, sizeof(word), &quoted)) || strcmp(word, "set") != 0){
+        snprintf(err, errLen, "expected set after the condition");
+        return -1;
+    }
+
+    if(!(p = RuleWord(p, word, sizeof(word), &quoted))){
+        snprintf(err, errLen, "rule sets nothing");
+        return -1;
+    }
+    if(strcmp(word, "audio") == 0){
+        rule.action = RULE_SET_AUDIO;
+    }else if(strcmp(word, "auto-light") == 0){
+        rule.action = RULE_SET_AUTO_LIGHT;
+    }else if(strcmp(word, "mixer") == 0){
+        rule.action = RULE_SET_MIXER;
+        if(!(p = RuleWord(p, word, sizeof(word), &quoted))){
+            snprintf(err, errLen, "rule names no mixer element");
+            return -1;
+        }
+        for(i=0;i<NUM_MIXER_ELEMENTS && strcmp(gEngine->mixerElements[i].name, word) != 0;i++)
+            ;
+        if(i == NUM_MIXER_ELEMENTS){
+            snprintf(err, errLen, "no mixer element called %s", word);
+            return -1;
+        }
+        rule.target = i;
+    }else{
+        rule.action = RULE_SET_ACTUATOR;
+        for(i=0;i<NUM_ACTUATORS && strcmp(gActuatorTable[i].name, word) != 0;i++)
+            ;
+        if(i == NUM_ACTUATORS){
+            snprintf(err, errLen, "can't set %s", word);
+            return -1;
+        }
+        rule.target = i;
+    }
+
+    if(!(p = RuleWord(p, word, sizeof(word), &quoted))){
+        snprintf(err, errLen, "rule sets no value");
+        return -1;
+    }
+    switch(rule.action){
+        case RULE_SET_AUDIO:
+            rule.value = !strcmp(word, "headphone") ? PS_AUDIO_HEADPHONE :
+                         !strcmp(word, "speaker") ? PS_AUDIO_SPEAKER : -1;
+            break;
+        case RULE_SET_MIXER:
+        case RULE_SET_AUTO_LIGHT:
+            rule.value = !strcmp(word, "on") ? 1 : !strcmp(word, "off") ? 0 : -1;
+            break;
+        case RULE_SET_ACTUATOR:
+            if(ParseDecimal(word, strlen(word), &rule.value) < 0)
+                rule.value = -1;
+            break;
+    }
+    if(rule.value < 0){
+        snprintf(err, errLen, "can't set it to %s", word);
+        return -1;
+    }
+
+    while(*p == ' ' || *p == '\t')
+        p++;
+    if(*p){
+        snprintf(err, errLen, "unexpected %s at the end of the rule", p);
+        return -1;
+    }
+
+    if(!config->fileRules){
+        config->numRules = 0;
+        config->fileRules = true;
+    }
+    if(config->numRules == gMaxRules){
+        snprintf(err, errLen, "more than %d rules", gMaxRules);
+        return -1;
+    }
+    config->rules[config->numRules++] = rule;
+    return 0;
+}
+
+/* order the rules by sensor, keeping the file order within each, and
+   note where each sensor's rules start */
+
+void CompileRules(Config *config)
+{
+    Rule sorted[gMaxRules];
+    int i, sensor, n = 0;
+
+    for(sensor=0;sensor<NUM_SENSORS;sensor++){
+        config->firstRule[sensor] = n;
+        for(i=0;i<config->numRules;i++){
+            if(config->rules[i].sensor == sensor)
+                sorted[n++] = config->rules[i];
+        }
+    }
+    config->firstRule[NUM_SENSORS] = n;
+    memcpy(config->rules, sorted, n*sizeof(Rule));
+}
+
+bool RuleMatches(const Rule *rule, int value)
+{
+    switch(rule->op){
+        case RULE_EQ: return value == rule->operand;
+        case RULE_NE: return value != rule->operand;
+        case RULE_LT: return value < rule->operand;
+        case RULE_LE: return value <= rule->operand;
+        case RULE_GT: return value > rule->operand;
+        case RULE_GE: return value >= rule->operand;
+    }
+    return false;
+}
+
+void DoRule(const Rule *rule)
+{
+    switch(rule->action){
+        case RULE_SET_AUDIO:
+            gEngine->audioAutoRoute = rule->value;
+            ApplyAudioRoute();
+            break;
+
+        case RULE_SET_MIXER:
+            QueueMixerSwitch(rule->target, rule->value != 0);
+            break;
+
+        case RULE_SET_ACTUATOR:
+            if(&gEngine->actuators[rule->target] == gEngine->backlightRamp.sink)
+                StartRamp(&gEngine->backlightRamp, rule->value);
+            else
+                QueueActuator(&gEngine->actuators[rule->target], rule->value);
+            break;
+
+        case RULE_SET_AUTO_LIGHT:
+            SetAutoLight(rule->value != 0);
+            break;
+    }
+}
+
+/* run the rules of each sensor whose bit is set in changed */
+
+void RunRules(const Config *config, unsigned int changed)
+{
+    int i;
+
+    while(changed){
+        int sensor = __builtin_ctz(changed);
+        const SensorSource *source = &gEngine->sensors[sensor];
+
+        changed &= changed - 1;
+        if(!source->valid)
+            continue;
+
+        for(i=config->firstRule[sensor];i<config->firstRule[sensor+1];i++){
+            if(RuleMatches(&config->rules[i], source->value))
+                DoRule(&config->rules[i]);
+        }
+    }
+}
+
+/**************************************************************************/
+/***************************************************************************
+
+   Configuration
+
+    Settings are read from an engine's configFilePath, see "Engines",
+   into a Config snapshot. A snapshot is never changed once it is
+   loaded: SIGHUP loads a new one and ApplyConfig swaps it in from the
+   main loop, between events, then frees the old one. Only sensors, actuators and the mixer whose paths
+   changed (or that could not be opened before) are reopened.
+
+    The file holds one "key = value" setting per line. Blank lines and
+   lines starting with '#' are ignored. Anything not set keeps the
+   built-in default. Keys:
+
+   sensor.<name>.path           sysfs attribute of a gSensorTable entry
+   sensor.<name>.period_ms      its sample period when it can't notify
+   sensor.<name>.max_period_ms  the longest it backs off to while stable
+   sensor.<name>.stable_delta   the change in value that still counts as
+                                stable
+   sensor.<name>.thread         1 = read it on a worker thread, see
+                                "Sensor workers"
+   sensor.<name>.cpu            the CPU to pin its worker to, -1 = any
+   sensor.<name>.timeout_ms     how long a worker read may take before
+                                the sensor counts as hung
+   actuator.<name>.path         sysfs attribute of a gActuatorTable entry
+   filter.median_window         samples in the median, 1..9
+   filter.rise_weight           EMA weight of a rising sample, 1..256
+   filter.fall_weight           EMA weight of a falling sample, 1..256
+   filter.rise_threshold        levels before we brighten
+   filter.fall_threshold        levels before we dim
+   filter.min_write_interval_ms shortest time between two ramps
+   curve                        "lux:level lux:level ...", lux ascending
+   rule                         "when <sensor> <op> <value> set <target>
+                                <value>", one per line, see "Rules"
+   ramp.duration_ms             0 = jump straight to a new level
+   ramp.frame_ms                time between two ramp steps
+   learn.enabled                1 = learn from levels set by the user, see
+                                "Learned curve"
+   learn.path                   where the learned curve is kept, "" = in
+                                memory only
+   learn.save_interval_ms       shortest time between two saves of it, and
+                                longest between two checks of the backlight
+                                level for a change we weren't told of
+   stats.enabled                1 = time the main loop, see "Statistics"
+   mixer.backend                alsa or fake
+   mixer.device                 ALSA control device
+
+***************************************************************************/
+/**************************************************************************/
+
+/* fill in the built-in settings. Called once at startup, before any
+   snapshot has changed the tables */
+
+void DefaultConfig(Config *config)
+{
+    int i;
+
+    memset(config, 0, sizeof(*config));
+
+    for(i=0;i<NUM_SENSORS;i++){
+        snprintf(config->sensorPath[i], gMaxPathLen, "%s", gSensorTable[i].path);
+        config->sensorPeriodMs[i] = gEngine->sensors[i].periodMs;
+        config->sensorMaxPeriodMs[i] = gEngine->sensors[i].maxPeriodMs;
+        config->sensorStableDelta[i] = gEngine->sensors[i].stableDelta;
+        config->sensorThread[i] = gEngine->sensors[i].threaded;
+        config->sensorCpu[i] = gEngine->sensors[i].cpu;
+        config->sensorTimeoutMs[i] = gEngine->sensors[i].timeoutMs;
+    }
+    for(i=0;i<NUM_ACTUATORS;i++)
+        snprintf(config->actuatorPath[i], gMaxPathLen, "%s", gActuatorTable[i].path);
+
+    config->medianWindow = gEngine->luxFilter.medianWindow;
+    config->riseWeight = gEngine->luxFilter.riseWeight;
+    config->fallWeight = gEngine->luxFilter.fallWeight;
+    config->riseThreshold = gEngine->luxFilter.riseThreshold;
+    config->fallThreshold = gEngine->luxFilter.fallThreshold;
+    config->minWriteIntervalMs = gEngine->luxFilter.minWriteIntervalMs;
+    config->curvePoints = gEngine->luxFilter.curvePoints;
+    memcpy(config->curve, gEngine->luxFilter.curve, gEngine->luxFilter.curvePoints*sizeof(CurvePoint));
+
+    for(i=0;i<(int)(sizeof(gDefaultRules)/sizeof(gDefaultRules[0]));i++)
+        ParseRule(config, gDefaultRules[i], 0, 0);
+    config->fileRules = false;
+    CompileRules(config);
+
+    config->rampDurationMs = gEngine->backlightRamp.durationMs;
+    config->rampFrameMs = gEngine->backlightRamp.frameMs;
+
+    config->learnEnabled = 1;
+    snprintf(config->learnPath, gMaxPathLen, "%s", gLearnedCurvePath);
+    config->learnSaveIntervalMs = gCurveSaveIntervalMs;
+
+    config->statsEnabled = gStatsEnabled;
+    snprintf(config->ioEngine, sizeof(config->ioEngine), "epoll");
+
+    snprintf(config->mixerBackend, sizeof(config->mixerBackend), "%s", gMixerBackendName);
+    snprintf(config->mixerDevice, gMaxPathLen, "%s", gMixerDevicePath);
+}
+
+/* parse "lux:level lux:level ..." into the curve of a snapshot */
+
+int ParseCurve(Config *config, const char *text, char *err, int errLen)
+{
+    const char *p = text;
+    char *end;
+    int n = 0;
+
+    while(*p){
+        long lux, level;
+
+        while(*p == ' ' || *p == '\t')
+            p++;
+        if(!*p)
+            break;
+
+        lux = strtol(p, &end, 10);
+        if(end == p || *end != ':'){
+            snprintf(err, errLen, "curve point must be lux:level");
+            return -1;
+        }
+        p = end + 1;
+        level = strtol(p, &end, 10);
+        if(end == p || lux < 0 || level < 0 || level > gDisplayMaxBrightness){
+            snprintf(err, errLen, "bad curve point");
+            return -1;
+        }
+        p = end;
+
+        if(n == gMaxCurvePoints){
+            snprintf(err, errLen, "more than %d curve points", gMaxCurvePoints);
+            return -1;
+        }
+        if(n > 0 && lux <= config->curve[n-1].lux){
+            snprintf(err, errLen, "curve lux values must ascend");
+            return -1;
+        }
+        config->curve[n].lux = lux;
+        config->curve[n].level = level;
+        n++;
+    }
+
+    if(n < 1){
+        snprintf(err, errLen, "empty curve");
+        return -1;
+    }
+
+    config->curvePoints = n;
+    return 0;
+}
+
+/* find the setting called key in a snapshot */
+
+int FindConfigSetting(Config *config, const char *key, ConfigSetting *setting)
+{
+    char name[32], field[32];
+    unsigned int i;
+
+    for(i=0;i<sizeof(gConfigKeys)/sizeof(gConfigKeys[0]);i++){
+        if(strcmp(gConfigKeys[i].key, key) == 0){
+            setting->type = gConfigKeys[i].type;
+            setting->target = (char *)config + gConfigKeys[i].offset;
+            setting->min = gConfigKeys[i].min;
+            setting->max = gConfigKeys[i].max;
+            return 0;
+        }
+    }
+
+    /* per device settings */
+
+    if(sscanf(key, "sensor.%31[^.].%31s", name, field) == 2){
+        for(i=0;i<NUM_SENSORS;i++){
+            if(strcmp(gSensorTable[i].name, name) != 0)
+                continue;
+            if(strcmp(field, "path") == 0){
+                setting->type = CONFIG_STRING;
+                setting->target = config->sensorPath[i];
+                setting->max = gMaxPathLen;
+                return 0;
+            }
+            if(strcmp(field, "period_ms") == 0 || strcmp(field, "max_period_ms") == 0){
+                setting->type = CONFIG_INT;
+                setting->target = field[0] == 'p' ? &config->sensorPeriodMs[i]
+                                                  : &config->sensorMaxPeriodMs[i];
+                setting->min = 10;
+                setting->max = 3600000;
+                return 0;
+            }
+            if(strcmp(field, "stable_delta") == 0){
+                setting->type = CONFIG_INT;
+                setting->target = &config->sensorStableDelta[i];
+                setting->min = 0;
+                setting->max = 1000000;
+                return 0;
+            }
+            if(strcmp(field, "thread") == 0){
+                setting->type = CONFIG_INT;
+                setting->target = &config->sensorThread[i];
+                setting->min = 0;
+                setting->max = 1;
+                return 0;
+            }
+            if(strcmp(field, "cpu") == 0){
+                setting->type = CONFIG_INT;
+                setting->target = &config->sensorCpu[i];
+                setting->min = -1;
+                setting->max = CPU_SETSIZE-1;
+                return 0;
+            }
+            if(strcmp(field, "timeout_ms") == 0){
+                setting->type = CONFIG_INT;
+                setting->target = &config->sensorTimeoutMs[i];
+                setting->min = 10;
+                setting->max = 3600000;
+                return 0;
+            }
+        }
+    }
+
+    if(sscanf(key, "actuator.%31[^.].%31s", name, field) == 2 &&
+       strcmp(field, "path") == 0){
+        for(i=0;i<NUM_ACTUATORS;i++){
+            if(strcmp(gActuatorTable[i].name, name) == 0){
+                setting->type = CONFIG_STRING;
+                setting->target = config->actuatorPath[i];
+                setting->max = gMaxPathLen;
+                return 0;
+            }
+        }
+    }
+
+    return -1;
+}
+
+/* apply one "key = value" line to a snapshot */
+
+int SetConfigValue(Config *config, char *line, char *err, int errLen)
+{
+    ConfigSetting setting;
+    char *key, *value, *eq, *end;
+    int number;
+
+    key = line + strspn(line, " \t");
+    end = key + strlen(key);
+    while(end > key && (end[-1] == '\n' || end[-1] == '\r' ||
+                        end[-1] == ' ' || end[-1] == '\t'))
+        *--end = 0;
+
+    if(*key == 0 || *key == '#')
+        return 0;
+
+    eq = strchr(key, '=');
+    if(!eq){
+        snprintf(err, errLen, "expected key = value");
+        return -1;
+    }
+    value = eq + 1 + strspn(eq + 1, " \t");
+    for(end = eq; end > key && (end[-1] == ' ' || end[-1] == '\t'); end--)
+        ;
+    *end = 0;
+
+    if(FindConfigSetting(config, key, &setting) < 0){
+        snprintf(err, errLen, "unknown key %s", key);
+        return -1;
+    }
+
+    switch(setting.type){
+        case CONFIG_INT:
+            if(ParseDecimal(value, strlen(value), &number) < 0 ||
+               number < setting.min || number > setting.max){
+                snprintf(err, errLen, "%s must be a number from %d to %d",
+                         key, setting.min, setting.max);
+                return -1;
+            }
+            *(int *)setting.target = number;
+            break;
+
+        case CONFIG_STRING:
+            if((int)strlen(value) >= setting.max){
+                snprintf(err, errLen, "%s is too long", key);
+                return -1;
+            }
+            strcpy((char *)setting.target, value);
+            break;
+
+        case CONFIG_CURVE:
+            return ParseCurve(config, value, err, errLen);
+
+        case CONFIG_RULE:
+            return ParseRule(config, value, err, errLen);
+    }
+
+    return 0;
+}
+
+/**************************************************************************/
+/***************************************************************************
+
+   LoadConfig
+
+    Build a new configuration snapshot from the built-in defaults and the
+   settings in a file. A missing file is not an error.
+
+    Inputs:
+
+   path			 I					  the configuration file
+
+   err			 O					  a description of the first error
+
+   errLen		 I					  the size of err
+
+    Returns:
+
+    the new snapshot (free it with free()), or 0 on error
+
+***************************************************************************/
+/**************************************************************************/
+
+Config *LoadConfig(const char *path, char *err, int errLen)
+{
+    Config *config;
+    FILE *fp;
+    char line[512], msg[128];
+    int lineNo = 0;
+
+    config = (Config *)malloc(sizeof(Config));
+    if(!config){
+        snprintf(err, errLen, "out of memory");
+        return 0;
+    }
+    *config = gBuiltinConfig;
+
+    fp = fopen(path, "r");
+    if(!fp){
+        if(errno == ENOENT)
+            return config;
+        snprintf(err, errLen, "%s: %s", path, strerror(errno));
+        free(config);
+        return 0;
+    }
+
+    while(fgets(line, sizeof(line), fp)){
+        lineNo++;
+        if(SetConfigValue(config, line, msg, sizeof(msg)) < 0){
+            snprintf(err, errLen, "%s:%d: %s", path, lineNo, msg);
+            fclose(fp);
+            free(config);
+            return 0;
+        }
+    }
+
+    fclose(fp);
+    CompileRules(config);
+    return config;
+}
+
+/**************************************************************************/
+/***************************************************************************
+
+   ApplyConfig
+
+    Make a snapshot the current configuration. Devices are only reopened
+   if their path changed, so reloading an unchanged file touches no
+   descriptors. Must be called from the main loop, never in the middle
+   of handling an event.
+
+    Inputs:
+
+   next			 I					  the snapshot to apply. It is owned by
+                                          the daemon from now on
+
+    Returns: none
+
+***************************************************************************/
+/**************************************************************************/
+
+void ApplyConfig(Config *next)
+{
+    Config *prev = gEngine->config;
+    int i;
+
+    gEngine->config = next;
+
+    for(i=0;i<NUM_SENSORS;i++){
+        SensorSource *sensor = &gEngine->sensors[i];
+
+        sensor->periodMs = next->sensorPeriodMs[i];
+        sensor->maxPeriodMs = next->sensorMaxPeriodMs[i] > sensor->periodMs ?
+                              next->sensorMaxPeriodMs[i] : sensor->periodMs;
+        sensor->stableDelta = next->sensorStableDelta[i];
+        sensor->curPeriodMs = sensor->periodMs;
+        sensor->timeoutMs = next->sensorTimeoutMs[i];
+        if(prev && strcmp(prev->sensorPath[i], next->sensorPath[i]) == 0 &&
+           sensor->fd >= 0){
+            sensor->path = next->sensorPath[i];
+        }else{
+            if(prev)
+                CloseSensor(sensor);
+            sensor->path = next->sensorPath[i];
+            OpenSensor(sensor);
+        }
+
+        /* a worker is only restarted to move it to another CPU */
+        if(sensor->worker && (!next->sensorThread[i] || sensor->cpu != next->sensorCpu[i]))
+            StopSensorWorker(sensor);
+        sensor->threaded = next->sensorThread[i];
+        sensor->cpu = next->sensorCpu[i];
+        if(sensor->threaded && !sensor->worker && sensor->fd >= 0)
+            StartSensorWorker(sensor);
+    }
+
+    for(i=0;i<NUM_ACTUATORS;i++){
+        ActuatorSink *sink = &gEngine->actuators[i];
+
+        if(prev && strcmp(prev->actuatorPath[i], next->actuatorPath[i]) == 0 &&
+           sink->fd >= 0){
+            sink->path = next->actuatorPath[i];
+            continue;
+        }
+        if(prev){
+            if(sink == gEngine->backlightRamp.sink)
+                StopRamp(&gEngine->backlightRamp);
+            CloseActuator(sink);
+        }
+        sink->path = next->actuatorPath[i];
+        OpenActuator(sink);
+    }
+
+    gEngine->luxFilter.riseWeight = next->riseWeight;
+    gEngine->luxFilter.fallWeight = next->fallWeight;
+    gEngine->luxFilter.riseThreshold = next->riseThreshold;
+    gEngine->luxFilter.fallThreshold = next->fallThreshold;
+    gEngine->luxFilter.minWriteIntervalMs = next->minWriteIntervalMs;
+    gEngine->luxFilter.curve = next->curve;
+    gEngine->luxFilter.curvePoints = next->curvePoints;
+    gEngine->luxFilter.table = gProfileTable.level;
+    gEngine->luxFilter.tableSize = IsProfileCurve(next->curve, next->curvePoints) ? gProfileTableSize : 0;
+    if(gEngine->luxFilter.medianWindow != next->medianWindow){
+        gEngine->luxFilter.medianWindow = next->medianWindow;
+        ResetLuxFilter(&gEngine->luxFilter);
+    }
+
+    gEngine->backlightRamp.durationMs = next->rampDurationMs;
+    gEngine->backlightRamp.frameMs = next->rampFrameMs;
+
+    /* a learned curve belongs to one backlight, so a new path for either
+       means the file for that pair */
+    if(!prev || prev->learnEnabled != next->learnEnabled ||
+       strcmp(prev->learnPath, next->learnPath) != 0 ||
+       strcmp(prev->actuatorPath[ACTUATOR_BACKLIGHT],
+              next->actuatorPath[ACTUATOR_BACKLIGHT]) != 0){
+        CloseCurveStore(&gEngine->curveStore);
+        if(next->learnEnabled)
+            OpenCurveStore(&gEngine->curveStore, next->learnPath,
+                           next->actuatorPath[ACTUATOR_BACKLIGHT]);
+    }
+    gEngine->curveStore.saveIntervalMs = next->learnSaveIntervalMs;
+    gEngine->luxFilter.learned = gEngine->curveStore.curve;
+
+    /* leave statistics switched on or off at run time alone unless the
+       file itself changed */
+    if(!prev || prev->statsEnabled != next->statsEnabled)
+        SetStatsEnabled(next->statsEnabled);
+
+    if(!prev || strcmp(prev->ioEngine, next->ioEngine) != 0)
+        SetIoEngine(next->ioEngine);
+
+    if(!prev || !gEngine->mixer || strcmp(prev->mixerBackend, next->mixerBackend) != 0 ||
+       strcmp(prev->mixerDevice, next->mixerDevice) != 0){
+        CloseMixer(gEngine->mixer);
+        gEngine->mixer = OpenMixer(next->mixerBackend);
+    }
+
+    free(prev);
+
+    RescheduleSampling();
+}
+
+/* load and apply the configuration file again, keeping the current
+   settings if it has errors */
+
+void ReloadConfig(void)
+{
+    char err[256];
+    Config *next;
+
+    next = LoadConfig(gEngine->configFilePath, err, sizeof(err));
+    if(!next){
+        LogMessage(LOG_INFO,"config not reloaded: %s", err);
+        return;
+    }
+
+    ApplyConfig(next);
+    LogMessage(LOG_INFO,"config reloaded");
+}
+
+/**************************************************************************/
+/***************************************************************************
+
+   Control socket
+
+    Local tools talk to the daemon over the Unix-domain socket described
+   in prime-sensors.h. The listening socket and every client are ordinary
+   event sources in the main loop. After each batch of events the main
+   loop calls PublishState, which compares the state with what was last
+   published and sends an event to each client subscribed to a group
+   that changed. A client that can't keep up loses events, and the next
+   one it gets carries PS_STATUS_OVERRUN.
+
+***************************************************************************/
+/**************************************************************************/
+
+/**************************************************************************/
+/***************************************************************************
+
+   BindPassiveSocket
+
+    Create the listening control socket.
+
+    Inputs:
+
+   socketPath	 I					  where to bind it. A stale socket
+                                          left there is removed
+
+   boundSocket	 O					  the listening socket
+
+    Returns:
+
+    status code indicating success - 0 = success
+
+***************************************************************************/
+/**************************************************************************/
+
+int BindPassiveSocket(const char *const socketPath, int *const boundSocket)
+{
+    struct sockaddr_un      addr;
+    int                     sock;
+
+    if(strlen(socketPath)>=sizeof(addr.sun_path))
+        return -1;
+
+    sock=socket(AF_UNIX,SOCK_SEQPACKET|SOCK_NONBLOCK|SOCK_CLOEXEC,0);
+    if(sock<0)
+        return -1;
+
+    memset(&addr,0,sizeof(addr));
+    addr.sun_family=AF_UNIX;
+    strcpy(addr.sun_path,socketPath);
+
+    unlink(socketPath);
+    if(bind(sock,(struct sockaddr *)&addr,sizeof(addr))<0 ||
+       chmod(socketPath,0660)<0 ||
+       listen(sock,gMaxControlClients)<0){
+        close(sock);
+        return -1;
+    }
+
+    *boundSocket=sock;
+    return 0;
+}
+
+int OpenControlSocket(void)
+{
+    int i;
+
+    for(i=0;i<gMaxControlClients;i++)
+        gEngine->controlClients[i].event.fd = -1;
+
+    /* a socket the service manager opened for us is already listening
+        at the path; it owns the file */
+
+    if(gListenSocket >= 0){
+        gEngine->masterSocket = gListenSocket;
+        gEngine->masterSocketInherited = true;
+        gListenSocket = -1;
+    }else if(BindPassiveSocket(gEngine->controlSocketPath, &gEngine->masterSocket) < 0){
+        LogMessage(LOG_INFO,"can't bind control socket %s, errno=%d",
+                   gEngine->controlSocketPath, errno);
+        return -1;
+    }
+
+    gEngine->listenSource.fd = gEngine->masterSocket;
+    return WatchEventSource(&gEngine->listenSource, EPOLLIN);
+}
+
+void CloseControlClient(ControlClient *client)
+{
+    if(client->event.fd >= 0)
+        close(client->event.fd);
+    client->event.fd = -1;
+}
+
+void CloseControlSocket(void)
+{
+    int i;
+
+    for(i=0;i<gMaxControlClients;i++)
+        CloseControlClient(&gEngine->controlClients[i]);
+}
+
+void OnControlConnect(EventSource *src, unsigned int events)
+{
+    int fd, i;
+
+    while((fd = LoopAccept(src->fd, SOCK_NONBLOCK|SOCK_CLOEXEC)) >= 0){
+        for(i=0;i<gMaxControlClients;i++){
+            if(gEngine->controlClients[i].event.fd < 0)
+                break;
+        }
+        if(i == gMaxControlClients){
+            LogMessage(LOG_INFO,"too many control clients");
+            close(fd);
+            continue;
+        }
+
+        ControlClient *client = &gEngine->controlClients[i];
+        client->event.fd = fd;
+        client->event.handler = OnControlRequest;
+        client->event.ctx = client;
+        client->subscriptions = 0;
+        client->overrun = false;
+        WatchEventSource(&client->event, EPOLLIN);
+    }
+}
+
+/* a snapshot, as seen by clients */
+
+void FillState(const SensorSnapshot *snap, PsState *state)
+{
+    state->lux = snap->lux;
+    state->brightness = snap->brightness;
+    state->targetBrightness = snap->targetBrightness;
+    state->autoLight = snap->autoLight;
+    state->jackPlugged = snap->jackPlugged;
+    state->audioRoute = snap->audioRoute;
+    state->audioOverride = snap->audioOverride;
+    state->timestampMs = (uint32_t)snap->updatedMs;
+}
+
+/* carry out one request and fill in the status of the response */
+
+int HandleControlRequest(ControlClient *client, const PsRequest *req)
+{
+    switch(req->op){
+        case PS_OP_GET_STATE:
+            return PS_STATUS_OK;
+
+        case PS_OP_SET_AUTO_LIGHT:
+            if(req->arg < -1 || req->arg > 1)
+                return PS_STATUS_BAD_VALUE;
+            SetAutoLight(req->arg < 0 ? !gEngine->autoLightOn : req->arg != 0);
+            return PS_STATUS_OK;
+
+        case PS_OP_SET_BRIGHTNESS:
+            if(req->arg < 0 || req->arg > gDisplayMaxBrightness)
+                return PS_STATUS_BAD_VALUE;
+            SetAutoLight(false);
+            return StartRamp(&gEngine->backlightRamp, req->arg) == 0 ? PS_STATUS_OK
+                                                             : PS_STATUS_FAILED;
+
+        case PS_OP_SET_AUDIO_ROUTE:
+            if(req->arg < PS_AUDIO_AUTO || req->arg > PS_AUDIO_HEADPHONE)
+                return PS_STATUS_BAD_VALUE;
+            gEngine->audioRouteOverride = req->arg;
+            return ApplyAudioRoute() == 0 ? PS_STATUS_OK : PS_STATUS_FAILED;
+
+        case PS_OP_SUBSCRIBE:
+            client->subscriptions = req->arg & PS_EVENT_ALL;
+            client->overrun = false;
+            return PS_STATUS_OK;
+
+        case PS_OP_RELOAD:
+            gCaughtHupSignal=1;
+            return PS_STATUS_OK;
+
+        case PS_OP_STOP:
+            gGracefulShutdown=1;
+            return PS_STATUS_OK;
+
+        case PS_OP_GET_STATS:
+            if(req->arg < 0 || req->arg > 1)
+                return PS_STATUS_BAD_VALUE;
+            return PS_STATUS_OK;
+
+        case PS_OP_SET_STATS:
+            if(req->arg < 0 || req->arg > 1)
+                return PS_STATUS_BAD_VALUE;
+            SetStatsEnabled(req->arg != 0);
+            return PS_STATUS_OK;
+    }
+
+    return PS_STATUS_BAD_REQUEST;
+}
+
+void OnControlRequest(EventSource *src, unsigned int events)
+{
+    ControlClient *client = (ControlClient *)src->ctx;
+    PsRequest req;
+    PsResponse resp;
+    PsStats stats;
+    struct iovec reply[2] = { { &resp, sizeof(resp) }, { &stats, sizeof(stats) } };
+    struct msghdr msg;
+    int len;
+
+    while((len = LoopRecv(src->fd, &req, sizeof(req), 0)) > 0){
+        memset(&resp, 0, sizeof(resp));
+        resp.version = PS_PROTOCOL_VERSION;
+        resp.op = req.op;
+
+        if(len != sizeof(req) || req.version != PS_PROTOCOL_VERSION)
+            resp.status = PS_STATUS_BAD_REQUEST;
+        else
+            resp.status = HandleControlRequest(client, &req);
+
+        UpdateSnapshot(); /* the request may have changed something */
+        resp.seq = gEngine->snapshot.seq;
+        FillState(&gEngine->snapshot, &resp.state);
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = reply;
+        msg.msg_iovlen = 1;
+        if(req.op == PS_OP_GET_STATS && resp.status == PS_STATUS_OK){
+            FillStats(&stats);
+            if(req.arg)
+                ResetStats();
+            msg.msg_iovlen = 2;
+        }
+        LoopSendmsg(src->fd, &msg, MSG_DONTWAIT|MSG_NOSIGNAL);
+    }
+
+    if(len == 0 || (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+        CloseControlClient(client);
+}
+
+/**************************************************************************/
+/***************************************************************************
+
+   PublishState
+
+    Send an event to every subscriber of a state group that changed since
+   the last call. Cheap when nothing changed.
+
+    Returns: none
+
+***************************************************************************/
+/**************************************************************************/
+
+void PublishState(void)
+{
+    PsState                 *last = &gEngine->published;
+    bool                    havePublished = gEngine->havePublished;
+    PsResponse              event;
+    unsigned int            changed = 0;
+    int                     i;
+
+    memset(&event, 0, sizeof(event));
+    FillState(&gEngine->snapshot, &event.state);
+
+    if(!havePublished || event.state.lux != last->lux)
+        changed |= PS_EVENT_LUX;
+    if(!havePublished || event.state.brightness != last->brightness ||
+       event.state.targetBrightness != last->targetBrightness)
+        changed |= PS_EVENT_BRIGHTNESS;
+    if(!havePublished || event.state.jackPlugged != last->jackPlugged ||
+       event.state.audioRoute != last->audioRoute ||
+       event.state.audioOverride != last->audioOverride)
+        changed |= PS_EVENT_AUDIO;
+    if(!havePublished || event.state.autoLight != last->autoLight)
+        changed |= PS_EVENT_AUTO_LIGHT;
+
+    if(!changed)
+        return;
+
+    *last = event.state;
+    gEngine->havePublished = true;
+
+    event.version = PS_PROTOCOL_VERSION;
+    event.op = PS_OP_EVENT;
+    event.events = changed;
+    event.seq = gEngine->snapshot.seq;
+
+    for(i=0;i<gMaxControlClients;i++){
+        ControlClient *client = &gEngine->controlClients[i];
+
+        if(client->event.fd < 0 || !(client->subscriptions & changed))
+            continue;
+
+        event.status = client->overrun ? PS_STATUS_OVERRUN : PS_STATUS_OK;
+        if(LoopSend(client->event.fd, &event, sizeof(event), MSG_DONTWAIT|MSG_NOSIGNAL) < 0){
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                client->overrun = true;
+            else
+                CloseControlClient(client);
+            continue;
+        }
+        client->overrun = false;
+    }
+}
+
+/* what the main loop does for an engine after each batch of events:
+   the latch the state socket reads, then the control socket's
+   subscribers */
+
+void PublishEngineState(void)
+{
+    UpdateSnapshot();
+    PublishState();
+}
+
+/**************************************************************************/
+/***************************************************************************
+
+   SendControlRequest
+
+    Client side of the control socket, used by the command line mode.
+
+    Inputs:
+
+   path			 I					  gEngine->controlSocketPath, or
+										  gEngine->stateSocketPath for
+										  PS_OP_GET_STATE
+
+   op			 I					  the request op
+
+   arg			 I					  its argument
+
+   resp			 O					  the daemon's response
+
+   stats		 O					  the statistics that follow it,
+										  for PS_OP_GET_STATS only
+
+    Returns:
+
+    the connected socket (the caller closes it), or -1 if the daemon
+    could not be reached
+
+***************************************************************************/
+/**************************************************************************/
+
+int SendControlRequest(const char *path, int op, int arg, PsResponse *resp, PsStats *stats)
+{
+    struct iovec            reply[2] = { { resp, sizeof(*resp) },
+                                         { stats, sizeof(*stats) } };
+    int                     replyLen = sizeof(*resp) + (stats ? sizeof(*stats) : 0);
+    struct msghdr           msg;
+    struct sockaddr_un      addr;
+    struct timeval          timeout = { 2, 0 };
+    PsRequest               req;
+    int                     sock;
+
+    sock=socket(AF_UNIX,SOCK_SEQPACKET|SOCK_CLOEXEC,0);
+    if(sock<0)
+        return -1;
+
+    memset(&addr,0,sizeof(addr));
+    addr.sun_family=AF_UNIX;
+    strncpy(addr.sun_path,path,sizeof(addr.sun_path)-1);
+
+    memset(&req,0,sizeof(req));
+    req.version=PS_PROTOCOL_VERSION;
+    req.op=op;
+    req.arg=arg;
+
+    memset(&msg,0,sizeof(msg));
+    msg.msg_iov=reply;
+    msg.msg_iovlen=stats ? 2 : 1;
+
+    setsockopt(sock,SOL_SOCKET,SO_RCVTIMEO,&timeout,sizeof(timeout));
+
+    if(connect(sock,(struct sockaddr *)&addr,sizeof(addr))<0 ||
+       send(sock,&req,sizeof(req),0)!=sizeof(req) ||
+       recvmsg(sock,&msg,0)!=replyLen){
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+/* signal the daemon named in the lock file. Used when the control socket
+   can't be reached */
+
+int SignalDaemon(int sig)
+{
+    char pid_buf[16];
+    int fd, len, pid;
+
+    if ((fd = open(gEngine->lockFilePath, O_RDONLY)) < 0)
+    {
+        perror("Lock file not found. May be the service is not running?");
+        return -1;
+    }
+    len = read(fd, pid_buf, sizeof(pid_buf)-1);
+    close(fd);
+
+    if(len <= 0 || ParseDecimal(pid_buf, len, &pid) < 0 || pid <= 0){
+        fprintf(stderr, "Lock file %s does not hold a PID\n", gEngine->lockFilePath);
+        return -1;
+    }
+
+    if(kill(pid, sig) < 0){
+        perror("Can't signal the daemon");
+        return -1;
+    }
+
+    return 0;
+}
+
+void PrintState(const PsState *state)
+{
+    printf("lux %d brightness %d target %d auto-light %s jack %s audio %s%s\n",
+           state->lux, state->brightness, state->targetBrightness,
+           state->autoLight ? "on" : "off",
+           state->jackPlugged ? "plugged" : "unplugged",
+           state->audioRoute == PS_AUDIO_HEADPHONE ? "headphone" : "speaker",
+           state->audioOverride == PS_AUDIO_AUTO ? "" : " (override)");
+}
+
+/* print the daemon's statistics as a table, times in microseconds */
+
+void PrintStats(const PsStats *stats)
+{
+    static const char *const names[PS_NUM_STATS] =
+    {
+        "loop", "sensor read", "actuator write", "mixer", "policy",
+        "backlight latency", "jack latency"
+    };
+    static const char *const countNames[PS_NUM_COUNTS] =
+    {
+        "wakeups", "sensor reads", "sensor skips", "decisions",
+        "actuator writes", "mixer switches", "syscalls",
+        "writes coalesced", "writes dropped", "sensor timeouts", "overrides"
+    };
+    double elapsed = stats->elapsedMs/1000.0;
+    double uptime = stats->uptimeMs/1000.0;
+    int i;
+
+    printf("since start, %.0f s (ready in %.1f ms)\n", uptime,
+           stats->startupUs/1000.0);
+    for(i=0;i<PS_NUM_COUNTS;i++){
+        printf("%-18s %10llu %10.3f/s\n", countNames[i],
+               (unsigned long long)stats->count[i],
+               uptime > 0 ? stats->count[i]/uptime : 0.0);
+    }
+
+    printf("statistics %s, %.1f s, %.2f wakeups/s\n",
+           stats->enabled ? "on" : "off", elapsed,
+           elapsed > 0 ? stats->stat[PS_STAT_LOOP].count/elapsed : 0.0);
+    printf("%-18s %10s %10s %10s %10s %10s %10s\n",
+           "us", "count", "mean", "p50", "p90", "p99", "max");
+    for(i=0;i<PS_NUM_STATS;i++){
+        const PsStat *stat = &stats->stat[i];
+
+        printf("%-18s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f\n", names[i],
+               (unsigned long long)stat->count,
+               stat->count ? stat->totalNs/1000.0/stat->count : 0.0,
+               stat->p50Ns/1000.0, stat->p90Ns/1000.0, stat->p99Ns/1000.0,
+               stat->maxNs/1000.0);
+    }
+}
+
+/**************************************************************************/
+/***************************************************************************
+
+   RunControlCommand
+
+    Command line mode: talk to a running daemon. The control socket is
+   used when it can be reached; stop, restart and sensorstate fall back
+   to signalling the PID in the lock file.
+
+    Inputs:
+
+   argc, argv	 I					  the command line
+
+    Returns:
+
+    the process exit status
+
+***************************************************************************/
+/**************************************************************************/
+
+int RunControlCommand(int argc, char *argv[])
+{
+    PsResponse resp;
+    PsStats stats;
+    int sock, op, arg = 0, fallbackSig = 0;
+    const char *cmd = argv[1];
+
+    if(!strcmp(cmd, "state")){
+        op = PS_OP_GET_STATE;
+    }else if(!strcmp(cmd, "sensorstate")){
+        op = PS_OP_SET_AUTO_LIGHT; arg = -1; fallbackSig = SIGUSR2;
+    }else if(!strcmp(cmd, "stop")){
+        op = PS_OP_STOP; fallbackSig = SIGUSR1;
+    }else if(!strcmp(cmd, "restart")){
+        op = PS_OP_RELOAD; fallbackSig = SIGHUP;
+    }else if(!strcmp(cmd, "auto") && argc > 2){
+        op = PS_OP_SET_AUTO_LIGHT; arg = !strcmp(argv[2], "on");
+    }else if(!strcmp(cmd, "brightness") && argc > 2){
+        op = PS_OP_SET_BRIGHTNESS; arg = atoi(argv[2]);
+    }else if(!strcmp(cmd, "audio") && argc > 2){
+        op = PS_OP_SET_AUDIO_ROUTE;
+        arg = !strcmp(argv[2], "headphone") ? PS_AUDIO_HEADPHONE :
+              !strcmp(argv[2], "speaker") ? PS_AUDIO_SPEAKER : PS_AUDIO_AUTO;
+    }else if(!strcmp(cmd, "watch")){
+        op = PS_OP_SUBSCRIBE; arg = PS_EVENT_ALL;
+    }else if(!strcmp(cmd, "stats") && argc > 2 && strcmp(argv[2], "reset") != 0){
+        op = PS_OP_SET_STATS; arg = !strcmp(argv[2], "on");
+    }else if(!strcmp(cmd, "stats")){
+        op = PS_OP_GET_STATS; arg = argc > 2;
+    }else{
+        printf ("usage %s [--dir <dir>...] [foreground|selftest|stop|restart|sensorstate|state|watch|auto on|off|"
+                "brightness <level>|audio speaker|headphone|auto|"
+                "stats [reset|on|off]]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    /* the state socket answers without waiting for the main loop; a
+        daemon too old to have one is asked on the control socket */
+    sock = -1;
+    if(op == PS_OP_GET_STATE)
+        sock = SendControlRequest(gEngine->stateSocketPath, op, arg, &resp, 0);
+    if(sock < 0 && (sock = SendControlRequest(gEngine->controlSocketPath, op, arg, &resp,
+                                              op == PS_OP_GET_STATS ? &stats : 0)) < 0){
+        if(fallbackSig)
+            return SignalDaemon(fallbackSig) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+        perror("Can't reach the daemon. May be the service is not running?");
+        return EXIT_FAILURE;
+    }
+
+    if(resp.status != PS_STATUS_OK){
+        fprintf(stderr, "request failed, status %d\n", resp.status);
+        close(sock);
+        return EXIT_FAILURE;
+    }
+
+    if(op == PS_OP_GET_STATE)
+        PrintState(&resp.state);
+
+    if(op == PS_OP_GET_STATS)
+        PrintStats(&stats);
+
+    if(op == PS_OP_SUBSCRIBE){
+        struct timeval forever = { 0, 0 };
+
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &forever, sizeof(forever));
+        PrintState(&resp.state);
+        while(recv(sock, &resp, sizeof(resp), 0) == sizeof(resp)){
+            PrintState(&resp.state);
+            fflush(stdout);
+        }
+    }
+
+    close(sock);
+    return EXIT_SUCCESS;
+}
+
+/**************************************************************************/
+/***************************************************************************
+
+   Statistics
+
+    When enabled (stats.enabled in the configuration, or "prime-sensors
+   stats on"), each stage of the main loop is timed and the times go
+   into a histogram per stage in gStats, along with the latency from the
+   wakeup that brought an event in to the write that answered it. When
+   disabled, StatStart returns 0 and every StatStop is a test and a
+   branch; no clock is read.
+
+    The histograms are log-linear, like HDR histograms: values below
+   2^gHistSubBits have a bucket each, and every octave above that is
+   split into 2^gHistSubBits buckets, so any value is placed to within
+   1/2^gHistSubBits of itself whatever its size, in a fixed table that
+   is never resized or allocated.
+
+***************************************************************************/
+/**************************************************************************/
+
+/* start timing a stage. Returns 0 if statistics are off */
+
+long long StatStart(void)
+{
+    if(__builtin_expect(!gStatsEnabled, 1))
+        return 0;
+    return NowNs();
+}
+
+int HistogramBucket(unsigned long long ns)
+{
+    int octave;
+
+    if(ns < (1ULL << gHistSubBits))
+        return ns;
+
+    octave = 63 - __builtin_clzll(ns) - gHistSubBits;
+    return ((octave + 1) << gHistSubBits) +
+           ((ns >> octave) & ((1 << gHistSubBits) - 1));
+}
+
+/* the largest value that lands in a bucket */
+
+unsigned long long HistogramBucketLimit(int bucket)
+{
+    int octave = (bucket >> gHistSubBits) - 1;
+    unsigned long long base;
+
+    if(octave < 0)
+        return bucket;
+
+    base = (1ULL << gHistSubBits) + (bucket & ((1 << gHistSubBits) - 1));
+    return ((base + 1) << octave) - 1;
+}
+
+unsigned long long HistogramPercentile(const StageStats *stage, int percent)
+{
+    unsigned long long want, seen = 0;
+    int i;
+
+    if(!stage->count)
+        return 0;
+
+    want = (stage->count*percent + 99)/100;
+    for(i=0;i<gHistBuckets;i++){
+        seen += stage->buckets[i];
+        if(seen >= want)
+            break;
+    }
+
+    /* the top bucket's limit may be past the largest value seen */
+    return i < gHistBuckets && HistogramBucketLimit(i) < stage->maxNs ?
+           HistogramBucketLimit(i) : stage->maxNs;
+}
+
+/* finish timing a stage started at start, a StatStart time or wakeup */
+
+void StatStop(int stat, long long start)
+{
+    StageStats *stage;
+    long long ns;
+
+    if(__builtin_expect(start == 0, 1))
+        return;
+
+    ns = NowNs() - start;
+    if(ns < 0)
+        ns = 0;
+
+    stage = &gStats[stat];
+    stage->count++;
+    stage->totalNs += ns;
+    if((unsigned long long)ns > stage->maxNs)
+        stage->maxNs = ns;
+    stage->buckets[HistogramBucket(ns)]++;
+}
+
+void ResetStats(void)
+{
+    memset(gStats, 0, sizeof(gStats));
+    gStatsSinceMs = NowMs();
+}
+
+void SetStatsEnabled(bool on)
+{
+    if(on == gStatsEnabled)
+        return;
+
+    gStatsEnabled = on;
+    gWakeNs = 0;
+    gEngine->backlightEventNs = 0;
+    if(on)
+        ResetStats();
+    LogMessage(LOG_INFO,"statistics %s",on?"on":"off");
+}
+
+void FillStats(PsStats *stats)
+{
+    int i;
+
+    memset(stats, 0, sizeof(*stats));
+    stats->enabled = gStatsEnabled;
+    stats->elapsedMs = gStatsSinceMs ? NowMs() - gStatsSinceMs : 0;
+    stats->uptimeMs = NowMs() - gStartMs;
+    stats->startupUs = gStartupUs;
+
+    stats->count[PS_COUNT_WAKEUPS] = gEngine->counters.wakeups;
+    stats->count[PS_COUNT_SENSOR_READS] = gEngine->counters.sensorReads;
+    stats->count[PS_COUNT_SENSOR_SKIPS] = gEngine->counters.sensorSkips;
+    stats->count[PS_COUNT_DECISIONS] = gEngine->counters.decisions;
+    stats->count[PS_COUNT_ACTUATOR_WRITES] = gEngine->counters.actuatorWrites;
+    stats->count[PS_COUNT_MIXER_SWITCHES] = gEngine->counters.mixerSwitches;
+    stats->count[PS_COUNT_SYSCALLS] = gEngine->counters.syscalls;
+    stats->count[PS_COUNT_WRITES_COALESCED] = gEngine->counters.writesCoalesced;
+    stats->count[PS_COUNT_WRITES_DROPPED] = gEngine->counters.writesDropped;
+    stats->count[PS_COUNT_SENSOR_TIMEOUTS] = gEngine->counters.sensorTimeouts;
+    stats->count[PS_COUNT_OVERRIDES] = gEngine->counters.overrides;
+
+    for(i=0;i<PS_NUM_STATS;i++){
+        const StageStats *stage = &gStats[i];
+        PsStat *stat = &stats->stat[i];
+
+        stat->count = stage->count;
+        stat->totalNs = stage->totalNs;
+        stat->maxNs = stage->maxNs;
+        stat->p50Ns = HistogramPercentile(stage, 50);
+        stat->p90Ns = HistogramPercentile(stage, 90);
+        stat->p99Ns = HistogramPercentile(stage, 99);
+    }
+}
+
+/**************************************************************************/
+/***************************************************************************
+
+   io_uring engine
+
+    With "io.engine = uring" sensor reads and actuator writes are not
+   made with pread and pwrite as they come up. Each one is queued as a
+   request on an io_uring, and FlushActuators submits everything the tick
+   queued with one io_uring_enter. The ring descriptor is an event source
+   of its own that becomes readable as requests complete; OnIoCompletion
+   then finishes the samples and writes that are done and runs the policy
+   once for them. A sensor whose driver is slow to answer (an I2C light
+   sensor, say) is read by a kernel worker in the meantime, so it no
+   longer holds up the jack or anything else handled in the same tick.
+
+    A sensor or an actuator has at most one request in flight. A sample
+   that comes due while the last read is still out is not queued again,
+   and a level queued while the last write is still out waits for the
+   flush after it completes.
+
+    The rings are set up with the raw system calls, so liburing is not
+   needed. When the headers or the kernel don't have io_uring, or the
+   ring can't be set up, the daemon says so in the log and carries on
+   with plain reads and writes, as it does with "io.engine = epoll".
+
+***************************************************************************/
+/**************************************************************************/
+
+#ifdef PS_HAVE_IO_URING
+
+/* the user_data of CancelIo's timeout. Sensors and sinks are aligned, so
+   it can't be one of theirs */
+
+unsigned long long const gIoTimeoutTag = 2;
+
+void *MapIoRing(int fd, size_t size, off_t offset)
+{
+    void *map = mmap(0, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, offset);
+
+    return map == MAP_FAILED ? 0 : map;
+}
+
+/**************************************************************************/
+/***************************************************************************
+
+   OpenIoRing
+
+    Set up an io_uring and map its rings.
+
+    Inputs:
+
+   ring			 O					  the ring to set up
+
+   entries		 I					  submission queue entries, a power of
+                                          two. The completion queue has
+                                          twice as many
+
+    Returns:
+
+    status code indicating success - 0 = success
+
+***************************************************************************/
+/**************************************************************************/
+
+int OpenIoRing(IoRing *ring, unsigned int entries)
+{
+    struct io_uring_params params;
+    char *sq, *cq;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if(ring->fd < 0)
+        return -1;
+
+    /* IORING_OP_READ and IORING_OP_WRITE came in with this feature */
+    if(!(params.features & IORING_FEAT_RW_CUR_POS)){
+        CloseIoRing(ring);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    ring->sqMapSize = params.sq_off.array + params.sq_entries*sizeof(unsigned int);
+    ring->cqMapSize = params.cq_off.cqes + params.cq_entries*sizeof(struct io_uring_cqe);
+    if(params.features & IORING_FEAT_SINGLE_MMAP){
+        if(ring->cqMapSize > ring->sqMapSize)
+            ring->sqMapSize = ring->cqMapSize;
+        ring->cqMapSize = ring->sqMapSize;
+    }
+    ring->sqesSize = params.sq_entries*sizeof(struct io_uring_sqe);
+
+    ring->sqMap = MapIoRing(ring->fd, ring->sqMapSize, IORING_OFF_SQ_RING);
+    if(ring->sqMap && (params.features & IORING_FEAT_SINGLE_MMAP))
+        ring->cqMap = ring->sqMap;
+    else if(ring->sqMap)
+        ring->cqMap = MapIoRing(ring->fd, ring->cqMapSize, IORING_OFF_CQ_RING);
+    ring->sqes = MapIoRing(ring->fd, ring->sqesSize, IORING_OFF_SQES);
+    if(!ring->sqMap || !ring->cqMap || !ring->sqes){
+        CloseIoRing(ring);
+        return -1;
+    }
+
+    sq = (char *)ring->sqMap;
+    cq = (char *)ring->cqMap;
+    ring->sqTail = (unsigned int *)(sq + params.sq_off.tail);
+    ring->sqMask = (unsigned int *)(sq + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned int *)(sq + params.sq_off.array);
+    ring->cqHead = (unsigned int *)(cq + params.cq_off.head);
+    ring->cqTail = (unsigned int *)(cq + params.cq_off.tail);
+    ring->cqMask = (unsigned int *)(cq + params.cq_off.ring_mask);
+    ring->cqes = cq + params.cq_off.cqes;
+
+    ring->event.fd = ring->fd;
+    ring->event.handler = OnIoCompletion;
+    ring->event.ctx = ring;
+    return 0;
+}
+
+/* cancel everything in flight and give the kernel gIoCloseTimeoutMs to
+   finish it, then unmap the rings. A driver stuck in a read can't hold up
+   shutdown or a reload this way; what is still out when the time is up is
+   abandoned with the ring, and since the buffers are in the sensor and
+   sink tables, which outlive it, a late completion has nowhere bad to
+   write. Samples finished here are not acted on, so they are marked
+   invalid to make the next one count */
+
+void CloseIoRing(IoRing *ring)
+{
+    unsigned int changed;
+    int i;
+
+    if(ring->fd < 0)
+        return;
+
+    if(ring->sqMap && ring->cqMap && ring->sqes){
+        changed = CancelIo(ring, gIoCloseTimeoutMs);
+        for(i=0;i<NUM_SENSORS;i++){
+            if(changed & (1u << i))
+                gEngine->sensors[i].valid = false;
+        }
+    }
+    for(i=0;i<NUM_SENSORS;i++){
+        if(!gEngine->sensors[i].worker)
+            gEngine->sensors[i].reading = false;
+    }
+    for(i=0;i<NUM_ACTUATORS;i++)
+        gEngine->actuators[i].writing = false;
+
+    if(ring->sqes)
+        munmap(ring->sqes, ring->sqesSize);
+    if(ring->cqMap && ring->cqMap != ring->sqMap)
+        munmap(ring->cqMap, ring->cqMapSize);
+    if(ring->sqMap)
+        munmap(ring->sqMap, ring->sqMapSize);
+    close(ring->fd);
+
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+/* claim the next submission queue entry, cleared. It is queued, and must
+   be filled in before the next io_uring_enter. Returns 0 when the ring is
+   full */
+
+struct io_uring_sqe *NextIoEntry(IoRing *ring)
+{
+    struct io_uring_sqe *sqe;
+    unsigned int tail, index;
+
+    if(ring->fd < 0 || ring->pending + ring->inFlight >= (unsigned int)gIoRingEntries)
+        return 0;
+
+    tail = *ring->sqTail;
+    index = tail & *ring->sqMask;
+    sqe = (struct io_uring_sqe *)ring->sqes + index;
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sqArray[index] = index;
+    __atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+/* queue one read or write at offset 0. Its user_data is the sensor or sink it is for, sinks
+   with the low bit set, or 0 for none. Fails when the ring is full */
+
+int QueueIo(IoRing *ring, bool write, int fd, void *buf, int len, unsigned long long userData)
+{
+    struct io_uring_sqe *sqe = NextIoEntry(ring);
+
+    if(!sqe)
+        return -1;
+
+    sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)buf;
+    sqe->len = len;
+    sqe->off = 0;
+    sqe->user_data = userData;
+    ring->pending++;
+    return 0;
+}
+
+/* queue a read of a sensor into its text buffer. A read already in flight
+   will do for this sample too */
+
+int QueueIoRead(IoRing *ring, SensorSource *sensor)
+{
+    if(sensor->reading)
+        return 0;
+
+    if(QueueIo(ring, false, sensor->fd, sensor->text,
+               sizeof(sensor->text)-1, (unsigned long)sensor) < 0)
+        return -1;
+
+    sensor->reading = true;
+    sensor->readStartNs = StatStart();
+    gEngine->counters.sensorReads++;
+    return 0;
+}
+
+/* queue a write of the level in the sink's writeBuf */
+
+int QueueIoWrite(IoRing *ring, ActuatorSink *sink)
+{
+    if(QueueIo(ring, true, sink->fd, sink->writeBuf,
+               sink->writeLen, (unsigned long)sink | 1) < 0)
+        return -1;
+
+    sink->writing = true;
+    return 0;
+}
+
+/* hand everything queued to the kernel without waiting for it */
+
+int SubmitIo(IoRing *ring)
+{
+    int submitted;
+
+    if(ring->fd < 0 || ring->pending == 0)
+        return 0;
+
+    submitted = LoopIoUringEnter(ring->fd, ring->pending, 0, 0);
+    if(submitted < 0){
+        LogMessage(LOG_INFO,"io_uring_enter failed, errno=%d", errno);
+        return -1;
+    }
+
+    ring->pending -= submitted;
+    ring->inFlight += submitted;
+    return submitted;
+}
+
+/* submit everything queued and wait until nothing is in flight. Returns
+   the sensors whose value changed */
+
+unsigned int WaitIo(IoRing *ring)
+{
+    unsigned int changed = 0;
+    int submitted;
+
+    while(ring->fd >= 0 && ring->pending + ring->inFlight > 0){
+        submitted = LoopIoUringEnter(ring->fd, ring->pending,
+                                     ring->pending + ring->inFlight, IORING_ENTER_GETEVENTS);
+        if(submitted < 0){
+            if(errno == EINTR)
+                continue;
+            LogMessage(LOG_INFO,"io_uring_enter failed, errno=%d", errno);
+            break;
+        }
+        ring->pending -= submitted;
+        ring->inFlight += submitted;
+        changed |= ReapIo(ring);
+    }
+
+    return changed;
+}
+
+/* ask the kernel to cancel every read and write in flight, and wait for
+   them to finish, or for timeoutMs, whichever is first. Returns the
+   sensors whose value changed */
+
+unsigned int CancelIo(IoRing *ring, int timeoutMs)
+{
+    struct __kernel_timespec timeout = { timeoutMs / 1000, (timeoutMs % 1000) * 1000000LL };
+    struct io_uring_sqe *sqe;
+    unsigned int changed = 0;
+    int i, submitted;
+
+    for(i=0;i<NUM_SENSORS;i++){
+        if(gEngine->sensors[i].reading && !gEngine->sensors[i].worker && (sqe = NextIoEntry(ring))){
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = -1;
+            sqe->addr = (unsigned long)&gEngine->sensors[i];
+            ring->pending++;
+        }
+    }
+    for(i=0;i<NUM_ACTUATORS;i++){
+        if(gEngine->actuators[i].writing && (sqe = NextIoEntry(ring))){
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = -1;
+            sqe->addr = (unsigned long)&gEngine->actuators[i] | 1;
+            ring->pending++;
+        }
+    }
+    if(!(sqe = NextIoEntry(ring)))
+        return WaitIo(ring);    /* can't happen: each has one request at most */
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (unsigned long)&timeout;
+    sqe->len = 1;
+    sqe->user_data = gIoTimeoutTag;
+    ring->pending++;
+    ring->expired = false;
+
+    /* the timeout stays in flight until it goes off, so more than one
+       means there is more to wait for */
+    while(ring->pending + ring->inFlight > 1 && !ring->expired){
+        submitted = LoopIoUringEnter(ring->fd, ring->pending, 1,
+                                     IORING_ENTER_GETEVENTS);
+        if(submitted < 0){
+            if(errno == EINTR)
+                continue;
+            LogMessage(LOG_INFO,"io_uring_enter failed, errno=%d", errno);
+            break;
+        }
+        ring->pending -= submitted;
+        ring->inFlight += submitted;
+        changed |= ReapIo(ring);
+    }
+
+    if(ring->expired && ring->pending + ring->inFlight > 0)
+        LogMessage(LOG_INFO,"io_uring: gave up waiting for %u requests",
+                   ring->pending + ring->inFlight);
+    return changed;
+}
+
+/**************************************************************************/
+/***************************************************************************
+
+   ReapIo
+
+    Finish every request that has completed: parse the samples, and
+   account for the writes. A write that failed leaves the level unknown,
+   so it is read back.
+
+    Inputs:
+
+   ring			 I					  the ring to reap
+
+    Returns:
+
+    the sensors whose value changed, one bit per gSensorTable entry
+
+***************************************************************************/
+/**************************************************************************/
+
+unsigned int ReapIo(IoRing *ring)
+{
+    struct io_uring_cqe *cqes = (struct io_uring_cqe *)ring->cqes;
+    unsigned int head, tail, changed = 0;
+
+    head = *ring->cqHead;
+    tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+    for(;head != tail;head++){
+        struct io_uring_cqe *cqe = &cqes[head & *ring->cqMask];
+        unsigned long long userData = cqe->user_data;
+        int res = cqe->res;
+
+        ring->inFlight--;
+        if(userData == gIoTimeoutTag){
+            ring->expired = true;
+        }else if(userData & 1){
+            ActuatorSink *sink = (ActuatorSink *)(unsigned long)(userData & ~1ULL);
+
+            sink->writing = false;
+            if(res == sink->writeLen){
+                FinishWrite(sink);
+            }else{
+                if(res != -ECANCELED)
+                    LogMessage(LOG_INFO,"actuator %s: write failed, errno=%d",
+                               sink->name, res < 0 ? -res : 0);
+                RefreshActuator(sink);
+            }
+        }else if(userData){
+            SensorSource *sensor = (SensorSource *)(unsigned long)userData;
+
+            sensor->reading = false;
+            StatStop(PS_STAT_SENSOR_READ, sensor->readStartNs);
+            sensor->text[res > 0 ? res : 0] = 0;
+            /* a sensor closed or disabled meanwhile has no use for it */
+            if(sensor->fd >= 0 && sensor->enabled &&
+               FinishSample(sensor, res < 0 ? -1 : res))
+                changed |= 1u << (sensor - gEngine->sensors);
+        }
+    }
+    __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+
+    return changed;
+}
+
+#else /* !PS_HAVE_IO_URING */
+
+int OpenIoRing(IoRing *ring, unsigned int entries)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+void CloseIoRing(IoRing *ring)
+{
+}
+
+int QueueIo(IoRing *ring, bool write, int fd, void *buf, int len, unsigned long long userData)
+{
+    return -1;
+}
+
+int QueueIoRead(IoRing *ring, SensorSource *sensor)
+{
+    return -1;
+}
+
+int QueueIoWrite(IoRing *ring, ActuatorSink *sink)
+{
+    return -1;
+}
+
+int SubmitIo(IoRing *ring)
+{
+    return 0;
+}
+
+unsigned int WaitIo(IoRing *ring)
+{
+    return 0;
+}
+
+unsigned int CancelIo(IoRing *ring, int timeoutMs)
+{
+    return 0;
+}
+
+unsigned int ReapIo(IoRing *ring)
+{
+    return 0;
+}
+
+#endif /* PS_HAVE_IO_URING */
+
+void OnIoCompletion(EventSource *src, unsigned int events)
+{
+    unsigned int changed = ReapIo((IoRing *)src->ctx);
+
+    if(changed)
+        RunPolicy(changed);
+}
+
+/* switch to the named engine, "epoll" or "uring" */
+
+void SetIoEngine(const char *name)
+{
+    if(strcmp(name, "uring") != 0){
+        if(strcmp(name, "epoll") != 0)
+            LogMessage(LOG_INFO,"io: unknown engine %s, using epoll", name);
+        CloseIoRing(&gEngine->ioRing);
+        return;
+    }
+
+    if(gEngine->ioRing.fd >= 0)
+        return;
+    if(OpenIoRing(&gEngine->ioRing, gIoRingEntries) < 0){
+        LogMessage(LOG_INFO,"io: can't set up io_uring, errno=%d, using epoll", errno);
+        return;
+    }
+    WatchEventSource(&gEngine->ioRing.event, EPOLLIN);
+}
+
+/**************************************************************************/
+/***************************************************************************
+
+   Sensor workers
+
+    A sensor with "sensor.<name>.thread = 1" is read on a thread of its
+   own, so a driver that hangs in a read (an I2C bus glitch on the light
+   sensor, say) only holds up that sensor. The main loop still decides
+   when the sensor is due; SampleSensor then wakes the worker through an
+   eventfd instead of reading. The worker reads its own dup of the
+   descriptor, puts the text in a single-producer, single-consumer ring
+   of WorkerSamples and signals a second eventfd, which is an event
+   source in the main loop. OnWorkerSample takes the samples off the
+   ring, finishes them as if they had been read in place and runs the
+   policy once for them. Nothing else is shared: the worker never
+   touches the sensor, the counters or the statistics.
+
+    As with the io_uring engine, a sensor has at most one read in
+   flight. Whenever it comes due while the read is still out, and on
+   every sample timer tick, CheckSensorWorker compares how long the read
+   has taken with timeoutMs. Past that the sensor is logged and counted
+   as hung and its value is dropped, so nothing acts on a stale sample,
+   until the read comes back. A read stuck in a driver can't be
+   interrupted, so no new thread is started for it; letting go of a
+   worker (on reload or shutdown) never waits for it either. The worker
+   and the main loop each hold a reference, and the last one out closes
+   the descriptors.
+
+***************************************************************************/
+/**************************************************************************/
+
+void ReleaseSensorWorker(SensorWorker *worker)
+{
+    if(__atomic_sub_fetch(&worker->refs, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+
+    close(worker->fd);
+    close(worker->wakeFd);
+    close(worker->event.fd);
+    free(worker);
+}
+
+void *SensorWorkerMain(void *arg)
+{
+    SensorWorker *worker = (SensorWorker *)arg;
+    unsigned long long requests, one = 1;
+
+    for(;;){
+        if(read(worker->wakeFd, &requests, sizeof(requests)) != sizeof(requests)){
+            if(errno == EINTR)
+                continue;
+            break;
+        }
+        if(__atomic_load_n(&worker->stop, __ATOMIC_ACQUIRE))
+            break;
+
+        /* the main loop asks for one sample at a time, so the ring is
+           never full unless it has stopped taking them */
+        unsigned int tail = worker->tail;
+        if(tail - __atomic_load_n(&worker->head, __ATOMIC_ACQUIRE) == (unsigned int)gWorkerQueueSize)
+            continue;
+
+        WorkerSample *slot = &worker->samples[tail & (gWorkerQueueSize - 1)];
+        slot->len = pread(worker->fd, slot->text, sizeof(slot->text)-1, 0);
+        slot->text[slot->len > 0 ? slot->len : 0] = 0;
+
+        __atomic_store_n(&worker->tail, tail + 1, __ATOMIC_RELEASE);
+        write(worker->event.fd, &one, sizeof(one));
+    }
+
+    ReleaseSensorWorker(worker);
+    return 0;
+}
+
+/**************************************************************************/
+/***************************************************************************
+
+   StartSensorWorker
+
+    Start a worker thread for a sensor and pin it to sensor->cpu. If it
+   can't be started the sensor is read on the main loop as before.
+
+    Inputs:
+
+   sensor		 I					  an open sensor without a worker
+
+    Returns:
+
+    status code indicating success - 0 = success
+
+***************************************************************************/
+/**************************************************************************/
+
+int StartSensorWorker(SensorSource *sensor)
+{
+    SensorWorker *worker;
+    char name[16];
+    int err;
+
+    worker = (SensorWorker *)calloc(1, sizeof(SensorWorker));
+    if(!worker)
+        return -1;
+
+    worker->fd = fcntl(sensor->fd, F_DUPFD_CLOEXEC, 0);
+    worker->cpu = sensor->cpu;
+    worker->wakeFd = eventfd(0, EFD_CLOEXEC);
+    worker->event.fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    worker->event.handler = OnWorkerSample;
+    worker->event.ctx = sensor;
+    worker->refs = 2;
+
+    if(worker->fd < 0 || worker->wakeFd < 0 || worker->event.fd < 0 ||
+       WatchEventSource(&worker->event, EPOLLIN) < 0){
+        err = errno;
+        goto fail;
+    }
+
+    if((err = pthread_create(&worker->thread, 0, SensorWorkerMain, worker)) != 0){
+        epoll_ctl(gEpollDesc, EPOLL_CTL_DEL, worker->event.fd, 0);
+        goto fail;
+    }
+    pthread_detach(worker->thread);
+
+    snprintf(name, sizeof(name), "ps-%s", sensor->name);
+    pthread_setname_np(worker->thread, name);
+
+    if(worker->cpu >= 0){
+        cpu_set_t cpus;
+
+        CPU_ZERO(&cpus);
+        CPU_SET(worker->cpu, &cpus);
+        if((err = pthread_setaffinity_np(worker->thread, sizeof(cpus), &cpus)) != 0)
+            LogMessage(LOG_INFO,"sensor %s: can't pin worker to cpu %d, errno=%d",
+                       sensor->name, worker->cpu, err);
+    }
+
+    sensor->worker = worker;
+    sensor->reading = false;
+    sensor->stalled = false;
+    return 0;
+
+fail:
+    LogMessage(LOG_INFO,"sensor %s: can't start worker, errno=%d, reading in place",
+               sensor->name, err);
+    if(worker->fd >= 0)
+        close(worker->fd);
+    if(worker->wakeFd >= 0)
+        close(worker->wakeFd);
+    if(worker->event.fd >= 0)
+        close(worker->event.fd);
+    free(worker);
+    return -1;
+}
+
+/* let a sensor's worker go. It exits as soon as it wakes, which for a
+   hung read is whenever the driver lets go of it */
+
+void StopSensorWorker(SensorSource *sensor)
+{
+    SensorWorker *worker = sensor->worker;
+    unsigned long long one = 1;
+
+    if(!worker)
+        return;
+
+    __atomic_store_n(&worker->stop, true, __ATOMIC_RELEASE);
+    write(worker->wakeFd, &one, sizeof(one));
+    epoll_ctl(gEpollDesc, EPOLL_CTL_DEL, worker->event.fd, 0);
+    ReleaseSensorWorker(worker);
+
+    sensor->worker = 0;
+    sensor->reading = false;
+    sensor->stalled = false;
+}
+
+/* ask the worker for a sample. A read already out will do for this one
+   too */
+
+int PostSensorRead(SensorSource *sensor)
+{
+    unsigned long long one = 1;
+
+    if(sensor->reading){
+        CheckSensorWorker(sensor, NowMs());
+        return 0;
+    }
+
+    if(LoopWrite(sensor->worker->wakeFd, &one, sizeof(one)) != sizeof(one))
+        return -1;
+
+    sensor->reading = true;
+    sensor->readStartNs = StatStart();
+    sensor->readSinceMs = NowMs();
+    gEngine->counters.sensorReads++;
+    return 0;
+}
+
+/* the watchdog: count a read that has been out for more than timeoutMs
+   as hung, once, and stop trusting the last sample */
+
+void CheckSensorWorker(SensorSource *sensor, long long now)
+{
+    if(!sensor->reading || sensor->stalled ||
+       now - sensor->readSinceMs < sensor->timeoutMs)
+        return;
+
+    sensor->stalled = true;
+    sensor->valid = false;
+    gEngine->counters.sensorTimeouts++;
+    LogMessage(LOG_INFO,"sensor %s: no answer in %d ms",
+               sensor->name, sensor->timeoutMs);
+}
+
+void OnWorkerSample(EventSource *src, unsigned int events)
+{
+    SensorSource *sensor = (SensorSource *)src->ctx;
+    SensorWorker *worker = sensor->worker;
+    unsigned long long count;
+    unsigned int head;
+    bool changed = false;
+
+    LoopRead(src->fd, &count, sizeof(count));
+
+    head = worker->head;
+    while(head != __atomic_load_n(&worker->tail, __ATOMIC_ACQUIRE)){
+        const WorkerSample *slot = &worker->samples[head & (gWorkerQueueSize - 1)];
+        int len = slot->len;
+
+        memcpy(sensor->text, slot->text, sizeof(sensor->text));
+        __atomic_store_n(&worker->head, ++head, __ATOMIC_RELEASE);
+
+        sensor->reading = false;
+        StatStop(PS_STAT_SENSOR_READ, sensor->readStartNs);
+        if(sensor->stalled){
+            sensor->stalled = false;
+            LogMessage(LOG_INFO,"sensor %s: answered after %lld ms",
+                       sensor->name, NowMs() - sensor->readSinceMs);
+        }
+
+        /* a sensor disabled meanwhile has no use for it */
+        if(sensor->enabled && FinishSample(sensor, len))
+            changed = true;
+    }
+
+    if(changed)
+        RunPolicy(1u << (sensor - gEngine->sensors));
+}
+
+/**************************************************************************/
+/***************************************************************************
+
+   Log queue
+
+    syslog() is a blocking send to /dev/log, and a journal that is busy
+   or restarting holds up whoever calls it. So the main loop only formats
+   a message, into a buffer of its own, and appends it to gLogQueue; a
+   flusher thread takes the messages off the queue and sends them. It
+   waits gLogFlushMs after the first one before it does, so a burst goes
+   out in one pass rather than one wakeup per message. If the queue is
+   full the message is dropped and the flusher says how many were.
+
+    Every message below LOG_NOTICE is also rate limited on its own, by
+   its format and its text together, so the same line repeated is held
+   back but a different sensor or value through the same format is not:
+   a few in a row go through, and after that one every gLogRefillMs,
+   with a count of those left out added to the next that goes through.
+   A jack that flaps costs a few lines, not one per contact. LOG_NOTICE
+   and above always go through. Each thread keeps its own limits, in a
+   small table where a new message takes the place of the one idle the
+   longest if its slots are all in use, so no thread ever waits on
+   another to log.
+
+    Before StartLogFlusher and after StopLogFlusher messages are sent at
+   once, as before; tools and benchmarks never start it. Any other
+   thread's messages are sent at once too.
+
+***************************************************************************/
+/**************************************************************************/
+
+/* the calling thread's rate limit for one message, found by the address
+   of its format and a hash of its text */
+
+LogLimit *FindLogLimit(const char *format, const char *text, long long now)
+{
+    static __thread LogLimit limits[gLogLimits];
+    unsigned int hash = 2166136261u, i, n; /* FNV-1a */
+    LogLimit *limit, *idlest = 0;
+
+    while(*text)
+        hash = (hash ^ (unsigned char)*text++)*16777619u;
+
+    i = ((uintptr_t)format >> 3) ^ hash;
+    for(n=0;n<(unsigned int)gLogLimitProbes;n++){
+        limit = &limits[(i + n) & (gLogLimits - 1)];
+
+        if(limit->format == format && limit->hash == hash)
+            return limit;
+        if(!limit->format)
+            break;
+        if(!idlest || limit->lastMs < idlest->lastMs)
+            idlest = limit;
+    }
+    if(limit->format)
+        limit = idlest;
+
+    limit->format = format;
+    limit->hash = hash;
+    limit->tokens = gLogBurst;
+    limit->refillMs = now;
+    limit->suppressed = 0;
+    return limit;
+}
+
+/* whether a message may go out now, and how many like it were held back
+   since the last one that did */
+
+bool AllowLogMessage(int priority, const char *format, const char *text,
+                     unsigned int *suppressed)
+{
+    long long now = NowMs();
+    LogLimit *limit;
+
+    *suppressed = 0;
+    if(priority <= LOG_NOTICE)
+        return true;
+
+    limit = FindLogLimit(format, text, now);
+    limit->lastMs = now;
+    if(limit->tokens < gLogBurst && now - limit->refillMs >= gLogRefillMs){
+        int refill = (now - limit->refillMs)/gLogRefillMs;
+
+        limit->tokens = refill >= gLogBurst - limit->tokens ? gLogBurst : limit->tokens + refill;
+        limit->refillMs = now;
+    }
+    if(limit->tokens == 0){
+        limit->suppressed++;
+        return false;
+    }
+    if(limit->tokens-- == gLogBurst)
+        limit->refillMs = now;
+    *suppressed = limit->suppressed;
+    limit->suppressed = 0;
+    return true;
+}
+
+/**************************************************************************/
+/***************************************************************************
+
+   LogMessage
+
+    syslog() at facility LOCAL0, without waiting for it. See "Log queue".
+
+    Inputs:
+
+   priority		 I					  LOG_INFO, LOG_DEBUG, ...
+
+   format, ...	 I					  as for printf(); with the text, the
+										  key the message is rate limited by
+
+    Returns:
+
+    nothing
+
+***************************************************************************/
+/**************************************************************************/
+
+void LogMessage(int priority, const char *format, ...)
+{
+    static __thread char text[gLogTextSize];
+    LogQueue *queue = &gLogQueue;
+    bool queued = queue->running && pthread_equal(pthread_self(), queue->owner);
+    unsigned int suppressed;
+    va_list args;
+    int len;
+
+    if(!(setlogmask(0) & LOG_MASK(priority)))
+        return;
+
+    va_start(args, format);
+    len = vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    if(len >= (int)sizeof(text))
+        len = sizeof(text) - 1;
+
+    if(!AllowLogMessage(priority, format, text, &suppressed))
+        return;
+    if(suppressed)
+        snprintf(text + len, sizeof(text) - len, " (%u more suppressed)", suppressed);
+
+    if(!queued){
+        syslog(LOG_LOCAL0|priority, "%s", text);
+        return;
+    }
+
+    unsigned int head = queue->head;
+    if(head - __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE) == (unsigned int)gLogRecords){
+        __atomic_add_fetch(&queue->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    LogRecord *record = &queue->records[head & (gLogRecords - 1)];
+    record->priority = priority;
+    memcpy(record->text, text, sizeof(record->text));
+    __atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+
+    /* one wakeup per batch: the flusher clears pending before it drains */
+    if(!__atomic_exchange_n(&queue->pending, true, __ATOMIC_ACQ_REL)){
+        unsigned long long one = 1;
+        write(queue->wakeFd, &one, sizeof(one));
+    }
+}
+
+/* send everything queued so far. Only the flusher, or whoever stopped
+   it, takes records off the queue */
+
+void DrainLogQueue(LogQueue *queue)
+{
+    unsigned int tail = queue->tail, head, dropped;
+
+    head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+    for(;tail != head;tail++){
+        const LogRecord *record = &queue->records[tail & (gLogRecords - 1)];
+
+        syslog(LOG_LOCAL0|record->priority, "%s", record->text);
+    }
+    __atomic_store_n(&queue->tail, tail, __ATOMIC_RELEASE);
+
+    if((dropped = __atomic_exchange_n(&queue->dropped, 0, __ATOMIC_RELAXED)) != 0)
+        syslog(LOG_LOCAL0|LOG_INFO, "log: %u messages dropped, the queue was full", dropped);
+}
+
+void *LogFlusherMain(void *arg)
+{
+    LogQueue *queue = (LogQueue *)arg;
+    unsigned long long wakeups;
+
+    for(;;){
+        if(read(queue->wakeFd, &wakeups, sizeof(wakeups)) != sizeof(wakeups)){
+            if(errno == EINTR)
+                continue;
+            break;
+        }
+        if(__atomic_load_n(&queue->stop, __ATOMIC_ACQUIRE))
+            break;
+
+        usleep(gLogFlushMs*1000); /* let the rest of the burst in */
+        __atomic_store_n(&queue->pending, false, __ATOMIC_RELEASE);
+        DrainLogQueue(queue);
+    }
+    return 0;
+}
+
+/**************************************************************************/
+/***************************************************************************
+
+   StartLogFlusher
+
+    Start the thread that sends queued log messages, and from now on
+   queue the messages of the calling thread. Start it after fork(), and
+   with the control signals blocked, which it inherits.
+
+    Inputs:
+
+   none
+
+    Returns:
+
+    status code indicating success - 0 = success; messages are sent
+   directly if it fails
+
+***************************************************************************/
+/**************************************************************************/
+
+int StartLogFlusher(void)
+{
+    LogQueue *queue = &gLogQueue;
+    int err;
+
+    queue->wakeFd = eventfd(0, EFD_CLOEXEC);
+    if(queue->wakeFd < 0)
+        return -1;
+
+    queue->owner = pthread_self();
+    queue->stop = false;
+    queue->pending = false;
+    if((err = pthread_create(&queue->thread, 0, LogFlusherMain, queue)) != 0){
+        close(queue->wakeFd);
+        queue->wakeFd = -1;
+        errno = err;
+        return -1;
+    }
+    pthread_setname_np(queue->thread, "ps-log");
+    queue->running = true;
+    return 0;
+}
+
+/* stop the flusher and send what it left */
+
+void StopLogFlusher(void)
+{
+    LogQueue *queue = &gLogQueue;
+    unsigned long long one = 1;
+
+    if(!queue->running)
+        return;
+
+    __atomic_store_n(&queue->stop, true, __ATOMIC_RELEASE);
+    write(queue->wakeFd, &one, sizeof(one));
+    pthread_join(queue->thread, 0);
+    queue->running = false;
+    close(queue->wakeFd);
+    queue->wakeFd = -1;
+
+    DrainLogQueue(queue);
+}
+
+/**************************************************************************/
+/***************************************************************************
+
+   Telemetry ring
+
+    Every sample taken and every level written is appended to a ring of
+   PsRingRecords in shared memory at the engine's telemetryRingPath, so
+   that logging and analytics agents can follow the daemon at full
+   sample rate without a syscall per record and without anything going to syslog.
+   The layout and a reader are in prime-sensors.h.
+
+    The main loop is the only writer and never waits for readers: a
+   reader that falls a whole ring behind loses the oldest records and
+   finds out from the sequence numbers. The ring is created when the
+   daemon starts and unlinked when it stops.
+
+    Readers map the file shared, so whoever can write it or swap it for
+   another can make the daemon write where they choose, or shrink it
+   under the mapping and crash the daemon with SIGBUS. The ring is
+   therefore kept in a directory of its own, which must belong to us (or
+   root) and only be writable by its owner, or be sticky like /dev/shm.
+   Whatever is at the path is removed and the file is created afresh
+   with O_EXCL and O_NOFOLLOW, so a file or link planted there is never
+   opened, and its owner and mode are checked once it is open.
+
+***************************************************************************/
+/**************************************************************************/
+
+/* make sure the directory the ring lives in is ours, creating it if it
+   isn't there. Returns 0 if it is safe to create the ring in */
+
+int CheckRingDir(const char *path)
+{
+    char dir[gMaxPathLen];
+    const char *slash = strrchr(path, '/');
+    struct stat st;
+
+    if(!slash || slash == path || slash - path >= (int)sizeof(dir))
+        return -1;
+    memcpy(dir, path, slash - path);
+    dir[slash - path] = 0;
+
+    if(mkdir(dir, 0755) < 0 && errno != EEXIST){
+        LogMessage(LOG_INFO,"telemetry: can't create %s, errno=%d", dir, errno);
+        return -1;
+    }
+    if(lstat(dir, &st) < 0 || !S_ISDIR(st.st_mode) ||
+       (st.st_uid != geteuid() && st.st_uid != 0) ||
+       ((st.st_mode & (S_IWGRP|S_IWOTH)) && !(st.st_mode & S_ISVTX))){
+        LogMessage(LOG_INFO,"telemetry: %s is not a directory only we can write to", dir);
+        return -1;
+    }
+    return 0;
+}
+
+int OpenTelemetryRing(TelemetryRing *ring, const char *path, unsigned int capacity)
+{
+    size_t size = sizeof(PsRingHeader) + (size_t)capacity*sizeof(PsRingRecord);
+    struct stat st;
+    void *map;
+    int fd;
+
+    memset(ring, 0, sizeof(*ring));
+
+    if(CheckRingDir(path) < 0)
+        return -1;
+    if(unlink(path) < 0 && errno != ENOENT){
+        LogMessage(LOG_INFO,"telemetry: can't remove the old %s, errno=%d", path, errno);
+        return -1;
+    }
+
+    fd = open(path, O_RDWR|O_CREAT|O_EXCL|O_NOFOLLOW|O_CLOEXEC, 0644);
+    if(fd < 0){
+        LogMessage(LOG_INFO,"telemetry: can't create %s, errno=%d", path, errno);
+        return -1;
+    }
+    if(fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_uid != geteuid() ||
+       fchmod(fd, 0644) < 0){
+        LogMessage(LOG_INFO,"telemetry: %s is not a file of ours", path);
+        close(fd);
+        return -1;
+    }
+    if(ftruncate(fd, size) < 0){
+        LogMessage(LOG_INFO,"telemetry: can't size %s, errno=%d", path, errno);
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+
+    map = mmap(0, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED){
+        LogMessage(LOG_INFO,"telemetry: can't map %s, errno=%d", path, errno);
+        unlink(path);
+        return -1;
+    }
+
+    ring->header = (PsRingHeader *)map;
+    ring->records = (PsRingRecord *)(ring->header + 1);
+    ring->mapSize = size;
+
+    /* slot n % capacity must not look like record n before it is
+       written, and 0 is a valid record number */
+    for(unsigned int i=0;i<capacity;i++)
+        ring->records[i].seq = ~0ULL;
+
+    ring->header->version = PS_RING_VERSION;
+    ring->header->recordSize = sizeof(PsRingRecord);
+    ring->header->capacity = capacity;
+    ring->header->writerPid = getpid();
+    ring->header->head = 0;
+    __atomic_store_n(&ring->header->magic, PS_RING_MAGIC, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void CloseTelemetryRing(TelemetryRing *ring, const char *path)
+{
+    if(!ring->header)
+        return;
+
+    munmap(ring->header, ring->mapSize);
+    memset(ring, 0, sizeof(*ring));
+    unlink(path);
+}
+
+/* append one record. The slot is marked invalid while it is rewritten
+   so a reader copying it at the same time sees the change and counts
+   the record as lost instead of returning a torn one */
+
+void RecordTelemetry(TelemetryRing *ring, int type, int source, int value, int value2)
+{
+    PsRingRecord *slot;
+    struct timespec now;
+    uint64_t n;
+
+    if(!ring->header)
+        return;
+
+    n = ring->header->head;
+    slot = &ring->records[n & (ring->header->capacity - 1)];
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    __atomic_store_n(&slot->seq, ~0ULL, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    slot->timestampNs = now.tv_sec*1000000000ULL + now.tv_nsec;
+    slot->type = type;
+    slot->source = source;
+    slot->value = value;
+    slot->value2 = value2;
+    slot->reserved = 0;
+    __atomic_store_n(&slot->seq, n, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->header->head, n + 1, __ATOMIC_RELEASE);
+}
+
+/* benchmark and self-check: a producer writes records as fast as it can
+   while a reader that keeps up and one that is deliberately slow follow
+   it through the same ring file. Every record must either be read, in
+   order and intact, or be counted as lost; the slow reader must be
+   overrun and notice */
+
+struct RingBench
+{
+    volatile bool       stop;
+    const char          *path;
+    int                 readDelayUs;
+    unsigned long long  produced;
+    unsigned long long  read;
+    unsigned long long  lost;
+    unsigned long long  maxLag;
+    bool                ok;
+};
+
+void *RingBenchReader(void *arg)
+{
+    RingBench *bench = (RingBench *)arg;
+    PsRingReader reader;
+    PsRingRecord record;
+    uint64_t start, expect;
+
+    if(ps_ring_open(&reader, bench->path) < 0)
+        return 0;
+
+    start = expect = reader.pos;
+    bench->ok = true;
+    for(;;){
+        uint64_t lag = ps_ring_lag(&reader);
+
+        if(lag > bench->maxLag)
+            bench->maxLag = lag;
+
+        if(!ps_ring_read(&reader, &record)){
+            if(bench->stop && ps_ring_lag(&reader) == 0)
+                break;
+            continue;
+        }
+
+        /* value carries the low bits of the record number and value2
+           their complement, so a torn or misplaced record shows */
+        if(record.seq != reader.pos - 1 || record.seq < expect ||
+           record.value != (int32_t)record.seq || record.value2 != ~record.value)
+            bench->ok = false;
+        expect = record.seq + 1;
+        bench->read++;
+
+        if(bench->readDelayUs)
+            usleep(bench->readDelayUs);
+    }
+
+    bench->lost = reader.lost;
+    bench->produced = reader.pos - start;
+    ps_ring_close(&reader);
+    return 0;
+}
+
+int BenchRing(int argc, char *argv[])
+{
+    static RingBench readers[2];
+    char path[64];
+    TelemetryRing ring;
+    pthread_t threads[2];
+    unsigned long long records = argc > 1 ? atoll(argv[1]) : 2000000;
+    unsigned int capacity = 1024;
+    struct timespec t0, t1;
+    bool ok = true;
+    double sec;
+    int i;
+
+    snprintf(path, sizeof(path), "/dev/shm/prime-sensors-bench.%d", getpid());
+    if(OpenTelemetryRing(&ring, path, capacity) < 0){
+        fprintf(stderr, "bench ring: can't create %s\n", path);
+        return EXIT_FAILURE;
+    }
+
+    memset(readers, 0, sizeof(readers));
+    readers[1].readDelayUs = 50;
+    for(i=0;i<2;i++){
+        readers[i].path = path;
+        pthread_create(&threads[i], 0, RingBenchReader, &readers[i]);
+    }
+    usleep(10000); /* let the readers map the ring */
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for(unsigned long long n=0;n<records;n++)
+        RecordTelemetry(&ring, PS_RECORD_SAMPLE, 0, (int)n, ~(int)n);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    sec = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec)/1e9;
+
+    for(i=0;i<2;i++){
+        readers[i].stop = true;
+        pthread_join(threads[i], 0);
+    }
+    CloseTelemetryRing(&ring, path);
+
+    printf("ring: producer        %12.0f records/s (%llu records, %u slots)\n",
+           records/sec, records, capacity);
+    for(i=0;i<2;i++){
+        RingBench *r = &readers[i];
+        bool balanced = r->read + r->lost == r->produced && r->produced == records;
+
+        printf("ring: %s reader   %12llu read, %llu lost, max lag %llu%s\n",
+               i ? "slow" : "fast", r->read, r->lost, r->maxLag,
+               r->ok && balanced ? "" : "  FAILED");
+        if(!r->ok || !balanced)
+            ok = false;
+    }
+    if(readers[1].lost == 0){
+        printf("ring: slow reader was never overrun  FAILED\n");
+        ok = false;
+    }
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**************************************************************************/
+/***************************************************************************
+
+   State snapshot
+
+    The latest sensor and actuator state of an engine is copied into its
+   snapshot once per batch of events, with the time each part of it last
+   changed. The main loop answers its own clients from that copy, and
+   publishes it in the engine's snapshotLatch for every other thread:
+   the query threads, which answer PS_OP_GET_STATE on the state socket
+   without waiting for the loop.
+
+    The snapshotLatch is a latched seqlock: it holds two copies of the
+   state and a sequence count. The writer bumps the count (odd), updates
+   copy 0, bumps it again (even) and updates copy 1. A reader always
+   reads the copy selected by the low bit of the count, which is the one
+   the writer is not touching, and only retries if the writer got all
+   the way round to that copy in the meantime. Readers therefore never
+   wait for a write to finish and never write shared memory, so any
+   number of them can run without slowing the writer down. The copies
+   are moved a word at a time with atomic loads and stores, so a reader
+   racing the writer reads stale words, never torn ones, and the count
+   tells it to read again.
+
+***************************************************************************/
+/**************************************************************************/
+
+void WriteSnapshot(SnapshotLatch *latch, const SensorSnapshot *data)
+{
+    unsigned int words[gSnapshotWords] = {}, seq = latch->seq; /* only we write it */
+    int i;
+
+    memcpy(words, data, sizeof(*data));
+
+    __atomic_store_n(&latch->seq, seq + 1, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    for(i=0;i<gSnapshotWords;i++)
+        __atomic_store_n(&latch->copies[0][i], words[i], __ATOMIC_RELAXED);
+
+    __atomic_store_n(&latch->seq, seq + 2, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    for(i=0;i<gSnapshotWords;i++)
+        __atomic_store_n(&latch->copies[1][i], words[i], __ATOMIC_RELAXED);
+}
+
+/* copy out the latest state, from any thread. Returns how many times the
+   read had to be retried, which is almost always 0 */
+
+int ReadSnapshot(const SnapshotLatch *latch, SensorSnapshot *data)
+{
+    unsigned int words[gSnapshotWords], seq;
+    int i, retries = -1;
+
+    do{
+        retries++;
+        seq = __atomic_load_n(&latch->seq, __ATOMIC_ACQUIRE);
+        for(i=0;i<gSnapshotWords;i++)
+            words[i] = __atomic_load_n(&latch->copies[seq & 1][i], __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    }while(__atomic_load_n(&latch->seq, __ATOMIC_RELAXED) != seq);
+
+    memcpy(data, words, sizeof(*data));
+    return retries;
+}
+
+/* called by the main loop after every batch of events. Stamps the time
+   of each change and publishes only if something changed */
+
+void UpdateSnapshot(void)
+{
+    SensorSource *light = &gEngine->sensors[SENSOR_LIGHT];
+    SensorSnapshot *last = &gEngine->snapshot;
+    SensorSnapshot next = *last;
+    long long now = NowMs();
+
+    next.lux = light->valid ? light->value : -1;
+    next.brightness = gEngine->actuators[ACTUATOR_BACKLIGHT].value;
+    next.targetBrightness = RampTarget(&gEngine->backlightRamp);
+    next.autoLight = gEngine->autoLightOn;
+    next.jackPlugged = gEngine->audioJackPlugged;
+    next.audioRoute = gEngine->audioRoute;
+    next.audioOverride = gEngine->audioRouteOverride;
+
+    if(next.lux != last->lux)
+        next.luxMs = now;
+    if(next.brightness != last->brightness ||
+       next.targetBrightness != last->targetBrightness)
+        next.brightnessMs = now;
+    if(next.jackPlugged != last->jackPlugged || next.audioRoute != last->audioRoute)
+        next.jackMs = now;
+
+    if(last->updatedMs != 0 && memcmp(&next, last, sizeof(next)) == 0)
+        return;
+
+    next.seq = ++gEngine->stateSeq;
+    next.updatedMs = now;
+    *last = next;
+    WriteSnapshot(&gEngine->snapshotLatch, last);
+}
+
+/* answer one client of the state socket until it hangs up, goes quiet
+   for gQueryIdleMs or the threads are stopped */
+
+void ServeStateClient(QueryServer *server, int fd)
+{
+    struct pollfd fds[2] = { { fd, POLLIN, 0 }, { server->stopFd, POLLIN, 0 } };
+    SensorSnapshot snap;
+    PsRequest req;
+    PsResponse resp;
+    int len;
+
+    while(poll(fds, 2, gQueryIdleMs) > 0 && !fds[1].revents){
+        if((len = recv(fd, &req, sizeof(req), 0)) <= 0){
+            if(len < 0 && (errno == EAGAIN || errno == EINTR))
+                continue;
+            return;
+        }
+
+        memset(&resp, 0, sizeof(resp));
+        resp.version = PS_PROTOCOL_VERSION;
+        resp.op = req.op;
+        if(len != sizeof(req) || req.version != PS_PROTOCOL_VERSION ||
+           req.op != PS_OP_GET_STATE){
+            resp.status = PS_STATUS_BAD_REQUEST;
+        }else{
+            ReadSnapshot(server->latch, &snap);
+            resp.status = PS_STATUS_OK;
+            resp.seq = snap.seq;
+            FillState(&snap, &resp.state);
+        }
+        if(send(fd, &resp, sizeof(resp), MSG_DONTWAIT|MSG_NOSIGNAL) < 0)
+            return;
+    }
+}
+
+void *QueryThreadMain(void *arg)
+{
+    QueryServer *server = (QueryServer *)arg;
+    struct pollfd fds[2] = { { server->listenFd, POLLIN, 0 }, { server->stopFd, POLLIN, 0 } };
+    int fd;
+
+    for(;;){
+        if(poll(fds, 2, -1) < 0){
+            if(errno == EINTR)
+                continue;
+            break;
+        }
+        if(fds[1].revents)
+            break;
+
+        /* the other threads wake for the same connection; one gets it */
+        if((fd = accept4(server->listenFd, 0, 0, SOCK_NONBLOCK|SOCK_CLOEXEC)) < 0)
+            continue;
+        ServeStateClient(server, fd);
+        close(fd);
+    }
+    return 0;
+}
+
+/**************************************************************************/
+/***************************************************************************
+
+   StartQueryThreads
+
+    Bind the state socket and start gQueryThreads threads to answer it,
+   each one client at a time. Start them with the control signals
+   blocked, which they inherit.
+
+    Inputs:
+
+   none
+
+    Returns:
+
+    status code indicating success - 0 = success; clients then have to
+   ask the control socket
+
+***************************************************************************/
+/**************************************************************************/
+
+int StartQueryThreads(void)
+{
+    QueryServer *server = &gEngine->queryServer;
+    int err;
+
+    /* a client may ask before the first batch of events is in */
+    UpdateSnapshot();
+
+    if(BindPassiveSocket(gEngine->stateSocketPath, &server->listenFd) < 0)
+        return -1;
+    if((server->stopFd = eventfd(0, EFD_CLOEXEC)) < 0){
+        StopQueryThreads();
+        return -1;
+    }
+
+    for(server->numThreads=0;server->numThreads<gQueryThreads;server->numThreads++){
+        pthread_t *thread = &server->threads[server->numThreads];
+
+        if((err = pthread_create(thread, 0, QueryThreadMain, server)) != 0){
+            StopQueryThreads();
+            errno = err;
+            return -1;
+        }
+        pthread_setname_np(*thread, "ps-query");
+    }
+    return 0;
+}
+
+/* stop the query threads, and remove the state socket */
+
+void StopQueryThreads(void)
+{
+    QueryServer *server = &gEngine->queryServer;
+    unsigned long long one = 1;
+    int i;
+
+    if(server->numThreads)
+        write(server->stopFd, &one, sizeof(one));
+    for(i=0;i<server->numThreads;i++)
+        pthread_join(server->threads[i], 0);
+    server->numThreads = 0;
+
+    if(server->stopFd >= 0)
+        close(server->stopFd);
+    server->stopFd = -1;
+    if(server->listenFd >= 0){
+        close(server->listenFd);
+        unlink(gEngine->stateSocketPath);
+    }
+    server->listenFd = -1;
+}
+
+/* benchmark: how fast the writer publishes with and without readers.
+   Writer throughput is measured per second of the writer thread's own
+   CPU time, so the result still means something when there are fewer
+   CPUs than threads. Every read is checked for a torn snapshot */
+
+struct SnapshotBench
+{
+    volatile bool       stop;
+    double              writerCpuSec;
+    unsigned long long  writes;
+    unsigned long long  reads;
+    unsigned long long  retries;
+    unsigned long long  torn;
+    SnapshotLatch       latch;
+};
+
+void *SnapshotBenchWriter(void *arg)
+{
+    SnapshotBench *bench = (SnapshotBench *)arg;
+    SensorSnapshot data;
+    struct timespec cpu;
+
+    memset(&data, 0, sizeof(data));
+    while(!bench->stop){
+        data.lux++;
+        data.seq = data.lux;
+        data.brightness = data.lux & 0xff;
+        data.updatedMs = data.lux;
+        WriteSnapshot(&bench->latch, &data);
+        bench->writes++;
+    }
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+    bench->writerCpuSec = cpu.tv_sec + cpu.tv_nsec/1e9;
+    return 0;
+}
+
+void *SnapshotBenchReader(void *arg)
+{
+    SnapshotBench *bench = (SnapshotBench *)arg;
+    unsigned long long reads = 0, retries = 0, torn = 0;
+    SensorSnapshot data;
+
+    while(!bench->stop){
+        retries += ReadSnapshot(&bench->latch, &data);
+        if(data.seq != (unsigned int)data.lux || data.brightness != (data.lux & 0xff) ||
+           data.updatedMs != data.lux)
+            torn++;
+        reads++;
+    }
+
+    __sync_fetch_and_add(&bench->reads, reads);
+    __sync_fetch_and_add(&bench->retries, retries);
+    __sync_fetch_and_add(&bench->torn, torn);
+    return 0;
+}
+
+/* run the writer for a while alongside numReaders readers */
+
+void RunSnapshotBench(int numReaders, int ms, SnapshotBench *bench)
+{
+    pthread_t threads[64];
+    int i;
+
+    memset(bench, 0, sizeof(*bench));
+
+    pthread_create(&threads[0], 0, SnapshotBenchWriter, bench);
+    for(i=1;i<=numReaders;i++)
+        pthread_create(&threads[i], 0, SnapshotBenchReader, bench);
+
+    usleep(ms*1000);
+    bench->stop = true;
+
+    for(i=0;i<=numReaders;i++)
+        pthread_join(threads[i], 0);
+}
+
+int BenchSnapshot(int argc, char *argv[])
+{
+    static SnapshotBench bench;
+    int numReaders = argc > 1 ? atoi(argv[1]) : 4;
+    int seconds = argc > 2 ? atoi(argv[2]) : 2;
+    double baseline;
+
+    if(numReaders < 1 || numReaders > 63 || seconds < 1){
+        fprintf(stderr, "usage: prime-sensors bench snapshot [readers 1..63] [seconds]\n");
+        return EXIT_FAILURE;
+    }
+
+    RunSnapshotBench(0, seconds*1000, &bench);
+    baseline = bench.writes/bench.writerCpuSec;
+    printf("snapshot: writer alone        %12.0f writes/cpu-s\n", baseline);
+
+    RunSnapshotBench(numReaders, seconds*1000, &bench);
+    printf("snapshot: writer, %2d readers  %12.0f writes/cpu-s (%.1f%% of alone)\n",
+           numReaders, bench.writes/bench.writerCpuSec,
+           100.0*bench.writes/bench.writerCpuSec/baseline);
+    printf("snapshot: readers             %12.0f reads/s, %.3f%% retried\n",
+           (double)bench.reads/seconds,
+           bench.reads ? 100.0*bench.retries/bench.reads : 0.0);
+    if(bench.torn)
+        printf("snapshot: %llu torn reads  FAILED\n", bench.torn);
+
+    return bench.torn ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/**************************************************************************/
+/***************************************************************************
+
+   Replay
+
+    A replay runs the real sensor, policy and actuator code against a
+   recorded trace instead of the hardware, on a virtual clock, as fast
+   as the CPU allows. Every sensor and actuator is backed by a memfd in
+   place of its sysfs attribute, so the code under test is the code
+   that runs on the device. Only the kernel is stood in for: ReplayTrace
+   steps the clock from one trace event or timer expiry to the next and
+   wakes the loop as the kernel would, with a uevent on the kernel's end
+   of a socket pair or a tick on an eventfd in place of each timerfd,
+   then lets WaitForEvents handle it. So the wakeups and system calls
+   it counts are the loop's own.
+
+    A trace file holds one "<ms> <device> <text>" line per change, in
+   time order, where device is a gSensorTable name and text is what its
+   attribute would read, or a gActuatorTable name and the level something
+   other than the daemon set it to, e.g.
+
+   0      light       120
+   0      audio-jack  0
+   2500   audio-jack  1
+   60000  backlight   0
+
+    Sensors that announce every change by uevent see the change at once;
+   the others at their next sample. Blank lines and lines starting with
+   '#' are ignored.
+
+***************************************************************************/
+/**************************************************************************/
+
+long long const         gReplayEpochMs = 1000000;   /* virtual uptime at 0 */
+int const               gNumStandardTraces = 8;     /* see MakeStandardTrace */
+
+struct TraceEvent
+{
+    long long           ms;
+    int                 sensor;             /* NUM_SENSORS up: an actuator */
+    char                text[32];
+};
+
+struct Trace
+{
+    const char          *name;
+    TraceEvent          *events;
+    int                 count;
+    int                 size;
+    long long           lengthMs;
+};
+
+struct ReplayResult
+{
+    long long           virtualMs;
+    double              cpuSec;
+    LoopCounters        counters;
+};
+
+int AddTraceEvent(Trace *trace, long long ms, int sensor, const char *text)
+{
+    if(trace->count == trace->size){
+        int size = trace->size ? trace->size*2 : 256;
+        TraceEvent *events = (TraceEvent *)realloc(trace->events, size*sizeof(TraceEvent));
+
+        if(!events)
+            return -1;
+        trace->events = events;
+        trace->size = size;
+    }
+
+    TraceEvent *event = &trace->events[trace->count++];
+    event->ms = ms;
+    event->sensor = sensor;
+    snprintf(event->text, sizeof(event->text), "%s", text);
+    if(ms > trace->lengthMs)
+        trace->lengthMs = ms;
+    return 0;
+}
+
+void FreeTrace(Trace *trace)
+{
+    free(trace->events);
+    memset(trace, 0, sizeof(*trace));
+}
+
+/* read a trace file. Returns 0, or -1 with a message in err */
+
+int LoadTrace(const char *path, Trace *trace, char *err, int errLen)
+{
+    char line[256], name[32], *p, *end;
+    int lineNo = 0, i;
+    long long ms;
+    FILE *file;
+
+    memset(trace, 0, sizeof(*trace));
+    trace->name = path;
+
+    if(!(file = fopen(path, "r"))){
+        snprintf(err, errLen, "%s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    while(fgets(line, sizeof(line), file)){
+        lineNo++;
+        for(p = line; *p == ' ' || *p == '\t'; p++)
+            ;
+        if(*p == '#' || *p == '\n' || *p == 0)
+            continue;
+
+        ms = strtoll(p, &end, 10);
+        if(end == p || ms < 0 || ms < trace->lengthMs ||
+           sscanf(end, " %31s %n", name, &i) != 1){
+            snprintf(err, errLen, "%s:%d: expected \"<ms> <device> <text>\" in time order",
+                     path, lineNo);
+            break;
+        }
+        p = end + i;
+        p[strcspn(p, "\n")] = 0;
+
+        for(i=0;i<NUM_SENSORS && strcmp(gSensorTable[i].name, name) != 0;i++)
+            ;
+        for(;i>=NUM_SENSORS && i<NUM_SENSORS+NUM_ACTUATORS &&
+             strcmp(gEngine->actuators[i-NUM_SENSORS].name, name) != 0;i++)
+            ;
+        if(i == NUM_SENSORS+NUM_ACTUATORS){
+            snprintf(err, errLen, "%s:%d: no device called \"%s\"", path, lineNo, name);
+            break;
+        }
+
+        if(AddTraceEvent(trace, ms, i, p) < 0){
+            snprintf(err, errLen, "%s: out of memory", path);
+            break;
+        }
+    }
+
+    if(!feof(file)){
+        fclose(file);
+        FreeTrace(trace);
+        return -1;
+    }
+
+    fclose(file);
+    return 0;
+}
+
+/* put a sensor's attribute text where the next read will find it, as
+   the driver would */
+
+void SetReplayAttr(int fd, const char *text)
+{
+    int len = strlen(text);
+
+    pwrite(fd, text, len, 0);
+    ftruncate(fd, len);
+}
+
+/* wake the loop the way the kernel would: a uevent on the socket, or a
+   tick on one of the timers, then let it handle just that */
+
+void ReplayWakeup(int fd, const char *devpath)
+{
+    char msg[gMaxPathLen + 32];
+    unsigned long long one = 1;
+
+    if(devpath){
+        int len = snprintf(msg, sizeof(msg), "change@/devices/virtual%s", devpath);
+        send(fd, msg, len + 1, 0);
+    }else{
+        write(fd, &one, sizeof(one));
+    }
+    WaitForEvents(0);
+}
+
+/**************************************************************************/
+/***************************************************************************
+
+   ReplayTrace
+
+    Run the daemon's handlers over a trace on the virtual clock, in an
+   engine of its own that starts as main() would start it.
+
+    Inputs:
+
+   trace		 I					  the trace
+
+   base			 I					  settings to run with; device
+										  paths and the mixer backend
+										  are replaced
+
+   verbose		 I					  print every actuator write and
+										  audio route change
+
+   result		 O					  what the loop did
+
+    Returns:
+
+    0, or -1 if the in-memory devices could not be set up
+
+***************************************************************************/
+/**************************************************************************/
+
+int ReplayTrace(const Trace *trace, const Config *base, bool verbose, ReplayResult *result)
+{
+    int sensorFd[NUM_SENSORS], sinkFd[NUM_ACTUATORS], sinkLevel[NUM_ACTUATORS];
+    int samplePeriodMs = 0, lastRoute, lastLevel, next = 0, i;
+    int ueventPair[2], kernelSide;
+    unsigned long long writes;
+    long long now = 0, sampleAt = -1, rampAt = -1;
+    struct timespec cpu0, cpu1;
+    char level[16];
+    Engine *current = gEngine, *engine;
+    Config *config;
+
+    if(!(config = (Config *)malloc(sizeof(Config))))
+        return -1;
+    if(!(engine = CreateEngine(0))){
+        free(config);
+        return -1;
+    }
+    gEngine = engine;
+
+    /* the wakeups the loop would have: uevents from the kernel's end of
+       a socket pair, and an eventfd for each timer in place of the
+       timerfd, which runs on the real clock */
+    EventSource ueventSource = { -1, OnUevent, 0, 0 };
+    EventSource timerSource = { -1, OnSampleTimer, 0, 0 };
+    EventSource rampSource = { -1, OnRampFrame, &engine->backlightRamp, 0 };
+    *config = *base;
+    snprintf(config->mixerBackend, sizeof(config->mixerBackend), "fake");
+    snprintf(config->ioEngine, sizeof(config->ioEngine), "epoll");
+    config->learnPath[0] = 0; /* learn, but leave the file alone */
+
+    /* each sensor starts out reading its first value in the trace. One
+       the trace never mentions isn't there, as on a device without it */
+    for(i=0;i<NUM_SENSORS;i++){
+        sensorFd[i] = memfd_create(engine->sensors[i].name, MFD_CLOEXEC);
+        config->sensorPath[i][0] = 0;
+        config->sensorThread[i] = 0; /* the virtual clock can't wait for one */
+        for(int e=0;e<trace->count;e++){
+            if(trace->events[e].sensor == i){
+                snprintf(config->sensorPath[i], gMaxPathLen, "/proc/self/fd/%d", sensorFd[i]);
+                SetReplayAttr(sensorFd[i], trace->events[e].text);
+                break;
+            }
+        }
+    }
+    snprintf(level, sizeof(level), "%d", gDisplayMaxBrightness);
+    for(i=0;i<NUM_ACTUATORS;i++){
+        sinkFd[i] = memfd_create(engine->actuators[i].name, MFD_CLOEXEC);
+        snprintf(config->actuatorPath[i], gMaxPathLen, "/proc/self/fd/%d", sinkFd[i]);
+        SetReplayAttr(sinkFd[i], level);
+        sinkLevel[i] = gDisplayMaxBrightness;
+    }
+
+    engine->suspendedMs = SuspendedMs();
+    gVirtualClock = true;
+    gVirtualNowMs = gReplayEpochMs;
+
+    if(socketpair(AF_UNIX, SOCK_DGRAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0, ueventPair) < 0)
+        ueventPair[0] = ueventPair[1] = -1;
+    gUeventSocket = ueventSource.fd = ueventPair[0];
+    kernelSide = ueventPair[1];
+    timerSource.fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    rampSource.fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    WatchEventSource(&ueventSource, EPOLLIN);
+    WatchEventSource(&timerSource, EPOLLIN);
+    WatchEventSource(&rampSource, EPOLLIN);
+
+    engine->sampleTimer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+    engine->sampleTimerPeriodMs = 0;
+    for(i=0;i<NUM_SENSORS;i++)
+        SetSensorEnabled(&engine->sensors[i], true);
+    ResetLuxFilter(&engine->luxFilter);
+    OpenRamp(&engine->backlightRamp, &engine->actuators[ACTUATOR_BACKLIGHT]);
+    epoll_ctl(gEpollDesc, EPOLL_CTL_DEL, engine->backlightRamp.event.fd, 0);
+    ApplyConfig(config);
+
+    lastLevel = engine->actuators[ACTUATOR_BACKLIGHT].value;
+    lastRoute = engine->audioRoute;
+    memset(&engine->counters, 0, sizeof(engine->counters));
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu0);
+
+    for(;;){
+        long long when = -1;
+
+        /* the timers as epoll would see them */
+        if(engine->sampleTimerPeriodMs != samplePeriodMs){
+            samplePeriodMs = engine->sampleTimerPeriodMs;
+            sampleAt = samplePeriodMs ? now + samplePeriodMs : -1;
+        }
+        if(!engine->backlightRamp.active)
+            rampAt = -1;
+        else if(rampAt < 0)
+            rampAt = now + engine->backlightRamp.frameMs;
+
+        if(next < trace->count)
+            when = trace->events[next].ms;
+        if(sampleAt >= 0 && (when < 0 || sampleAt < when))
+            when = sampleAt;
+        if(rampAt >= 0 && (when < 0 || rampAt < when))
+            when = rampAt;
+        if(when < 0 || when > trace->lengthMs)
+            break;
+
+        now = when;
+        gVirtualNowMs = gReplayEpochMs + now; /* latencies are in virtual time */
+        writes = engine->counters.actuatorWrites;
+
+        if(next < trace->count && trace->events[next].ms == now &&
+           trace->events[next].sensor >= NUM_SENSORS){
+            const TraceEvent *event = &trace->events[next++];
+
+            /* someone else setting the backlight raises a uevent, as
+               any write to it does, and we read it back */
+            ActuatorSink *sink = &engine->actuators[event->sensor - NUM_SENSORS];
+
+            SetReplayAttr(sinkFd[event->sensor - NUM_SENSORS], event->text);
+            sinkLevel[event->sensor - NUM_SENSORS] = atoi(event->text);
+            if(sink->ueventMatch)
+                ReplayWakeup(kernelSide, sink->ueventMatch);
+            continue;
+        }else if(next < trace->count && trace->events[next].ms == now){
+            const TraceEvent *event = &trace->events[next++];
+            SensorSource *sensor = &engine->sensors[event->sensor];
+
+            /* a polled sensor is left for the sample timer to find */
+            SetReplayAttr(sensorFd[event->sensor], event->text);
+            if(!sensor->polled)
+                ReplayWakeup(kernelSide, sensor->ueventMatch);
+        }else if(sampleAt == now){
+            ReplayWakeup(timerSource.fd, 0);
+            sampleAt += samplePeriodMs;
+        }else{
+            ReplayWakeup(rampSource.fd, 0);
+            rampAt += engine->backlightRamp.frameMs;
+        }
+
+        /* a sysfs attribute reads back just what was last written; a
+           memfd only does once it is cut to length */
+        for(i=0;writes != engine->counters.actuatorWrites && i<NUM_ACTUATORS;i++){
+            if(engine->actuators[i].value != sinkLevel[i]){
+                sinkLevel[i] = engine->actuators[i].value;
+                snprintf(level, sizeof(level), "%d", sinkLevel[i]);
+                SetReplayAttr(sinkFd[i], level);
+            }
+        }
+
+        if(verbose && engine->actuators[ACTUATOR_BACKLIGHT].value != lastLevel){
+            lastLevel = engine->actuators[ACTUATOR_BACKLIGHT].value;
+            printf("%8lld backlight %d\n", now, lastLevel);
+        }
+        if(verbose && engine->audioRoute != lastRoute){
+            lastRoute = engine->audioRoute;
+            printf("%8lld audio %s\n", now,
+                   lastRoute == PS_AUDIO_HEADPHONE ? "headphone" : "speaker");
+        }
+    }
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu1);
+    result->virtualMs = trace->lengthMs;
+    result->cpuSec = (cpu1.tv_sec - cpu0.tv_sec) + (cpu1.tv_nsec - cpu0.tv_nsec)/1e9;
+    result->counters = engine->counters;
+
+    StopEngine(engine);
+    DestroyEngine(engine);
+    gEngine = current;
+    close(ueventPair[0]);
+    close(ueventPair[1]);
+    gUeventSocket = -1;
+    close(timerSource.fd);
+    close(rampSource.fd);
+    for(i=0;i<NUM_SENSORS;i++)
+        close(sensorFd[i]);
+    for(i=0;i<NUM_ACTUATORS;i++)
+        close(sinkFd[i]);
+    gVirtualClock = false;
+
+    return 0;
+}
+
+/* the built-in settings, as a replay starts from */
+
+void ReplayConfig(Config *config)
+{
+    static bool haveBuiltin = false;
+
+    if(!haveBuiltin){
+        DefaultConfig(&gBuiltinConfig);
+        haveBuiltin = true;
+    }
+    *config = gBuiltinConfig;
+}
+
+/* "prime-sensors replay <trace> [config]": print what the daemon would
+   have done over a trace */
+
+int RunReplay(int argc, char *argv[])
+{
+    static Config config;
+    ReplayResult result;
+    char err[256];
+    Trace trace;
+
+    if(argc < 1 || argc > 2){
+        fprintf(stderr, "usage: prime-sensors replay <trace> [config]\n");
+        return EXIT_FAILURE;
+    }
+
+    setlogmask(LOG_UPTO(LOG_WARNING));
+    ReplayConfig(&config);
+    if(argc > 1){
+        Config *loaded = LoadConfig(argv[1], err, sizeof(err));
+
+        if(!loaded){
+            fprintf(stderr, "%s\n", err);
+            return EXIT_FAILURE;
+        }
+        config = *loaded;
+        free(loaded);
+    }
+
+    if(LoadTrace(argv[0], &trace, err, sizeof(err)) < 0){
+        fprintf(stderr, "%s\n", err);
+        return EXIT_FAILURE;
+    }
+
+    if(CreateEventLoop() < 0 || ReplayTrace(&trace, &config, true, &result) < 0){
+        perror("can't set up the replay");
+        FreeTrace(&trace);
+        return EXIT_FAILURE;
+    }
+
+    printf("%lld ms: %llu wakeups, %llu decisions, %llu actuator writes, "
+           "%llu mixer switches, %llu syscalls\n", result.virtualMs,
+           result.counters.wakeups, result.counters.decisions,
+           result.counters.actuatorWrites, result.counters.mixerSwitches,
+           result.counters.syscalls);
+
+    FreeTrace(&trace);
+    return EXIT_SUCCESS;
+}
+
+/* the standard traces for "bench replay", each an hour long. A small
+   LCG keeps them the same from run to run for the same seed */
+
+unsigned int TraceNoise(unsigned int *seed, int range)
+{
+    *seed = *seed*1103515245 + 12345;
+    return (*seed >> 16) % range;
+}
+
+int MakeStandardTrace(int which, unsigned int seed, Trace *trace)
+{
+    static const char *const names[] =
+        { "dark-room", "office", "clouds", "flicker", "headset", "screen-off",
+          "override", "panel-off" };
+    long long const hourMs = 3600000;
+    char text[32];
+    long long ms;
+    int lux = 0, result = 0;
+
+    if(which < 0 || which >= (int)(sizeof(names)/sizeof(names[0])))
+        return -1;
+
+    memset(trace, 0, sizeof(*trace));
+    trace->name = names[which];
+    result |= AddTraceEvent(trace, 0, SENSOR_AUDIO_JACK, "0");
+
+    for(ms=0;ms<=hourMs;ms+=gLightSamplePeriodMs){
+        switch(which){
+            case 0: /* nothing changes */
+                lux = 3;
+                break;
+            case 1: /* indoor light drifting slowly, with sensor noise */
+                lux = 300 + (int)(100*sin(ms*2*M_PI/1200000)) +
+                      TraceNoise(&seed, 21) - 10;
+                break;
+            case 2: /* sun and cloud, a new level every half minute or so */
+                if(ms % 30000 == 0)
+                    lux = 150 + TraceNoise(&seed, 1050);
+                break;
+            case 3: /* a light flashing on and off every second */
+                lux = (ms/1000) % 2 ? 400 : 20;
+                break;
+            case 4: /* a headset plugged in and out every minute */
+                lux = 200;
+                if(ms % 60000 == 0 && ms > 0)
+                    result |= AddTraceEvent(trace, ms, SENSOR_AUDIO_JACK,
+                                            (ms/60000) % 2 ? "1" : "0");
+                break;
+            case 5: /* office light, the screen blanked for 40 minutes */
+                lux = 300 + TraceNoise(&seed, 21) - 10;
+                if(ms == 600000)
+                    result |= AddTraceEvent(trace, ms, NUM_SENSORS + ACTUATOR_BACKLIGHT, "0");
+                if(ms == 3000000)
+                    result |= AddTraceEvent(trace, ms, NUM_SENSORS + ACTUATOR_BACKLIGHT, "180");
+                break;
+            case 6: /* office light drifting, the user turning the screen
+                       down whenever it isn't where they left it */
+                lux = 300 + (int)(100*sin(ms*2*M_PI/1200000)) +
+                      TraceNoise(&seed, 21) - 10;
+                if(ms % 300000 == 150000)
+                    result |= AddTraceEvent(trace, ms, NUM_SENSORS + ACTUATOR_BACKLIGHT, "90");
+                break;
+            case 7: /* office light, the panel blanked for 40 minutes with
+                       the backlight level left as it was */
+                lux = 300 + TraceNoise(&seed, 21) - 10;
+                if(ms == 0 || ms == 600000 || ms == 3000000)
+                    result |= AddTraceEvent(trace, ms, SENSOR_DISPLAY_POWER,
+                                            ms == 600000 ? "4" : "0");
+                break;
+        }
+        snprintf(text, sizeof(text), "%d", lux);
+        result |= AddTraceEvent(trace, ms, SENSOR_LIGHT, text);
+    }
+
+    if(result < 0)
+        FreeTrace(trace);
+    return result;
+}
+
+/* benchmark: replay the standard traces, or the trace files given, and
+   report the cost of the control path. Each trace is run twice, the
+   second time with sampling held at the full rate, to show what backing
+   off saves */
+
+int BenchReplay(int argc, char *argv[])
+{
+    static Config config, fixed;
+    ReplayResult result;
+    char err[256];
+    Trace trace;
+    int i, numTraces = argc > 1 ? argc - 1 : gNumStandardTraces;
+
+    setlogmask(LOG_UPTO(LOG_WARNING));
+    ReplayConfig(&config);
+    fixed = config;
+    for(i=0;i<NUM_SENSORS;i++)
+        fixed.sensorMaxPeriodMs[i] = fixed.sensorPeriodMs[i];
+    if(CreateEventLoop() < 0){
+        perror("can't set up the replay");
+        return EXIT_FAILURE;
+    }
+
+    printf("%-18s %12s %10s %10s %10s %14s\n", "trace", "decisions/s",
+           "writes/h", "reads/h", "wakeups/h", "syscalls/tick");
+    for(i=0;i<numTraces*2;i++){
+        if(argc > 1 ? LoadTrace(argv[i/2+1], &trace, err, sizeof(err)) < 0
+                    : MakeStandardTrace(i/2, 1, &trace) < 0){
+            fprintf(stderr, "%s\n", argc > 1 ? err : "out of memory");
+            return EXIT_FAILURE;
+        }
+
+        if(ReplayTrace(&trace, i%2 ? &fixed : &config, false, &result) < 0){
+            perror("can't set up the replay");
+            FreeTrace(&trace);
+            return EXIT_FAILURE;
+        }
+
+        const LoopCounters *c = &result.counters;
+        double hours = result.virtualMs/3600000.0;
+        char name[32];
+
+        snprintf(name, sizeof(name), "%s%s", trace.name, i%2 ? "/fixed" : "");
+        if(hours <= 0)
+            hours = 1;
+        printf("%-18s %12.0f %10.0f %10.0f %10.0f %14.2f\n", name,
+               result.cpuSec > 0 ? c->decisions/result.cpuSec : 0.0,
+               (c->actuatorWrites + c->mixerSwitches)/hours,
+               c->sensorReads/hours, c->wakeups/hours,
+               c->wakeups ? (double)c->syscalls/c->wakeups : 0.0);
+        FreeTrace(&trace);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/**************************************************************************/
+/***************************************************************************
+
+   BenchFleet
+
+    "prime-sensors bench fleet [instances] [hours]" - how many devices
+   one host could run the daemon for. Every instance is an Engine of
+   its own, see "Engines", all of them in this process, each started by
+   StartEngine on memfds in place of its light sensor, headset jack and
+   backlight, and run on the virtual clock as ReplayTrace runs one, so
+   an hour of thousands of devices takes seconds.
+
+    Each device sees a scene of its own, from a seed of its own: the
+   light jumps between dark, indoor and daylight every gFleetSceneMinMs
+   to gFleetSceneMaxMs, and now and then the headset is plugged in or
+   pulled out instead. There is no uevent socket, so both sensors are
+   polled. A binary heap keyed on each instance's next scene change,
+   sample or ramp frame picks the instance to run next; its handlers
+   are called through DispatchEvent, as the main loop calls them.
+
+    CPU time is the process's over the run, so it is what the instances
+   cost together, divided out per instance-hour. The latency of a light
+   change is in virtual time, from the change to the first backlight
+   write after it, so it includes the wait for the next sample.
+
+    The instances must not see each other: one of them is then run
+   again on its own, and must do exactly what it did in the fleet.
+
+    Inputs:
+
+   argc, argv	 I					  the arguments after "bench"
+
+    Returns:
+
+    the process exit status
+
+***************************************************************************/
+/**************************************************************************/
+
+int const               gFleetSceneMinMs = 20000;
+int const               gFleetSceneMaxMs = 90000;
+int const               gFleetFds = 5;              /* per instance: 3 memfds, 2 timerfds */
+
+/* one simulated device */
+
+struct FleetInstance
+{
+    Engine              *engine;
+    unsigned int        seed;               /* of its scene, never 0 */
+    int                 luxFd;              /* memfds in place of sysfs */
+    int                 jackFd;
+    int                 backlightFd;
+    int                 band;               /* dark, indoor, daylight */
+    bool                jackPlugged;
+    int                 level;              /* the backlight as it reads back */
+    int                 samplePeriodMs;     /* as the sample timer was armed */
+    long long           changeAt;           /* virtual ms of the next scene change */
+    long long           sampleAt;           /* -1 = the timer is disarmed */
+    long long           rampAt;             /* -1 = no ramp */
+    long long           stepAt;             /* a light change not yet written, -1 = none */
+    long long           nextAt;             /* the first of the three */
+    LoopCounters        counters;           /* when it was stopped */
+};
+
+struct FleetResult
+{
+    double              cpuSec;
+    LoopCounters        total;
+    unsigned long long  lightChanges;
+    StageStats          latency;            /* of the ones that got a write */
+};
+
+/* xorshift, so a scene is the same every run */
+
+unsigned int FleetRandom(unsigned int *seed)
+{
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 17;
+    *seed ^= *seed << 5;
+    return *seed;
+}
+
+/* move an instance's scene on: a jump of the light into another band,
+   or, one time in eight, the headset */
+
+void ChangeFleetScene(FleetInstance *inst, long long now)
+{
+    static const int bands[][2] = { { 1, 10 }, { 100, 500 }, { 2000, 20000 } };
+    unsigned int r = FleetRandom(&inst->seed);
+    char text[16];
+
+    if(r % 8 == 0){
+        inst->jackPlugged = !inst->jackPlugged;
+        SetReplayAttr(inst->jackFd, inst->jackPlugged ? "1" : "0");
+    }else{
+        inst->band = (inst->band + 1 + (r >> 3) % 2) % 3;
+        snprintf(text, sizeof(text), "%d", bands[inst->band][0] +
+                 (int)((r >> 4) % (bands[inst->band][1] - bands[inst->band][0])));
+        SetReplayAttr(inst->luxFd, text);
+        inst->stepAt = now;
+    }
+    inst->changeAt = now + gFleetSceneMinMs +
+                     (long long)(FleetRandom(&inst->seed) % (gFleetSceneMaxMs - gFleetSceneMinMs));
+}
+
+/* when an instance next has something to do, with its timers as epoll
+   would see them */
+
+void ScheduleFleetInstance(FleetInstance *inst, long long now)
+{
+    Engine *engine = inst->engine;
+
+    if(engine->sampleTimerPeriodMs != inst->samplePeriodMs){
+        inst->samplePeriodMs = engine->sampleTimerPeriodMs;
+        inst->sampleAt = inst->samplePeriodMs ? now + inst->samplePeriodMs : -1;
+    }
+    if(!engine->backlightRamp.active)
+        inst->rampAt = -1;
+    else if(inst->rampAt < 0)
+        inst->rampAt = now + engine->backlightRamp.frameMs;
+
+    inst->nextAt = inst->changeAt;
+    if(inst->sampleAt >= 0 && inst->sampleAt < inst->nextAt)
+        inst->nextAt = inst->sampleAt;
+    if(inst->rampAt >= 0 && inst->rampAt < inst->nextAt)
+        inst->nextAt = inst->rampAt;
+}
+
+/* set up instance number n of a fleet, with its own copy of base.
+   Returns 0, or -1 if it could not be */
+
+int StartFleetInstance(FleetInstance *inst, int n, const Config *base)
+{
+    char level[16];
+    Config *config;
+
+    memset(inst, 0, sizeof(*inst));
+    inst->seed = 2654435761u*(n + 1) | 1;
+    inst->luxFd = memfd_create("light", MFD_CLOEXEC);
+    inst->jackFd = memfd_create("audio-jack", MFD_CLOEXEC);
+    inst->backlightFd = memfd_create("backlight", MFD_CLOEXEC);
+    inst->level = gDisplayMaxBrightness;
+    inst->sampleAt = inst->rampAt = inst->stepAt = -1;
+    if(inst->luxFd < 0 || inst->jackFd < 0 || inst->backlightFd < 0 ||
+       !(config = (Config *)malloc(sizeof(Config))))
+        return -1;
+
+    *config = *base;
+    for(int i=0;i<NUM_SENSORS;i++){
+        config->sensorPath[i][0] = 0;
+        config->sensorThread[i] = 0; /* the virtual clock can't wait for one */
+    }
+    snprintf(config->sensorPath[SENSOR_LIGHT], gMaxPathLen, "/proc/self/fd/%d", inst->luxFd);
+    snprintf(config->sensorPath[SENSOR_AUDIO_JACK], gMaxPathLen, "/proc/self/fd/%d", inst->jackFd);
+    snprintf(config->actuatorPath[ACTUATOR_BACKLIGHT], gMaxPathLen, "/proc/self/fd/%d",
+             inst->backlightFd);
+    snprintf(config->mixerBackend, sizeof(config->mixerBackend), "fake");
+    snprintf(config->ioEngine, sizeof(config->ioEngine), "epoll");
+    config->learnPath[0] = 0;
+
+    /* indoors with the headset out, until a time of its own */
+    inst->band = 1;
+    inst->changeAt = FleetRandom(&inst->seed) % gFleetSceneMaxMs;
+    SetReplayAttr(inst->luxFd, "100");
+    SetReplayAttr(inst->jackFd, "0");
+    snprintf(level, sizeof(level), "%d", inst->level);
+    SetReplayAttr(inst->backlightFd, level);
+
+    if(!(inst->engine = CreateEngine(0))){
+        free(config);
+        return -1;
+    }
+    if(StartEngine(inst->engine, config) < 0)
+        return -1;
+    memset(&inst->engine->counters, 0, sizeof(inst->engine->counters));
+    ScheduleFleetInstance(inst, 0);
+    return 0;
+}
+
+void StopFleetInstance(FleetInstance *inst)
+{
+    if(inst->engine){
+        inst->counters = inst->engine->counters;
+        StopEngine(inst->engine);
+        DestroyEngine(inst->engine);
+        inst->engine = 0;
+    }
+    if(inst->luxFd >= 0)
+        close(inst->luxFd);
+    if(inst->jackFd >= 0)
+        close(inst->jackFd);
+    if(inst->backlightFd >= 0)
+        close(inst->backlightFd);
+}
+
+/* run the instance whose time has come, at now: the kernel's part of
+   it, a scene change, or the loop's, a sample or a ramp frame */
+
+void StepFleetInstance(FleetInstance *inst, long long now, FleetResult *result)
+{
+    Engine *engine = inst->engine;
+    ActuatorSink *backlight = &engine->actuators[ACTUATOR_BACKLIGHT];
+    char level[16];
+
+    gVirtualNowMs = gReplayEpochMs + now;
+    gEngine = engine;
+
+    if(inst->changeAt == now){
+        if(inst->stepAt >= 0 && inst->stepAt != now)
+            result->lightChanges++;     /* never written */
+        ChangeFleetScene(inst, now);
+    }else{
+        gWakeNs = StatStart();
+        engine->counters.wakeups++;
+        if(inst->sampleAt == now){
+            DispatchEvent(&engine->sampleTimer, EPOLLIN);
+            inst->sampleAt += inst->samplePeriodMs;
+        }else{
+            DispatchEvent(&engine->backlightRamp.event, EPOLLIN);
+            inst->rampAt += engine->backlightRamp.frameMs;
+        }
+        PublishEngineState();
+
+        /* a sysfs attribute reads back just what was last written */
+        if(backlight->value >= 0 && backlight->value != inst->level){
+            inst->level = backlight->value;
+            snprintf(level, sizeof(level), "%d", inst->level);
+            SetReplayAttr(inst->backlightFd, level);
+            if(inst->stepAt >= 0){
+                unsigned long long ns = (now - inst->stepAt)*1000000ULL;
+
+                result->lightChanges++;
+                result->latency.count++;
+                result->latency.totalNs += ns;
+                if(ns > result->latency.maxNs)
+                    result->latency.maxNs = ns;
+                result->latency.buckets[HistogramBucket(ns)]++;
+                inst->stepAt = -1;
+            }
+        }
+    }
+
+    ScheduleFleetInstance(inst, now);
+}
+
+/* keep the instance with the earliest nextAt at the top of the heap.
+   Only the top one ever moves, and only later */
+
+void SiftFleetHeap(FleetInstance **heap, int count, int i)
+{
+    for(;;){
+        int first = i, child = 2*i + 1;
+
+        if(child < count && heap[child]->nextAt < heap[first]->nextAt)
+            first = child;
+        if(child + 1 < count && heap[child + 1]->nextAt < heap[first]->nextAt)
+            first = child + 1;
+        if(first == i)
+            return;
+
+        FleetInstance *swap = heap[i];
+        heap[i] = heap[first];
+        heap[first] = swap;
+        i = first;
+    }
+}
+
+/* run instances numbered first to first+count-1 together for lengthMs
+   of virtual time. Returns 0, or -1 if they could not all be set up */
+
+int RunFleet(int first, int count, long long lengthMs, FleetInstance *instances,
+             FleetResult *result)
+{
+    FleetInstance **heap;
+    Engine *current = gEngine;
+    struct timespec cpu0, cpu1;
+    Config base;
+    int i, status = 0;
+
+    memset(result, 0, sizeof(*result));
+    if(!(heap = (FleetInstance **)malloc(count*sizeof(FleetInstance *))))
+        return -1;
+
+    ReplayConfig(&base);
+    gVirtualClock = true;
+    gVirtualNowMs = gReplayEpochMs;
+    for(i=0;i<count;i++){
+        if(StartFleetInstance(&instances[i], first + i, &base) < 0){
+            status = -1;
+            count = i + 1;
+            break;
+        }
+        heap[i] = &instances[i];
+    }
+
+    if(status == 0){
+        for(i=count/2-1;i>=0;i--)
+            SiftFleetHeap(heap, count, i);
+
+        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu0);
+        while(heap[0]->nextAt < lengthMs){
+            StepFleetInstance(heap[0], heap[0]->nextAt, result);
+            SiftFleetHeap(heap, count, 0);
+        }
+        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu1);
+        result->cpuSec = (cpu1.tv_sec - cpu0.tv_sec) + (cpu1.tv_nsec - cpu0.tv_nsec)/1e9;
+    }
+
+    for(i=0;i<count;i++){
+        FleetInstance *inst = &instances[i];
+
+        StopFleetInstance(inst);
+        result->total.wakeups += inst->counters.wakeups;
+        result->total.sensorReads += inst->counters.sensorReads;
+        result->total.decisions += inst->counters.decisions;
+        result->total.actuatorWrites += inst->counters.actuatorWrites;
+        result->total.mixerSwitches += inst->counters.mixerSwitches;
+        result->total.syscalls += inst->counters.syscalls;
+    }
+    gVirtualClock = false;
+    gEngine = current;
+    free(heap);
+    return status;
+}
+
+/* run instance n of a fleet on its own, and compare it with what it did
+   among the others. Returns true if it did just the same */
+
+bool FleetInstanceIsolated(int n, long long lengthMs, const FleetInstance *inFleet)
+{
+    FleetInstance alone;
+    FleetResult result;
+
+    if(RunFleet(n, 1, lengthMs, &alone, &result) < 0)
+        return false;
+    return memcmp(&alone.counters, &inFleet->counters, sizeof(alone.counters)) == 0 &&
+           alone.level == inFleet->level;
+}
+
+int BenchFleet(int argc, char *argv[])
+{
+    int numInstances = argc > 1 ? atoi(argv[1]) : 2000;
+    double hours = argc > 2 ? atof(argv[2]) : 1;
+    long long lengthMs = hours*3600000;
+    FleetInstance *instances;
+    FleetResult result;
+    struct rlimit files;
+    int maxInstances;
+
+    getrlimit(RLIMIT_NOFILE, &files);
+    maxInstances = ((long long)files.rlim_cur - 64)/gFleetFds;
+    if(numInstances < 1 || lengthMs < 1000){
+        fprintf(stderr, "usage: prime-sensors bench fleet [instances] [hours]\n");
+        return EXIT_FAILURE;
+    }
+    if(numInstances > maxInstances){
+        fprintf(stderr, "bench fleet: %d instances need %d files open, at most %llu are allowed\n",
+                numInstances, numInstances*gFleetFds + 64, (unsigned long long)files.rlim_cur);
+        return EXIT_FAILURE;
+    }
+
+    if(CreateEventLoop() < 0 ||
+       !(instances = (FleetInstance *)calloc(numInstances, sizeof(FleetInstance))) ||
+       RunFleet(0, numInstances, lengthMs, instances, &result) < 0){
+        perror("bench fleet");
+        return EXIT_FAILURE;
+    }
+
+    const LoopCounters *c = &result.total;
+    double instanceHours = numInstances*(lengthMs/3600000.0);
+    double msPerHour = result.cpuSec*1000/instanceHours;
+    int check = numInstances/2;
+    bool isolated = FleetInstanceIsolated(check, lengthMs, &instances[check]);
+
+    printf("fleet: %d instances in one process for %.2f h each, %.2f s of cpu\n",
+           numInstances, lengthMs/3600000.0, result.cpuSec);
+    printf("fleet: per instance-hour    %.2f ms cpu, %.0f wakeups, %.0f decisions, "
+           "%.0f writes, %.0f syscalls\n", msPerHour, c->wakeups/instanceHours,
+           c->decisions/instanceHours, (c->actuatorWrites + c->mixerSwitches)/instanceHours,
+           c->syscalls/instanceHours);
+    printf("fleet: load per instance    %.5f%% of a core, %.0f instances per core\n",
+           msPerHour/36000, msPerHour > 0 ? 3600000/msPerHour : 0.0);
+    printf("fleet: light changes        %llu of %llu written, after mean %.0f ms, p50 %.0f, "
+           "p90 %.0f, p99 %.0f, max %.0f (virtual)\n", result.latency.count,
+           result.lightChanges, result.latency.count ?
+           result.latency.totalNs/1e6/result.latency.count : 0.0,
+           HistogramPercentile(&result.latency, 50)/1e6,
+           HistogramPercentile(&result.latency, 90)/1e6,
+           HistogramPercentile(&result.latency, 99)/1e6, result.latency.maxNs/1e6);
+    printf("fleet: per instance         %u bytes of engine, %u of configuration, %d files\n",
+           (unsigned int)sizeof(Engine), (unsigned int)sizeof(Config), gFleetFds);
+    printf("fleet: instance %d alone %s\n", check,
+           isolated ? "did the same as in the fleet" : "did not do the same  FAILED");
+
+    free(instances);
+    return isolated ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* "bench profile [other build]": the cost of a loop tick over the
+   standard traces, and the size of the code, for this build and, if
+   given, another one, e.g. a board build against the generic one. The
+   best of a few rounds is taken, as the traces are short, and how far
+   the worst round was from it is the spread; a difference between the
+   builds inside that is no difference. A tick is mostly system calls,
+   so the part of it a profile fixes, a light sample from its text to
+   the write decision, is timed on its own as well. The code size is
+   from the start of the image to the end of the text, as the linker
+   marks them; the file is padded out to pages. The other build is given
+   by its path, and run without a shell */
+
+extern char             __executable_start, etext;
+
+/* ns per light sample taken from its text to the write decision, as
+   UpdateBacklight takes it, with the curve the way ApplyConfig sets it
+   up for the built-in settings */
+
+double ProfileDecisionNs(void)
+{
+    static const char *const texts[] = { "12", "340", "75", "1800", "5", "260", "90", "30" };
+    int const samples = 1000000;
+    SensorSource light = gEngine->sensors[SENSOR_LIGHT];
+    LuxFilter filter = gEngine->luxFilter;
+    struct timespec t0, t1;
+    int i, len, value, target, level = gDisplayMaxBrightness, writes = 0;
+
+    filter.table = gProfileTable.level;
+    filter.tableSize = IsProfileCurve(filter.curve, filter.curvePoints) ? gProfileTableSize : 0;
+    filter.learned = 0;
+    ResetLuxFilter(&filter);
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t0);
+    for(i=0;i<samples;i++){
+        len = strlen(texts[i & 7]);
+        memcpy(light.text, texts[i & 7], len + 1);
+        if(ParseSample(&light, len, &value) < 0)
+            continue;
+        target = LookupBrightness(&filter, FilterLux(&filter, value));
+        if(PassesHysteresis(&filter, level, target, (long long)i*gLightSamplePeriodMs)){
+            level = target;
+            filter.lastWriteMs = (long long)i*gLightSamplePeriodMs;
+            writes++;
+        }
+    }
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t1);
+
+    if(!writes)
+        return 0;   /* the compiler may not skip it all */
+    return ((t1.tv_sec - t0.tv_sec)*1e9 + (t1.tv_nsec - t0.tv_nsec))/samples;
+}
+
+int BenchProfile(int argc, char *argv[])
+{
+    static Config config;
+    long long size = &etext - &__executable_start, otherSize;
+    double bestNs = 0, worstNs = 0, decisionNs = 0, spread, otherNs, otherSpread, otherDecisionNs;
+    char line[256], otherName[32];
+    int round, i, fds[2], status;
+    FILE *other = 0;
+    pid_t pid = -1;
+    bool ok;
+
+    setlogmask(LOG_UPTO(LOG_WARNING));
+    ReplayConfig(&config);
+    if(CreateEventLoop() < 0){
+        perror("bench profile");
+        return EXIT_FAILURE;
+    }
+
+    for(round=0;round<5;round++){
+        unsigned long long wakeups = 0;
+        double cpuSec = 0, ns;
+
+        for(i=0;i<gNumStandardTraces;i++){
+            ReplayResult result;
+            Trace trace;
+
+            if(MakeStandardTrace(i, 1, &trace) < 0 ||
+               ReplayTrace(&trace, &config, false, &result) < 0){
+                perror("bench profile");
+                FreeTrace(&trace);
+                return EXIT_FAILURE;
+            }
+            wakeups += result.counters.wakeups;
+            cpuSec += result.cpuSec;
+            FreeTrace(&trace);
+        }
+        if(wakeups && (round == 0 || cpuSec*1e9/wakeups < bestNs))
+            bestNs = cpuSec*1e9/wakeups;
+        if(wakeups && cpuSec*1e9/wakeups > worstNs)
+            worstNs = cpuSec*1e9/wakeups;
+
+        ns = ProfileDecisionNs();
+        if(round == 0 || ns < decisionNs)
+            decisionNs = ns;
+    }
+    spread = bestNs > 0 ? (worstNs - bestNs)*100/bestNs : 0;
+
+    printf("profile %-10s %10lld bytes %10.0f ns/tick %5.1f%% spread %8.1f ns/decision\n",
+           BuildProfile::name, size, bestNs, spread, decisionNs);
+    if(argc < 2)
+        return EXIT_SUCCESS;
+    fflush(stdout);
+
+    /* the other build prints the same line */
+    if(pipe2(fds, O_CLOEXEC) == 0){
+        pid = fork();
+        if(pid == 0){
+            char *const args[] = { argv[1], (char *)"bench", (char *)"profile", 0 };
+
+            dup2(fds[1], 1);
+            execv(argv[1], args);
+            _exit(127);
+        }
+        close(fds[1]);
+        if(pid < 0 || !(other = fdopen(fds[0], "r")))
+            close(fds[0]);
+    }
+    ok = other && fgets(line, sizeof(line), other) &&
+         sscanf(line, "profile %31s %lld bytes %lf ns/tick %lf%% spread %lf ns/decision",
+                otherName, &otherSize, &otherNs, &otherSpread, &otherDecisionNs) == 5;
+    if(other)
+        fclose(other);
+    if(pid > 0)
+        waitpid(pid, &status, 0);
+    if(!ok){
+        fprintf(stderr, "bench profile: no result from %s\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    double tickRatio = otherNs > 0 ? bestNs/otherNs : 0.0;
+
+    printf("%s", line);
+    printf("profile %s/%s: %.2f of the size, %.2f of the time per tick%s, "
+           "%.2f of the time per decision\n", BuildProfile::name, otherName,
+           otherSize ? (double)size/otherSize : 0.0, tickRatio,
+           fabs(tickRatio - 1)*100 <= (spread > otherSpread ? spread : otherSpread) ?
+           " (inside the spread)" : "",
+           otherDecisionNs > 0 ? decisionNs/otherDecisionNs : 0.0);
+    return EXIT_SUCCESS;
+}
+
+/* "bench io [sensors] [ticks]": the cost of a tick that reads every
+   sensor and writes one level, with plain reads and writes and as one
+   io_uring batch. The attributes are memfds, so this is the system call
+   overhead; a slow driver only shows on the device itself */
+
+double BenchIoTicks(int *fds, int numFds, long long ticks, bool uring, unsigned long long *syscalls)
+{
+    char buf[32];
+    struct timespec t0, t1;
+    long long n;
+    int i;
+
+    *syscalls = gEngine->counters.syscalls;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for(n=0;n<ticks;n++){
+        for(i=0;i<numFds-1;i++){
+            if(!uring || QueueIo(&gEngine->ioRing, false, fds[i], buf, sizeof(buf)-1, 0) < 0)
+                ReadSysfsAttr(fds[i], buf, sizeof(buf));
+        }
+        if(!uring || QueueIo(&gEngine->ioRing, true, fds[i], (void *)"128", 3, 0) < 0)
+            LoopPwrite(fds[i], "128", 3, 0);
+        WaitIo(&gEngine->ioRing);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    *syscalls = gEngine->counters.syscalls - *syscalls;
+
+    return ((t1.tv_sec - t0.tv_sec)*1e9 + (t1.tv_nsec - t0.tv_nsec))/ticks;
+}
+
+int BenchIo(int argc, char *argv[])
+{
+    int fds[gIoRingEntries];
+    int numSensors = argc > 1 ? atoi(argv[1]) : 8;
+    long long ticks = argc > 2 ? atoll(argv[2]) : 100000;
+    unsigned long long syscalls;
+    double ns;
+    int i;
+
+    if(numSensors < 1 || numSensors >= gIoRingEntries || ticks < 1){
+        fprintf(stderr, "usage: prime-sensors bench io [sensors 1-%d] [ticks]\n",
+                gIoRingEntries-1);
+        return EXIT_FAILURE;
+    }
+
+    for(i=0;i<=numSensors;i++){
+        fds[i] = memfd_create("bench", MFD_CLOEXEC);
+        SetReplayAttr(fds[i], "123");
+    }
+
+    ns = BenchIoTicks(fds, numSensors+1, ticks, false, &syscalls);
+    printf("io: epoll  %2d reads + 1 write %10.0f ns/tick %6.2f syscalls/tick\n",
+           numSensors, ns, (double)syscalls/ticks);
+
+    if(OpenIoRing(&gEngine->ioRing, gIoRingEntries) < 0){
+        printf("io: uring  not available, errno=%d\n", errno);
+    }else{
+        ns = BenchIoTicks(fds, numSensors+1, ticks, true, &syscalls);
+        printf("io: uring  %2d reads + 1 write %10.0f ns/tick %6.2f syscalls/tick\n",
+               numSensors, ns, (double)syscalls/ticks);
+        CloseIoRing(&gEngine->ioRing);
+    }
+
+    for(i=0;i<=numSensors;i++)
+        close(fds[i]);
+    return EXIT_SUCCESS;
+}
+
+/**************************************************************************/
+/***************************************************************************
+
+   RunSelfTest
+
+    "prime-sensors selftest [name...]" - run the built-in checks, or the
+   ones named, and fail if any of them does. Each check drives one part
+   of the control path directly, on the standard traces or on input made
+   up for it, and says what it expected when it didn't get it. Nothing
+   here touches the hardware or the running daemon.
+
+   lux    - the light filter and the write decision, with the built-in
+            filter settings
+   ring   - the telemetry ring: what a reader is told when it falls
+            behind and is overrun, and that the ring is only ever
+            created as a new file of our own
+   io     - closing the io_uring engine with reads that will never finish
+   switch - the switch name table: every name found, nothing else
+   curve  - saving the learned curve where a link has been planted
+   log    - the log rate limits: by format and text, per thread, and
+            never LOG_NOTICE and above
+   snapshot - the state latch: readers racing the writer never see a
+            torn snapshot
+   fleet  - engines side by side in one process: each runs as it would
+            on its own, and is gone once it is destroyed
+
+    Inputs:
+
+   argc, argv	 I					  the arguments after "selftest"
+
+    Returns:
+
+    the process exit status
+
+***************************************************************************/
+/**************************************************************************/
+
+/* report one check. Returns 1 if it failed, so failures can be summed */
+
+int SelfCheck(bool ok, const char *format, ...)
+{
+    va_list args;
+
+    printf("%-7s", ok ? "ok" : "FAILED");
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+    printf("\n");
+    return !ok;
+}
+
+/* a run of light samples through the filter and the write decision, the
+   way UpdateBacklight takes them, with each write taking effect at once.
+   The level starts where the first sample puts it, as though the daemon
+   had been running */
+
+struct LuxRun
+{
+    LuxFilter           filter;
+    int                 level;
+    int                 writes;
+    long long           minGapMs;           /* between writes, -1 if < 2 */
+    long long           lastMs;
+};
+
+void StartLuxRun(LuxRun *run)
+{
+    run->filter = gEngine->luxFilter;
+    run->filter.learned = 0;
+    ResetLuxFilter(&run->filter);
+    run->level = -1;
+    run->writes = 0;
+    run->minGapMs = -1;
+    run->lastMs = 0;
+}
+
+/* returns the filtered lux */
+
+int RunLuxSample(LuxRun *run, long long ms, int lux)
+{
+    int filtered = FilterLux(&run->filter, lux);
+    int target = LookupBrightness(&run->filter, filtered);
+
+    if(run->level < 0){
+        run->level = target;
+        run->filter.lastWriteMs = ms;
+    }else if(PassesHysteresis(&run->filter, run->level, target, ms)){
+        if(run->writes && (run->minGapMs < 0 || ms - run->lastMs < run->minGapMs))
+            run->minGapMs = ms - run->lastMs;
+        run->level = target;
+        run->filter.lastWriteMs = ms;
+        run->lastMs = ms;
+        run->writes++;
+    }
+    return filtered;
+}
+
+/* the number of samples before a step from one lux to another is
+   followed to within a tenth of the step */
+
+int LuxStepSamples(int from, int to)
+{
+    LuxRun run;
+    int i, filtered;
+
+    StartLuxRun(&run);
+    for(i=0;i<gMaxMedianWindow;i++)
+        RunLuxSample(&run, i*gLightSamplePeriodMs, from);
+    for(i=0;i<100;i++){
+        filtered = RunLuxSample(&run, (i+gMaxMedianWindow)*gLightSamplePeriodMs, to);
+        if(abs(filtered - to)*10 <= abs(to - from))
+            return i + 1;
+    }
+    return i;
+}
+
+/* the furthest the filtered lux strays from a steady level when one
+   sample in the middle of it reads spike instead, or two in a row if
+   twice is set */
+
+int LuxSpikeError(int steady, int spike, bool twice)
+{
+    LuxRun run;
+    int i, filtered, worst = 0;
+
+    StartLuxRun(&run);
+    for(i=0;i<20;i++){
+        filtered = RunLuxSample(&run, i*gLightSamplePeriodMs,
+                                i == 10 || (twice && i == 11) ? spike : steady);
+        if(abs(filtered - steady) > worst)
+            worst = abs(filtered - steady);
+    }
+    return worst;
+}
+
+int SelfTestLux(void)
+{
+    LuxFilter const *defaults = &gEngine->luxFilter;
+    int i, j, rise, fall, failed = 0;
+    Trace trace;
+
+    /* the standard traces. Only light samples matter here: screen and
+       jack events are left to replay */
+    for(i=0;i<gNumStandardTraces;i++){
+        LuxRun run;
+
+        if(MakeStandardTrace(i, 1, &trace) < 0)
+            return failed + SelfCheck(false, "lux: can't make the %d trace", i);
+        StartLuxRun(&run);
+        for(j=0;j<trace.count;j++){
+            if(trace.events[j].sensor == SENSOR_LIGHT)
+                RunLuxSample(&run, trace.events[j].ms, atoi(trace.events[j].text));
+        }
+
+        /* dark-room and headset hold the light steady, screen-off and
+           panel-off keep it within sensor noise of 300 lux, which is
+           inside both thresholds */
+        if(i == 0 || i == 4 || i == 5 || i == 7)
+            failed += SelfCheck(run.writes == 0,
+                                "lux: %s, no writes while lux stays within the thresholds (%d)",
+                                trace.name, run.writes);
+        else
+            failed += SelfCheck(run.writes < 2 ||
+                                run.minGapMs >= defaults->minWriteIntervalMs,
+                                "lux: %s, at most one write per %d ms (%d writes, closest %lld ms)",
+                                trace.name, defaults->minWriteIntervalMs,
+                                run.writes, run.minGapMs);
+        FreeTrace(&trace);
+    }
+
+    rise = LuxStepSamples(20, 400);
+    fall = LuxStepSamples(400, 20);
+    failed += SelfCheck(rise < fall, "lux: a rise is followed faster than a fall "
+                        "(%d samples up, %d down)", rise, fall);
+
+    failed += SelfCheck(LuxSpikeError(100, 5000, false) == 0,
+                        "lux: the median rejects a one sample spike");
+    failed += SelfCheck(LuxSpikeError(300, 0, false) == 0,
+                        "lux: the median rejects a one sample drop");
+    failed += SelfCheck(LuxSpikeError(100, 5000, true) > 0,
+                        "lux: a change lasting two samples gets through");
+    return failed;
+}
+
+/* write count records numbered from first, the way BenchRing does */
+
+void FillRing(TelemetryRing *ring, uint64_t first, int count)
+{
+    for(int i=0;i<count;i++)
+        RecordTelemetry(ring, PS_RECORD_SAMPLE, 0, (int)(first + i), ~(int)(first + i));
+}
+
+int SelfTestRing(void)
+{
+    char dir[] = "/dev/shm/prime-sensors-selftest.XXXXXX";
+    char path[sizeof(dir) + 16], victim[sizeof(dir) + 16];
+    unsigned int const capacity = 64;
+    TelemetryRing ring;
+    PsRingReader reader;
+    PsRingRecord record;
+    struct stat st;
+    int i, read, failed = 0;
+    bool ordered;
+
+    if(!mkdtemp(dir))
+        return SelfCheck(false, "ring: can't make a directory to test in");
+    snprintf(path, sizeof(path), "%s/ring", dir);
+    snprintf(victim, sizeof(victim), "%s/victim", dir);
+
+    if(OpenTelemetryRing(&ring, path, capacity) < 0 || ps_ring_open(&reader, path) < 0){
+        rmdir(dir);
+        return SelfCheck(false, "ring: can't create and open %s", path);
+    }
+
+    memset(&record, 0, sizeof(record));
+    FillRing(&ring, 0, 10);
+    failed += SelfCheck(ps_ring_lag(&reader) == 10, "ring: lag counts unread records "
+                        "(%llu, expected 10)", (unsigned long long)ps_ring_lag(&reader));
+    for(i=0;i<4;i++)
+        ps_ring_read(&reader, &record);
+    failed += SelfCheck(ps_ring_lag(&reader) == 6 && record.seq == 3 && reader.lost == 0,
+                        "ring: reading takes records in order (lag %llu, seq %llu, lost %llu)",
+                        (unsigned long long)ps_ring_lag(&reader),
+                        (unsigned long long)record.seq, (unsigned long long)reader.lost);
+
+    /* fall more than a ring behind: 6 unread and 200 more is 206, of
+       which only the newest capacity are still there */
+    FillRing(&ring, 10, 200);
+    failed += SelfCheck(ps_ring_lag(&reader) == 206, "ring: lag goes past the capacity "
+                        "when overrun (%llu, expected 206)",
+                        (unsigned long long)ps_ring_lag(&reader));
+    ps_ring_read(&reader, &record);
+    failed += SelfCheck(reader.lost == 206 - capacity && record.seq == 210 - capacity &&
+                        record.value == (int32_t)record.seq && ps_ring_lag(&reader) == capacity - 1,
+                        "ring: an overrun reader skips to the oldest record and counts the "
+                        "rest as lost (lost %llu, expected %u; seq %llu, expected %u)",
+                        (unsigned long long)reader.lost, 206 - capacity,
+                        (unsigned long long)record.seq, 210 - capacity);
+
+    ordered = true;
+    for(read=1;ps_ring_read(&reader, &record);read++)
+        ordered = ordered && record.seq == 210 - capacity + read;
+    failed += SelfCheck(ordered && read == (int)capacity && reader.lost == 206 - capacity &&
+                        ps_ring_lag(&reader) == 0,
+                        "ring: the rest read back in order with nothing more lost "
+                        "(%d read, lost %llu)", read, (unsigned long long)reader.lost);
+    ps_ring_close(&reader);
+    CloseTelemetryRing(&ring, path);
+
+    /* a link planted at the path must be replaced, not followed */
+    int fd = open(victim, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0666);
+    if(fd < 0 || write(fd, "keep", 4) != 4 || symlink(victim, path) < 0){
+        if(fd >= 0)
+            close(fd);
+        unlink(victim);
+        rmdir(dir);
+        return failed + SelfCheck(false, "ring: can't plant a link at %s", path);
+    }
+    close(fd);
+    if(OpenTelemetryRing(&ring, path, capacity) == 0){
+        failed += SelfCheck(lstat(path, &st) == 0 && S_ISREG(st.st_mode) &&
+                            (st.st_mode & 07777) == 0644 && stat(victim, &st) == 0 &&
+                            st.st_size == 4, "ring: a link at the path is replaced, "
+                            "and what it pointed at left alone");
+        CloseTelemetryRing(&ring, path);
+    }else
+        failed += SelfCheck(false, "ring: a link at the path stopped the ring being created");
+    unlink(victim);
+
+    /* and a directory anyone can write to is refused */
+    chmod(dir, 0777);
+    failed += SelfCheck(OpenTelemetryRing(&ring, path, capacity) < 0,
+                        "ring: a directory others can write to is refused");
+    CloseTelemetryRing(&ring, path);
+    rmdir(dir);
+
+    return failed;
+}
+
+/* a read of an empty pipe never finishes by itself, like one from a
+   driver that has stopped answering */
+
+int SelfTestIo(void)
+{
+    static char buf[16];    /* may still be the target of a read after we return */
+    SensorSource *sensor = &gEngine->sensors[SENSOR_LIGHT];
+    int pipeFds[2], failed = 0;
+    long long start, ms;
+
+    if(OpenIoRing(&gEngine->ioRing, gIoRingEntries) < 0){
+        printf("%-7sio: no io_uring here, errno=%d\n", "skip", errno);
+        return 0;
+    }
+    if(pipe2(pipeFds, O_CLOEXEC) < 0){
+        CloseIoRing(&gEngine->ioRing);
+        return SelfCheck(false, "io: can't make a pipe, errno=%d", errno);
+    }
+
+    sensor->fd = pipeFds[0];
+    sensor->enabled = true;
+    QueueIoRead(&gEngine->ioRing, sensor);
+    SubmitIo(&gEngine->ioRing);
+    start = NowMs();
+    CloseIoRing(&gEngine->ioRing);
+    ms = NowMs() - start;
+    failed += SelfCheck(!sensor->reading && ms < gIoCloseTimeoutMs,
+                        "io: a sensor read that is stuck is cancelled on close (%lld ms)", ms);
+    sensor->fd = -1;
+    sensor->enabled = false;
+
+    /* one that nothing cancels holds the close up no longer than the
+       timeout */
+    if(OpenIoRing(&gEngine->ioRing, gIoRingEntries) == 0){
+        QueueIo(&gEngine->ioRing, false, pipeFds[0], buf, sizeof(buf), 0);
+        SubmitIo(&gEngine->ioRing);
+        start = NowMs();
+        CloseIoRing(&gEngine->ioRing);
+        ms = NowMs() - start;
+        failed += SelfCheck(ms >= gIoCloseTimeoutMs - gTimerSlackMs && ms < 2*gIoCloseTimeoutMs,
+                            "io: close gives up on a read it can't cancel after %d ms (%lld ms)",
+                            gIoCloseTimeoutMs, ms);
+    }
+
+    close(pipeFds[0]);
+    close(pipeFds[1]);
+    return failed;
+}
+
+int SelfTestSwitch(void)
+{
+    static const char *const unknown[] = { "", "HDM", "HDMI ", "Headphones2", "car", "No",
+                                           "h2w", "hdmi" };
+    static const int jackStates[] = { PS_SWITCH_NONE, PS_SWITCH_HEADSET, PS_SWITCH_HEADPHONE };
+    int i, state, failed = 0;
+    char text[8];
+
+    for(i=0;i<gNumSwitchNames;i++){
+        state = LookupSwitchName(gSwitchNames[i].text, strlen(gSwitchNames[i].text));
+        failed += SelfCheck(state == gSwitchNames[i].state, "switch: \"%s\" is %d (expected %d)",
+                            gSwitchNames[i].text, state, gSwitchNames[i].state);
+    }
+    for(i=0;i<(int)(sizeof(unknown)/sizeof(unknown[0]));i++){
+        state = LookupSwitchName(unknown[i], strlen(unknown[i]));
+        failed += SelfCheck(state == -1, "switch: \"%s\" is not a name (%d)", unknown[i], state);
+    }
+
+    /* the jack as its state attribute reads, and its name without print_name */
+    for(i=0;i<(int)(sizeof(jackStates)/sizeof(jackStates[0]));i++){
+        snprintf(text, sizeof(text), "%d\n", i);
+        state = -1;
+        ParseJackState(0, text, strlen(text), &state);
+        failed += SelfCheck(state == jackStates[i], "switch: jack state %d is %d (expected %d)",
+                            i, state, jackStates[i]);
+    }
+    snprintf(text, sizeof(text), "h2w\n");
+    failed += SelfCheck(ParseJackState(0, text, strlen(text), &state) < 0,
+                        "switch: a jack reading \"h2w\" is not a sample");
+    return failed;
+}
+
+int SelfTestCurve(void)
+{
+    static CurveStore store;
+    char dir[] = "/tmp/prime-sensors-selftest.XXXXXX";
+    char victim[sizeof(dir) + 16], tmp[sizeof(dir) + 16];
+    struct stat st;
+    int fd, failed = 0;
+
+    if(!mkdtemp(dir))
+        return SelfCheck(false, "curve: can't make a directory to test in");
+    snprintf(victim, sizeof(victim), "%s/victim", dir);
+    snprintf(store.path, sizeof(store.path), "%s/curve", dir);
+    snprintf(tmp, sizeof(tmp), "%s/curve.tmp", dir);
+
+    memset(&store.blank, 0, sizeof(store.blank));
+    store.blank.magic = gLearnedMagic;
+    store.blank.version = gLearnedVersion;
+    store.blank.numPoints = gLearnedPoints;
+    store.curve = &store.blank;
+    store.event.fd = -1;
+
+    fd = open(victim, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+    if(fd < 0 || write(fd, "keep", 4) != 4 || symlink(victim, tmp) < 0){
+        failed += SelfCheck(false, "curve: can't plant a link at %s", tmp);
+    }else{
+        failed += SelfCheck(SaveCurveStore(&store) == 0 &&
+                            lstat(store.path, &st) == 0 && S_ISREG(st.st_mode) &&
+                            st.st_size == sizeof(LearnedCurve) &&
+                            stat(victim, &st) == 0 && st.st_size == 4 &&
+                            lstat(tmp, &st) < 0,
+                            "curve: a link left at the temporary file is replaced, "
+                            "and what it pointed at left alone");
+    }
+    if(fd >= 0)
+        close(fd);
+
+    unlink(store.path);
+    unlink(tmp);
+    unlink(victim);
+    rmdir(dir);
+    return failed;
+}
+
+int SelfTestSnapshot(void)
+{
+    static SnapshotBench bench;
+    int failed = 0;
+
+    RunSnapshotBench(3, 300, &bench);
+    failed += SelfCheck(bench.writes > 0 && bench.reads > 0, "snapshot: %llu writes, %llu reads",
+                        bench.writes, bench.reads);
+    failed += SelfCheck(bench.torn == 0, "snapshot: %llu torn reads", bench.torn);
+    return failed;
+}
+
+/* the rate limits of one thread are its own: a message held back on the
+   calling thread still goes out on another */
+
+struct LogTestThread
+{
+    const char          *format;
+    bool                allowed;
+};
+
+void *LogTestThreadMain(void *arg)
+{
+    LogTestThread *test = (LogTestThread *)arg;
+    unsigned int suppressed;
+
+    test->allowed = AllowLogMessage(LOG_INFO, test->format, "sensor light", &suppressed);
+    return 0;
+}
+
+/* a few instances of a fleet for ten minutes: each of them gets on with
+   its own scene, one of them does the same on its own, and none is left
+   behind */
+
+int SelfTestFleet(void)
+{
+    static FleetInstance instances[20];
+    int const numInstances = sizeof(instances)/sizeof(instances[0]);
+    long long const lengthMs = 600000;
+    Engine *engines = gEngines;
+    FleetResult result;
+    int i, idle = 0, failed = 0;
+
+    if(gEpollDesc < 0 && CreateEventLoop() < 0)
+        return SelfCheck(false, "fleet: no event loop, errno=%d", errno);
+
+    failed += SelfCheck(RunFleet(0, numInstances, lengthMs, instances, &result) == 0,
+                        "fleet: %d instances run", numInstances);
+    for(i=0;i<numInstances;i++){
+        if(!instances[i].counters.decisions || !instances[i].counters.actuatorWrites)
+            idle++;
+    }
+    failed += SelfCheck(idle == 0, "fleet: %d instances did nothing (expected 0)", idle);
+    failed += SelfCheck(FleetInstanceIsolated(7, lengthMs, &instances[7]),
+                        "fleet: instance 7 alone does what it did among the others");
+    failed += SelfCheck(gEngines == engines && (!engines || !engines->next),
+                        "fleet: every instance's engine is gone");
+    return failed;
+}
+
+int SelfTestLog(void)
+{
+    static const char *const format = "log: %s";
+    bool virtualClock = gVirtualClock;
+    long long virtualNowMs = gVirtualNowMs;
+    unsigned int suppressed;
+    LogTestThread test = { format, false };
+    pthread_t thread;
+    char text[32];
+    int i, sent, failed = 0;
+
+    gVirtualClock = true;
+    gVirtualNowMs = 1000000;
+
+    for(i=sent=0;i<gLogBurst+3;i++)
+        sent += AllowLogMessage(LOG_INFO, format, "sensor light", &suppressed);
+    failed += SelfCheck(sent == gLogBurst, "log: %d of %d repeats sent (expected %d)",
+                        sent, gLogBurst+3, gLogBurst);
+    failed += SelfCheck(AllowLogMessage(LOG_INFO, format, "sensor hdmi", &suppressed),
+                        "log: the same format with other arguments goes out");
+    failed += SelfCheck(AllowLogMessage(LOG_NOTICE, format, "sensor light", &suppressed),
+                        "log: LOG_NOTICE is never held back");
+
+    if(pthread_create(&thread, 0, LogTestThreadMain, &test) != 0)
+        failed += SelfCheck(false, "log: can't start a thread");
+    else{
+        pthread_join(thread, 0);
+        failed += SelfCheck(test.allowed, "log: another thread's limits are its own");
+    }
+
+    gVirtualNowMs += gLogRefillMs;
+    sent = AllowLogMessage(LOG_INFO, format, "sensor light", &suppressed);
+    failed += SelfCheck(sent && suppressed == 3, "log: after %d ms the next is sent, %u "
+                        "suppressed (expected 3)", gLogRefillMs, suppressed);
+
+    /* a message that keeps repeating stays limited while many different
+       ones come and go around it */
+    gVirtualNowMs += gLogRefillMs*gLogBurst;
+    for(i=sent=0;i<20;i++){
+        int n;
+
+        gVirtualNowMs++;
+        sent += AllowLogMessage(LOG_INFO, format, "jack flapping", &suppressed);
+        for(n=0;n<10;n++){
+            snprintf(text, sizeof(text), "value %d", i*10 + n);
+            gVirtualNowMs++;
+            AllowLogMessage(LOG_INFO, format, text, &suppressed);
+        }
+    }
+    failed += SelfCheck(sent == gLogBurst, "log: %d of 20 repeats among 200 others sent "
+                        "(expected %d)", sent, gLogBurst);
+
+    gVirtualClock = virtualClock;
+    gVirtualNowMs = virtualNowMs;
+    return failed;
+}
+
+int RunSelfTest(int argc, char *argv[])
+{
+    static const struct
+    {
+        const char      *name;
+        int             (*run)(void);
+    } tests[] =
+    {
+        { "lux", SelfTestLux },
+        { "ring", SelfTestRing },
+        { "io", SelfTestIo },
+        { "switch", SelfTestSwitch },
+        { "curve", SelfTestCurve },
+        { "log", SelfTestLog },
+        { "snapshot", SelfTestSnapshot },
+        { "fleet", SelfTestFleet },
+    };
+    unsigned int i;
+    int j, failed = 0;
+
+    for(j=0;j<argc;j++){
+        for(i=0;i<sizeof(tests)/sizeof(tests[0]) && strcmp(argv[j], tests[i].name);i++)
+            ;
+        if(i == sizeof(tests)/sizeof(tests[0])){
+            fprintf(stderr, "usage: prime-sensors selftest [name...], where name is one of:");
+            for(i=0;i<sizeof(tests)/sizeof(tests[0]);i++)
+                fprintf(stderr, " %s", tests[i].name);
+            fprintf(stderr, "\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    setlogmask(LOG_UPTO(LOG_WARNING));
+    for(i=0;i<sizeof(tests)/sizeof(tests[0]);i++){
+        for(j=0;j<argc && strcmp(argv[j], tests[i].name);j++)
+            ;
+        if(!argc || j < argc)
+            failed += tests[i].run();
+    }
+
+    if(failed)
+        printf("%d checks failed\n", failed);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/**************************************************************************/
+/***************************************************************************
+
+   RunBenchmark
+
+    "prime-sensors bench <name> [args]" - run one of the built-in
+   benchmarks in the foreground and print its results.
+
+    Inputs:
+
+   argc, argv	 I					  the arguments after "bench"
+
+    Returns:
+
+    the process exit status
+
+***************************************************************************/
+/**************************************************************************/
+
+int RunBenchmark(int argc, char *argv[])
+{
+    static const struct
+    {
+        const char      *name;
+        int             (*run)(int argc, char *argv[]);
+    } benchmarks[] =
+    {
+        { "snapshot", BenchSnapshot },
+        { "ring", BenchRing },
+        { "replay", BenchReplay },
+        { "fleet", BenchFleet },
+        { "profile", BenchProfile },
+        { "io", BenchIo },
+    };
+    unsigned int i;
+
+    for(i=0;argc>0 && i<sizeof(benchmarks)/sizeof(benchmarks[0]);i++){
+        if(!strcmp(argv[0], benchmarks[i].name))
+            return benchmarks[i].run(argc, argv);
+    }
+
+    fprintf(stderr, "usage: prime-sensors bench <name> [args], where name is one of:");
+    for(i=0;i<sizeof(benchmarks)/sizeof(benchmarks[0]);i++)
+        fprintf(stderr, " %s", benchmarks[i].name);
+    fprintf(stderr, "\n");
+    return EXIT_FAILURE;
+}
+
+/**************************************************************************/
+/***************************************************************************
+
+   Mixer backends
+
+    A mixer backend switches named playback elements on and off. The
+   element names are the simple element names amixer uses ("Int Spk",
+   "Headphone Jack"). A backend is opened once at startup and every
+   routing change is handed to it as one batch, applied in order.
+
+   alsa - talks to the ALSA control device with the SNDRV_CTL_IOCTL_*
+          ioctls, which is what alsa-lib does underneath. Element ids are
+          resolved once at open, so a switch costs one ioctl per element.
+
+   fake - keeps the element states in memory and counts the batches. It
+          is meant for running the daemon without audio hardware.
+
+***************************************************************************/
+/**************************************************************************/
+
+/* resolve an element to a control id. A simple element "X" is backed by
+   the control "X Switch" (a DAPM pin switch on ASoC cards) or
+   "X Playback Switch" */
+
+int AlsaFindElement(int fd, MixerElement *elem)
+{
+    static const char *const suffixes[] = { " Switch", " Playback Switch", "" };
+    struct snd_ctl_elem_info info;
+    unsigned int i;
+
+    for(i=0;i<sizeof(suffixes)/sizeof(suffixes[0]);i++){
+        memset(&info, 0, sizeof(info));
+        info.id.iface = SNDRV_CTL_ELEM_IFACE_MIXER;
+        snprintf((char *)info.id.name, sizeof(info.id.name), "%s%s",
+                 elem->name, suffixes[i]);
+
+        if(ioctl(fd, SNDRV_CTL_IOCTL_ELEM_INFO, &info) < 0)
+            continue;
+        if(info.type != SNDRV_CTL_ELEM_TYPE_BOOLEAN)
+            continue;
+
+        elem->numid = info.id.numid;
+        elem->channels = info.count;
+        return 0;
+    }
+
+    return -1;
+}
+
+int AlsaMixerOpen(MixerBackend *mixer)
+{
+    int i;
+
+    mixer->fd = open(gEngine->config->mixerDevice, O_RDWR|O_CLOEXEC);
+    if(mixer->fd < 0){
+        LogMessage(LOG_INFO,"mixer: can't open %s, errno=%d",
+                   gEngine->config->mixerDevice, errno);
+        return -1;
+    }
+
+    for(i=0;i<NUM_MIXER_ELEMENTS;i++){
+        if(AlsaFindElement(mixer->fd, &gEngine->mixerElements[i]) < 0){
+            gEngine->mixerElements[i].numid = 0;
+            LogMessage(LOG_INFO,"mixer: no switch for \"%s\"",
+                       gEngine->mixerElements[i].name);
+        }
+    }
+
+    return 0;
+}
+
+int AlsaMixerApply(MixerBackend *mixer, const MixerSwitch *switches, int count)
+{
+    struct snd_ctl_elem_value value;
+    int i, ch, result = 0;
+
+    for(i=0;i<count;i++){
+        MixerElement *elem = &gEngine->mixerElements[switches[i].element];
+
+        if(elem->numid == 0){
+            result = -1;
+            continue;
+        }
+
+        memset(&value, 0, sizeof(value));
+        value.id.numid = elem->numid;
+        for(ch=0;ch<elem->channels;ch++)
+            value.value.integer.value[ch] = switches[i].on;
+
+        if(LoopIoctl(mixer->fd, SNDRV_CTL_IOCTL_ELEM_WRITE, &value) < 0){
+            LogMessage(LOG_INFO,"mixer: can't switch \"%s\", errno=%d",
+                       elem->name, errno);
+            result = -1;
+            continue;
+        }
+        elem->on = switches[i].on;
+        elem->known = true;
+    }
+
+    return result;
+}
+
+void AlsaMixerClose(MixerBackend *mixer)
+{
+    if(mixer->fd >= 0)
+        close(mixer->fd);
+    mixer->fd = -1;
+}
+
+int FakeMixerOpen(MixerBackend *mixer)
+{
+    mixer->batches = 0;
+    return 0;
+}
+
+int FakeMixerApply(MixerBackend *mixer, const MixerSwitch *switches, int count)
+{
+    int i;
+
+    for(i=0;i<count;i++){
+        gEngine->mixerElements[switches[i].element].on = switches[i].on;
+        gEngine->mixerElements[switches[i].element].known = true;
+    }
+    mixer->batches++;
+
+    return 0;
+}
+
+void FakeMixerClose(MixerBackend *mixer)
+{
+}
+
+const MixerBackend      gMixerBackends[] =
+{
+    { "alsa", AlsaMixerOpen, AlsaMixerApply, AlsaMixerClose, -1, 0 },
+    { "fake", FakeMixerOpen, FakeMixerApply, FakeMixerClose, -1, 0 },
+};
 
-/*************************************************************************/
+/* open the backend called name for gEngine, in its own copy of the
+   backend. Returns it, or 0 if it is unknown or can't be opened */
 
-int main(int argc,char *argv[])
+MixerBackend *OpenMixer(const char *name)
 {
-    int   result;
-    pid_t daemonPID;
-    int fd, len;
-    if (argc > 1) {
-          pid_t pid;
-          char pid_buf[16];
-          if ((fd = open(gLockFilePath, O_RDONLY)) < 0)
-          {
-                perror("Lock file not found. May be the service is not running?");
-                exit(fd);
-          }
-          len = read(fd, pid_buf, 16);
-          pid_buf[len] = 0;
-          pid = atoi(pid_buf);
-          if(!strcmp(argv[1], "sensorstate")) {
-                kill(pid, SIGUSR2);
-                exit(EXIT_SUCCESS);
-          }
-          if(!strcmp(argv[1], "stop")) {
-                kill(pid, SIGUSR1);
-                exit(EXIT_SUCCESS);
-          }
-          if(!strcmp(argv[1], "restart")) {
-                kill(pid, SIGHUP);
-                exit(EXIT_SUCCESS);
-          }
-          printf ("usage %s [stop|restart]\n", argv[0]);
-          exit (EXIT_FAILURE);
-      }
-
-    /*************************************************************/
-    /* perhaps at this stage you would read a configuration file */
-    /*************************************************************/
+    unsigned int i;
 
-    /* the first task is to put ourself into the background (i.e
-        become a daemon. */
+    for(i=0;i<sizeof(gMixerBackends)/sizeof(gMixerBackends[0]);i++){
+        MixerBackend *mixer = &gEngine->mixerBackend;
 
-    if((result=BecomeDaemonProcess(gLockFilePath,"prime-sensors",
-                                             LOG_DEBUG,&gLockFileDesc,&daemonPID))<0)
-    {
-        perror("Failed to become daemon process");
-        exit(result);
+        if(strcmp(gMixerBackends[i].name, name) != 0)
+            continue;
+        *mixer = gMixerBackends[i];
+        if(mixer->open(mixer) < 0)
+            return 0;
+        return mixer;
     }
 
-    /* set up signal processing */
+    LogMessage(LOG_INFO,"mixer: unknown backend %s", name);
+    return 0;
+}
 
-    if((result=ConfigureSignalHandlers())<0)
-        {
-        syslog(LOG_LOCAL0|LOG_INFO,"ConfigureSignalHandlers failed, errno=%d",errno);
-        unlink(gLockFilePath);
-        exit(result);
-        }
+void CloseMixer(MixerBackend *mixer)
+{
+    int i;
 
+    if(mixer)
+        mixer->close(mixer);
+    for(i=0;i<NUM_MIXER_ELEMENTS;i++)
+        gEngine->mixerElements[i].known = gEngine->mixerElements[i].queued = false;
+}
 
-    /* now enter an infinite loop handling connections */
-    int lux;
-    char data_buf[16];
-    int sensorFile = open(gLightSensorPath, O_RDONLY);
-//    int displayPowerFile = open(gDisplayPowerPath, O_RDONLY);
-    int regulatorFile = open(gDisplayRegulatorPath, O_RDWR);
-    int jackStatusFile = open(gAudioJackPath, O_RDONLY);
+/* queue a mixer switch for the next flush, see "Actuator queue" */
 
-    syslog(LOG_LOCAL0|LOG_INFO,"fileid: %d and %d", sensorFile, regulatorFile);
-    do{
-        if(gAutoLightOn && sensorFile > 0 && regulatorFile > 0){
-          len = read(sensorFile, data_buf, 16);
-          data_buf[len] = 0;
-          lux = atoi(data_buf);
-
-          len = read(regulatorFile, data_buf, 16);
-          data_buf[len] = 0;
-          int curBrightness = atoi(data_buf);
-
-	  if(curBrightness > 0){
-            int calcBrightness = gDisplayMinBrightness + lux/1.5;
-            if(calcBrightness > 255){
-        	 calcBrightness = 255;
-            }
+void QueueMixerSwitch(int element, bool on)
+{
+    MixerElement *elem = &gEngine->mixerElements[element];
 
-            if(abs(curBrightness - calcBrightness) > 15){
-        	 sprintf(data_buf, "%d", calcBrightness);
-                write(regulatorFile, data_buf, sizeof(data_buf));
-            }
-	  }
-        }
-
-        if(jackStatusFile > 0){
-    	    len = read(jackStatusFile, data_buf, 9);
-    	    data_buf[len] = 0;
-
-    	    if (strcmp(data_buf, "No Device") == 0){
-        	if(gAudioJackPlugged){
-            	    gAudioJackPlugged = false;
-            	    syslog(LOG_LOCAL0|LOG_INFO, "audio headset unplugged", data_buf);
-            	    system("amixer set \"Headphone Jack\" mute");
-            	    system("amixer set \"Int Spk\" unmute");
-        	}
-    	    }else{
-        	if(!gAudioJackPlugged){
-            	    gAudioJackPlugged = true;
-            	    syslog(LOG_LOCAL0|LOG_INFO, "audio %s plugged", data_buf);
-            	    system("amixer set \"Int Spk\" mute");
-            	    system("amixer set \"Headphone Jack\" unmute");
-        	}
-    	    }
-	}
-	
-	lseek(sensorFile, SEEK_SET, 0);
-//	lseek(displayPowerFile, SEEK_SET, 0);
-	lseek(regulatorFile, SEEK_SET, 0);
-	lseek(jackStatusFile, SEEK_SET, 0);
-
-        sleep(1);
-        /* the next conditional will be true if we caught signal SIGUSR1 */
-        if((gGracefulShutdown==1)&&(gCaughtHupSignal==0))
-            break;
+    if(elem->queued)
+        gEngine->counters.writesCoalesced++;
 
-        /* if we caught SIGHUP, then start handling connections again */
-        gGracefulShutdown=gCaughtHupSignal=0;
-    }while(1);
-    close(sensorFile);
-    close(regulatorFile);
-    close(jackStatusFile);
+    if(elem->known && elem->on == on){
+        if(!elem->queued)
+            gEngine->counters.writesDropped++;
+        elem->queued = false;
+        return;
+    }
 
-    TidyUp(); /* close the socket and kill the lock file */
+    elem->queued = true;
+    elem->queuedOn = on;
+}
 
-    return 0;
+/* hand every queued switch to the backend as one batch, the ones that
+   turn something off first */
+
+void FlushMixer(void)
+{
+    MixerSwitch switches[NUM_MIXER_ELEMENTS];
+    int i, pass, count = 0;
+
+    for(pass=0;pass<2;pass++){
+        for(i=0;i<NUM_MIXER_ELEMENTS;i++){
+            MixerElement *elem = &gEngine->mixerElements[i];
+
+            if(!elem->queued || elem->queuedOn != (pass == 1))
+                continue;
+            elem->queued = false;
+            switches[count].element = i;
+            switches[count].on = elem->queuedOn;
+            count++;
+        }
+    }
+
+    if(count == 0 || !gEngine->mixer)
+        return;
+
+    long long start = StatStart();
+    gEngine->counters.mixerSwitches += count;
+    gEngine->mixer->apply(gEngine->mixer, switches, count);
+    StatStop(PS_STAT_MIXER, start);
+
+    StatStop(PS_STAT_JACK_LATENCY, gEngine->jackEventNs);
+    gEngine->jackEventNs = 0;
 }
 
 /**************************************************************************/
@@ -222,7 +8567,7 @@ int BecomeDaemonProcess(const char *const lockFileName,
                             int *const lockFileDesc,
                             pid_t *const thisPID)
 {
-    int						curPID,stdioFD,lockResult,killResult,lockFD,i,numFiles;
+    int						curPID,stdioFD,lockResult,killResult,lockFD;
     char                    pidBuf[17],*lfs,pidStr[7];
     FILE                    *lfp;
     unsigned long			lockPID;
@@ -356,18 +8701,10 @@ int BecomeDaemonProcess(const char *const lockFileName,
 
     *lockFileDesc=lockFD; /* return lock file descriptor to caller */
 
-    /* close open file descriptors */
-    /* Note by A.B.: sysconf(_SC_OPEN_MAX) does work under Linux.
-       No need in ad hoc guessing */
-
-    numFiles = sysconf(_SC_OPEN_MAX); /* how many file descriptors? */
+    /* close open file descriptors. Only the ones actually open: the
+        limit from sysconf(_SC_OPEN_MAX) can be a million or more */
 
-
-    for(i=numFiles-1;i>=0;--i) /* close all open files except lock */
-        {
-        if(i!=lockFD) /* don't close the lock file! */
-            close(i);
-        }
+    CloseOpenFiles(lockFD); /* don't close the lock file! */
 
     /* stdin/out/err to /dev/null */
 
@@ -393,101 +8730,330 @@ int BecomeDaemonProcess(const char *const lockFileName,
 }
 
 
-void StateHandler(int sig){
-    gAutoLightOn = !gAutoLightOn;
+/**************************************************************************/
+/***************************************************************************
+
+   CloseOpenFiles
+
+    Close every file descriptor except one. close_range() does it in one
+   call; on kernels without it we close what /proc/self/fd lists, and
+   only without /proc do we try every descriptor up to the limit.
+
+    Inputs:
+
+   keep			 I					  the descriptor to leave open
+
+    Returns: none
+
+***************************************************************************/
+/**************************************************************************/
+
+void CloseOpenFiles(int keep)
+{
+    DIR *dir;
+    struct dirent *entry;
+    int fd, numFiles;
+
+#ifdef __NR_close_range
+    if((keep == 0 || syscall(__NR_close_range, 0, keep-1, 0) == 0) &&
+       syscall(__NR_close_range, keep+1, ~0u, 0) == 0)
+        return;
+#endif
+
+    dir = opendir("/proc/self/fd");
+    if(dir){
+        while((entry = readdir(dir)) != 0){
+            if(ParseDecimal(entry->d_name, strlen(entry->d_name), &fd) < 0)
+                continue;   /* . and .. */
+            if(fd != keep && fd != dirfd(dir))
+                close(fd);
+        }
+        closedir(dir);
+        return;
+    }
+
+    numFiles = sysconf(_SC_OPEN_MAX);
+    for(fd=numFiles-1;fd>=0;--fd){
+        if(fd!=keep)
+            close(fd);
+    }
 }
 
 /**************************************************************************/
 /***************************************************************************
 
-   ConfigureSignalHandlers
+   Service manager
 
-    Set up the behaviour of the various signal handlers for this process.
-   Signals are divided into three groups: those we can ignore; those that
-   cause a fatal error but in which we are not particularly interested and
-   those that are used to control the server daemon. We don't bother with
-   the new real-time signals under Linux since these are blocked by default
-   anyway.
+    "prime-sensors foreground" runs the daemon under a service manager
+   such as systemd: there is no fork, no lock file and no detaching from
+   the terminal, since the manager tracks the process and collects its
+   output itself. Two of its protocols are spoken, both optional:
 
-    Returns: none
+    Socket activation. If LISTEN_PID is our PID and LISTEN_FDS is at
+   least 1, descriptor 3 is the control socket, already bound and
+   listening (ListenSequentialPacket= in a .socket unit). Clients can
+   connect before we are up, and the socket file is left to the manager.
+
+    sd_notify. If NOTIFY_SOCKET names a datagram socket (a path, or an
+   abstract name starting with '@') we send READY=1 once every device and
+   socket is open, RELOADING=1/READY=1 around a configuration reload and
+   STOPPING=1 on the way out. If WATCHDOG_USEC is also set we send
+   WATCHDOG=1 from the main loop at half that interval, so a loop that
+   wedges stops the pings.
+
+    Nothing here needs the manager itself: any process that binds a
+   datagram socket and sets NOTIFY_SOCKET to it sees the messages, e.g.
+
+      socat UNIX-RECV:/tmp/notify - &
+      NOTIFY_SOCKET=/tmp/notify WATCHDOG_USEC=2000000 prime-sensors foreground
+
+    The time from main() to READY=1 is logged and reported by "stats".
 
 ***************************************************************************/
 /**************************************************************************/
 
-int ConfigureSignalHandlers(void)
+/**************************************************************************/
+/***************************************************************************
+
+   BecomeServiceProcess
+
+    The foreground counterpart of BecomeDaemonProcess: pick up what the
+   service manager passed us and open the system log.
+
+    Inputs:
+
+   logPrefix	 I					  the string that will appear at the
+                                          start of all log messages
+
+   logLevel		 I					  the logging level for this process
+
+    Returns:
+
+    status code indicating success - 0 = success
+
+***************************************************************************/
+/**************************************************************************/
+
+int BecomeServiceProcess(const char *const logPrefix, const int logLevel)
 {
-    struct sigaction		sighupSA,sigusr1SA,sigtermSA;
+    chdir("/");
 
-    /* ignore several signals because they do not concern us. In a
-        production server, SIGPIPE would have to be handled as this
-        is raised when attempting to write to a socket that has
-        been closed or has gone away (for example if the client has
-        crashed). SIGURG is used to handle out-of-band data. SIGIO
-        is used to handle asynchronous I/O. SIGCHLD is very important
-        if the server has forked any child processes. */
+    openlog(logPrefix,LOG_PID|LOG_NDELAY,LOG_LOCAL0);
+    (void)setlogmask(LOG_UPTO(logLevel));
 
-    signal(SIGUSR2, StateHandler);
-    signal(SIGPIPE, SIG_IGN);
-    signal(SIGALRM, SIG_IGN);
-    signal(SIGTSTP, SIG_IGN);
-    signal(SIGTTIN, SIG_IGN);
-    signal(SIGTTOU, SIG_IGN);
-    signal(SIGURG, SIG_IGN);
-    signal(SIGXCPU, SIG_IGN);
-    signal(SIGXFSZ, SIG_IGN);
-    signal(SIGVTALRM, SIG_IGN);
-    signal(SIGPROF, SIG_IGN);
-    signal(SIGIO, SIG_IGN);
-    signal(SIGCHLD, SIG_IGN);
+    gListenSocket=TakeListenSocket();
+    OpenNotifySocket();
 
-    /* these signals mainly indicate fault conditions and should be logged.
-        Note we catch SIGCONT, which is used for a type of job control that
-        is usually inapplicable to a daemon process. We don't do anyting to
-        SIGSTOP since this signal can't be caught or ignored. SIGEMT is not
-        supported under Linux as of kernel v2.4 */
-
-    signal(SIGQUIT, FatalSigHandler);
-    signal(SIGILL, FatalSigHandler);
-    signal(SIGTRAP, FatalSigHandler);
-    signal(SIGABRT, FatalSigHandler);
-    signal(SIGIOT, FatalSigHandler);
-    signal(SIGBUS, FatalSigHandler);
+    return 0;
+}
+
+/* the control socket passed by socket activation, or -1. Only the first
+   descriptor is ours; any others are closed */
+
+int TakeListenSocket(void)
+{
+    const char *pidEnv = getenv("LISTEN_PID"), *fdsEnv = getenv("LISTEN_FDS");
+    int pid, numFds, type, fd = 3, i;
+    socklen_t len = sizeof(type);
+
+    if(!pidEnv || !fdsEnv ||
+       ParseDecimal(pidEnv, strlen(pidEnv), &pid) < 0 || pid != getpid() ||
+       ParseDecimal(fdsEnv, strlen(fdsEnv), &numFds) < 0 || numFds < 1)
+        return -1;
+
+    /* not for our children */
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_FDNAMES");
+
+    for(i=1;i<numFds;i++)
+        close(fd+i);
+
+    if(getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) < 0 || type != SOCK_SEQPACKET){
+        LogMessage(LOG_INFO,"passed descriptor %d is not a seqpacket socket", fd);
+        close(fd);
+        return -1;
+    }
+
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    LogMessage(LOG_INFO,"control socket passed by the service manager");
+    return fd;
+}
+
+/* connect gNotifySocket to NOTIFY_SOCKET. Returns -1 if there is none */
+
+int OpenNotifySocket(void)
+{
+    const char *path = getenv("NOTIFY_SOCKET");
+    size_t len;
+
+    if(!path || (path[0] != '/' && path[0] != '@'))
+        return -1;
+    len = strlen(path);
+    if(len >= sizeof(gNotifyAddr.sun_path))
+        return -1;
+
+    memset(&gNotifyAddr, 0, sizeof(gNotifyAddr));
+    gNotifyAddr.sun_family = AF_UNIX;
+    memcpy(gNotifyAddr.sun_path, path, len);
+    if(path[0] == '@')
+        gNotifyAddr.sun_path[0] = 0;    /* abstract namespace */
+    gNotifyAddrLen = offsetof(struct sockaddr_un, sun_path) + len;
+
+    gNotifySocket = socket(AF_UNIX, SOCK_DGRAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+    if(gNotifySocket < 0){
+        LogMessage(LOG_INFO,"can't open notify socket, errno=%d", errno);
+        return -1;
+    }
+    return 0;
+}
+
+/* send one sd_notify message, newline separated assignments. A lost
+   message is logged, never fatal */
+
+int NotifyServiceManager(const char *state)
+{
+    if(gNotifySocket < 0)
+        return 0;
+
+    if(LoopSendTo(gNotifySocket, state, strlen(state), MSG_NOSIGNAL,
+                  (struct sockaddr *)&gNotifyAddr, gNotifyAddrLen) < 0){
+        LogMessage(LOG_INFO,"can't notify the service manager, errno=%d", errno);
+        return -1;
+    }
+    return 0;
+}
+
+/* arm the watchdog ping if the service manager wants one */
+
+int StartServiceWatchdog(void)
+{
+    static EventSource watchdogSource = { -1, OnWatchdogTimer, 0, 0 };
+    const char *usecEnv = getenv("WATCHDOG_USEC"), *pidEnv = getenv("WATCHDOG_PID");
+    struct itimerspec its;
+    unsigned long long usec;
+    int pid;
+
+    if(gNotifySocket < 0 || !usecEnv)
+        return 0;
+    if(pidEnv && (ParseDecimal(pidEnv, strlen(pidEnv), &pid) < 0 || pid != getpid()))
+        return 0;
+
+    usec = strtoull(usecEnv, 0, 10) / 2;
+    if(usec == 0)
+        return 0;
+
+    gWatchdogTimerDesc = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+    if(gWatchdogTimerDesc < 0)
+        return -1;
+
+    its.it_value.tv_sec = its.it_interval.tv_sec = usec / 1000000;
+    its.it_value.tv_nsec = its.it_interval.tv_nsec = (usec % 1000000) * 1000;
+    LoopTimerSettime(gWatchdogTimerDesc, &its);
+
+    watchdogSource.fd = gWatchdogTimerDesc;
+    LogMessage(LOG_INFO,"watchdog ping every %llu ms", usec/1000);
+    return WatchEventSource(&watchdogSource, EPOLLIN);
+}
+
+void OnWatchdogTimer(EventSource *src, unsigned int events)
+{
+    unsigned long long expirations;
+
+    if(LoopRead(src->fd, &expirations, sizeof(expirations)) == sizeof(expirations))
+        NotifyServiceManager("WATCHDOG=1");
+}
+
+
+/**************************************************************************/
+/***************************************************************************
+
+   Crash records
+
+    A fatal signal can arrive at any point, in the middle of malloc or
+   syslog among others, so its handler may only use async-signal-safe
+   calls: no stdio, no syslog, no allocation. FatalSigHandler formats a
+   one line record into the preallocated gCrashRecord with the helpers
+   below, writes it to gCrashFilePath, which was opened at startup, and
+   to stderr (the terminal or the service manager's log, /dev/null for a
+   daemon). The next run finds the record there and logs it.
+
+***************************************************************************/
+/**************************************************************************/
+
+struct FatalSignal
+{
+    int                 sig;
+    const char          *name;
+};
+
+FatalSignal const       gFatalSignals[] =
+{
+    { SIGQUIT, "SIGQUIT" },
+    { SIGILL, "SIGILL" },
+    { SIGTRAP, "SIGTRAP" },
+    { SIGABRT, "SIGABRT" },             /* also SIGIOT */
+    { SIGBUS, "SIGBUS" },
 #ifdef SIGEMT /* this is not defined under Linux */
-    signal(SIGEMT,FatalSigHandler);
+    { SIGEMT, "SIGEMT" },
 #endif
-    signal(SIGFPE, FatalSigHandler);
-    signal(SIGSEGV, FatalSigHandler);
-    signal(SIGSTKFLT, FatalSigHandler);
-    signal(SIGCONT, FatalSigHandler);
-    signal(SIGPWR, FatalSigHandler);
-    signal(SIGSYS, FatalSigHandler);
+    { SIGFPE, "SIGFPE" },
+    { SIGSEGV, "SIGSEGV" },
+    { SIGSTKFLT, "SIGSTKFLT" },
+    { SIGPWR, "SIGPWR" },
+    { SIGSYS, "SIGSYS" },
+};
 
-    /* these handlers are important for control of the daemon process */
+int const               gNumFatalSignals = sizeof(gFatalSignals)/sizeof(gFatalSignals[0]);
+
+/* append text to the record at *pos, keeping room for the newline */
+
+void AppendCrashText(int *pos, const char *text)
+{
+    while(*text && *pos < gCrashRecordSize - 1)
+        gCrashRecord[(*pos)++] = *text++;
+}
 
-    /* TERM  - shut down immediately */
+void AppendCrashNumber(int *pos, unsigned long long value, int base)
+{
+    char digits[24];
+    int n = 0;
 
-    sigtermSA.sa_handler=TermHandler;
-    sigemptyset(&sigtermSA.sa_mask);
-    sigtermSA.sa_flags=0;
-    sigaction(SIGTERM,&sigtermSA,NULL);
+    do{
+        digits[n++] = "0123456789abcdef"[value % base];
+        value /= base;
+    }while(value);
+
+    if(base == 16)
+        AppendCrashText(pos, "0x");
+    while(n > 0 && *pos < gCrashRecordSize - 1)
+        gCrashRecord[(*pos)++] = digits[--n];
+}
 
-    /* USR1 - finish serving the current connection and then close down
-        (graceful shutdown) */
+/* open the crash record file, logging and clearing what the last run
+   left in it */
 
-    sigusr1SA.sa_handler=Usr1Handler;
-    sigemptyset(&sigusr1SA.sa_mask);
-    sigusr1SA.sa_flags=0;
-    sigaction(SIGUSR1,&sigusr1SA,NULL);
+int OpenCrashRecord(const char *path)
+{
+    char last[gCrashRecordSize];
+    int len;
 
-    /* HUP - finish serving the current connection and then restart
-        connection handling. This could be used to force a re-read of
-        a configuration file for example */
+    gCrashFileDesc = open(path, O_RDWR|O_CREAT|O_CLOEXEC, 0644);
+    if(gCrashFileDesc < 0){
+        LogMessage(LOG_INFO,"can't open crash record %s, errno=%d", path, errno);
+        return -1;
+    }
 
-    sighupSA.sa_handler=HupHandler;
-    sigemptyset(&sighupSA.sa_mask);
-    sighupSA.sa_flags=0;
-    sigaction(SIGHUP,&sighupSA,NULL);
+    len = read(gCrashFileDesc, last, sizeof(last) - 1);
+    if(len > 0){
+        last[len] = 0;
+        last[strcspn(last, "\n")] = 0;
+        LogMessage(LOG_INFO,"the last run crashed: %s", last);
+    }
 
+    ftruncate(gCrashFileDesc, 0);
+    lseek(gCrashFileDesc, 0, SEEK_SET);
     return 0;
 }
 
@@ -496,107 +9062,236 @@ int ConfigureSignalHandlers(void)
 
    FatalSigHandler
 
-    General catch-all signal handler to mop up signals that we aren't
-    especially interested in. It shouldn't be called (if it is it
-    probably indicates an error). It simply dumps a report of the
-    signal to the log and dies. Note the strsignal() function may not be
-   available on all platform/compiler combinations.
+    Handler for the signals that mean something has gone badly wrong.
+   It records which signal, the fault address (or the sender), the
+   uptime and how far the main loop had got, removes the lock file and
+   the control socket (close and unlink are async-signal-safe), then
+   raises the signal again. SA_RESETHAND has put back the default action
+   by then, so we die with the right status, and a core file where
+   enabled.
 
     sig			 I					  the signal number
 
+    info		 I					  what the kernel knows about it
+
+    context		 I					  unused
+
     Returns: none
 
 ***************************************************************************/
 /**************************************************************************/
 
-void FatalSigHandler(int sig)
+void FatalSigHandler(int sig, siginfo_t *info, void *context)
 {
-#ifdef _GNU_SOURCE
-    syslog(LOG_LOCAL0|LOG_INFO,"caught signal: %s - exiting",strsignal(sig));
-#else
-    syslog(LOG_LOCAL0|LOG_INFO,"caught signal: %d - exiting",sig);
-#endif
+    const char *name = "signal";
+    int pos = 0, i;
+
+    for(i=0;i<gNumFatalSignals;i++){
+        if(gFatalSignals[i].sig == sig)
+            name = gFatalSignals[i].name;
+    }
+
+    AppendCrashText(&pos, "pid ");
+    AppendCrashNumber(&pos, getpid(), 10);
+    AppendCrashText(&pos, " caught ");
+    AppendCrashText(&pos, name);
+    AppendCrashText(&pos, " (");
+    AppendCrashNumber(&pos, sig, 10);
+    AppendCrashText(&pos, ") code ");
+    AppendCrashNumber(&pos, (unsigned int)info->si_code, 10);
+    if(info->si_code <= 0){
+        AppendCrashText(&pos, " from pid ");     /* kill(), raise(), abort() */
+        AppendCrashNumber(&pos, info->si_pid, 10);
+    }else{
+        AppendCrashText(&pos, " addr ");
+        AppendCrashNumber(&pos, (unsigned long)info->si_addr, 16);
+    }
+    AppendCrashText(&pos, " uptime ");
+    AppendCrashNumber(&pos, NowMs() - gStartMs, 10);
+    AppendCrashText(&pos, " ms wakeups ");
+    AppendCrashNumber(&pos, gEngine->counters.wakeups, 10);
+    AppendCrashText(&pos, " seq ");
+    AppendCrashNumber(&pos, gEngine->stateSeq, 10);
+    gCrashRecord[pos++] = '\n';
+
+    if(gCrashFileDesc >= 0)
+        write(gCrashFileDesc, gCrashRecord, pos);
+    write(STDERR_FILENO, gCrashRecord, pos);
 
-    closelog();
     TidyUp();
-    _exit(0);
+    raise(sig);
 }
 
 /**************************************************************************/
 /***************************************************************************
 
-   TermHandler
-
-    Handler for the SIGTERM signal. It cleans up the lock file and
-   closes the server's master socket, then immediately exits.
+   ConfigureSignalHandlers
 
-    sig			 I					  the signal number (SIGTERM)
+    Set up the behaviour of the various signal handlers for this process.
+   Signals are divided into three groups: those we can ignore; those that
+   cause a fatal error but in which we are not particularly interested and
+   those that are used to control the server daemon. We don't bother with
+   the new real-time signals under Linux since these are blocked by default
+   anyway.
 
     Returns: none
 
 ***************************************************************************/
 /**************************************************************************/
 
-void TermHandler(int sig)
+int ConfigureSignalHandlers(void)
 {
-    TidyUp();
-    _exit(0);
+    struct sigaction		fatalSA;
+    stack_t                 altStack;
+    int                     i;
+
+    /* ignore several signals because they do not concern us. In a
+        production server, SIGPIPE would have to be handled as this
+        is raised when attempting to write to a socket that has
+        been closed or has gone away (for example if the client has
+        crashed). SIGURG is used to handle out-of-band data. SIGIO
+        is used to handle asynchronous I/O. SIGCHLD is very important
+        if the server has forked any child processes. */
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGALRM, SIG_IGN);
+    signal(SIGTSTP, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    signal(SIGTTOU, SIG_IGN);
+    signal(SIGURG, SIG_IGN);
+    signal(SIGXCPU, SIG_IGN);
+    signal(SIGXFSZ, SIG_IGN);
+    signal(SIGVTALRM, SIG_IGN);
+    signal(SIGPROF, SIG_IGN);
+    signal(SIGIO, SIG_IGN);
+    signal(SIGCHLD, SIG_IGN);
+
+    /* these signals mainly indicate fault conditions and should be logged.
+        The handler runs once (SA_RESETHAND) on a stack of its own, so a
+        stack overflow can still be reported, and then lets the signal
+        kill us as it would have. We don't do anyting to SIGSTOP since
+        this signal can't be caught or ignored, and leave SIGCONT alone so
+        that a stopped daemon can be resumed. SIGEMT is not supported
+        under Linux as of kernel v2.4 */
+
+    altStack.ss_sp=gAltStack;
+    altStack.ss_size=sizeof(gAltStack);
+    altStack.ss_flags=0;
+    sigaltstack(&altStack,NULL);
+
+    fatalSA.sa_sigaction=FatalSigHandler;
+    sigemptyset(&fatalSA.sa_mask);
+    fatalSA.sa_flags=SA_SIGINFO|SA_ONSTACK|SA_RESETHAND;
+
+    for(i=0;i<gNumFatalSignals;i++)
+        sigaction(gFatalSignals[i].sig,&fatalSA,NULL);
+
+    /* TERM, INT, USR1, USR2 and HUP are not handled here. They are
+        blocked and read from a signalfd by the main loop - see
+        ConfigureControlSignals */
+
+    return 0;
 }
 
 /**************************************************************************/
 /***************************************************************************
 
-   HupHandler
+   ConfigureControlSignals
 
-    Handler for the SIGHUP signal. It sets the gGracefulShutdown and
-   gCaughtHupSignal flags. The latter is used to distinguish this from
-   catching SIGUSR1. Typically in real-world servers, SIGHUP is used to
-   tell the server that it should re-read its configuration file. Many
-   important daemons do this, including syslog and xinetd (under Linux).
+    Block the signals used to control the daemon and open a signalfd for
+   them. They are then picked up by the main loop in OnControlSignal, so
+   no work is done in signal context and a stop or restart takes effect
+   as soon as it arrives rather than after the next sample period.
 
-    sig			 I					  the signal number (SIGTERM)
+    Returns:
 
-    Returns: none
+    status code indicating success - 0 = success
 
 ***************************************************************************/
 /**************************************************************************/
 
-void HupHandler(int sig)
+int ConfigureControlSignals(void)
 {
-    syslog(LOG_LOCAL0|LOG_INFO,"caught SIGHUP");
-    gGracefulShutdown=1;
-    gCaughtHupSignal=1;
+    sigset_t                controlSet;
 
-    /****************************************************************/
-    /* perhaps at this point you would re-read a configuration file */
-    /****************************************************************/
+    sigemptyset(&controlSet);
+    sigaddset(&controlSet,SIGTERM);
+    sigaddset(&controlSet,SIGINT);
+    sigaddset(&controlSet,SIGUSR1);
+    sigaddset(&controlSet,SIGUSR2);
+    sigaddset(&controlSet,SIGHUP);
 
-    return;
+    if(sigprocmask(SIG_BLOCK,&controlSet,NULL)<0)
+        return -1;
+
+    gSignalDesc=signalfd(-1,&controlSet,SFD_NONBLOCK|SFD_CLOEXEC);
+    if(gSignalDesc<0)
+        return -1;
+
+    return 0;
 }
 
 /**************************************************************************/
 /***************************************************************************
 
-   Usr1Handler
+   OnControlSignal
+
+    Drain the signalfd and act on each control signal:
+
+   SIGUSR1 - sets the gGracefulShutdown flag, which lets the loop finish
+   SIGTERM   the event it is handling before shutdown. Everything is
+   SIGINT    closed in order and the lock file and socket are removed.
+
+   SIGHUP  - sets gCaughtHupSignal, which makes the main loop reload the
+             configuration files once the current batch of events is
+             handled. The daemon keeps running throughout.
 
-    Handler for the SIGUSR1 signal. This sets the gGracefulShutdown flag,
-   which permits active connections to run to completion before shutdown.
-   It is therefore a more friendly way to shut down the server than
-   sending SIGTERM.
+   SIGUSR2 - toggles automatic backlight control, of every instance. The
+             sample timer is disarmed while it is off, so an idle daemon
+             does not wake.
 
-    sig			 I					  the signal number (SIGTERM)
+    src			 I					  the signalfd event source
+
+    events		 I					  the epoll events reported
 
     Returns: none
 
 ***************************************************************************/
 /**************************************************************************/
 
-void Usr1Handler(int sig)
+void OnControlSignal(EventSource *src, unsigned int events)
 {
-    syslog(LOG_LOCAL0|LOG_INFO,"caught SIGUSR1 - soft shutdown");
-    gGracefulShutdown=1;
+    struct signalfd_siginfo info;
+
+    while(LoopRead(src->fd,&info,sizeof(info))==sizeof(info)){
+        switch(info.ssi_signo){
+            case SIGUSR1:
+            case SIGTERM:
+            case SIGINT:
+                LogMessage(LOG_INFO,"caught %s - soft shutdown",
+                           info.ssi_signo==SIGUSR1 ? "SIGUSR1" :
+                           info.ssi_signo==SIGTERM ? "SIGTERM" : "SIGINT");
+                gGracefulShutdown=1;
+                break;
+
+            case SIGHUP:
+                LogMessage(LOG_INFO,"caught SIGHUP");
+                gCaughtHupSignal=1; /* the main loop reloads the config */
+                break;
+
+            case SIGUSR2:
+                ForEachEngine(ToggleAutoLight); /* of every instance */
+                break;
+        }
+    }
+}
 
-    return;
+/* SIGUSR2, for gEngine */
+
+void ToggleAutoLight(void)
+{
+    SetAutoLight(!gEngine->autoLightOn);
+    FlushActuators();
 }
 
 /**************************************************************************/
@@ -609,6 +9304,9 @@ void Usr1Handler(int sig)
    file descriptors are closed, etc.) but it is good practice to
    explicitly release that which you have allocated.
 
+    FatalSigHandler calls it too, so it must only make async-signal-safe
+   calls.
+
     Returns: none
 
 ***************************************************************************/
@@ -616,16 +9314,36 @@ void Usr1Handler(int sig)
 
 void TidyUp(void)
 {
-    if(gLockFileDesc!=-1)
+    Engine *engine;
+
+    for(engine=gEngines;engine;engine=engine->next)
         {
-        close(gLockFileDesc);
-        unlink(gLockFilePath);
-        gLockFileDesc=-1;
+        if(engine->lockFileDesc!=-1)
+            {
+            close(engine->lockFileDesc);
+            unlink(engine->lockFilePath);
+            engine->lockFileDesc=-1;
+            }
+
+        if(engine->masterSocket!=-1)
+            {
+            close(engine->masterSocket);
+            if(!engine->masterSocketInherited)
+                unlink(engine->controlSocketPath);
+            engine->masterSocket=-1;
+            }
+
+        if(engine->queryServer.listenFd!=-1)
+            {
+            close(engine->queryServer.listenFd);
+            unlink(engine->stateSocketPath);
+            engine->queryServer.listenFd=-1;
+            }
         }
 
-    if(gMasterSocket!=-1)
+    if(gCrashFileDesc!=-1)
         {
-        close(gMasterSocket);
-        gMasterSocket=-1;
+        close(gCrashFileDesc);
+        gCrashFileDesc=-1;
         }
 }
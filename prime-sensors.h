@@ -0,0 +1,344 @@
+/*************************************************************************/
+/***************************************************************************
+
+   prime-sensors.h
+
+    Interface to a running prime-sensors daemon for local tools: the
+   control socket protocol and the telemetry ring reader.
+
+    The daemon serves a Unix-domain SOCK_SEQPACKET socket at
+   PS_CONTROL_SOCKET_PATH. Every message is one fixed size record: a
+   client sends a PsRequest and gets back exactly one PsResponse with the
+   same op; for PS_OP_GET_STATS the message carries a PsStats after the
+   PsResponse. After PS_OP_SUBSCRIBE the daemon also sends unsolicited
+   PsResponse records with op PS_OP_EVENT whenever a state group in the
+   subscription mask changes. Records are in host byte order; the socket
+   is local only.
+
+    A client that only polls the state can use PS_STATE_SOCKET_PATH
+   instead. It speaks the same records but only answers PS_OP_GET_STATE,
+   from threads of its own that never wait for the daemon's main loop,
+   so a busy client can't hold the loop up and a busy loop can't hold
+   the client up. Any other op gets PS_STATUS_BAD_REQUEST.
+
+***************************************************************************/
+/*************************************************************************/
+
+#ifndef PRIME_SENSORS_H
+#define PRIME_SENSORS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define PS_CONTROL_SOCKET_PATH  "/var/run/prime-sensors.sock"
+#define PS_STATE_SOCKET_PATH    "/var/run/prime-sensors-state.sock"
+#define PS_PROTOCOL_VERSION     1
+
+/* request ops. The argument is described next to each one */
+
+enum
+{
+    PS_OP_GET_STATE = 1,        /* none */
+    PS_OP_SET_AUTO_LIGHT,       /* 1 = on, 0 = off, -1 = toggle */
+    PS_OP_SET_BRIGHTNESS,       /* backlight level; turns auto light off */
+    PS_OP_SET_AUDIO_ROUTE,      /* a PS_AUDIO_* value */
+    PS_OP_SUBSCRIBE,            /* mask of PS_EVENT_* bits, 0 = none */
+    PS_OP_RELOAD,               /* none; same as SIGHUP */
+    PS_OP_STOP,                 /* none; same as SIGUSR1 */
+    PS_OP_GET_STATS,            /* 1 = reset the statistics after reading */
+    PS_OP_SET_STATS,            /* 1 = collect statistics, 0 = stop */
+
+    PS_OP_EVENT = 0x80          /* daemon to subscriber only */
+};
+
+enum
+{
+    PS_STATUS_OK = 0,
+    PS_STATUS_BAD_REQUEST,      /* unknown op or version */
+    PS_STATUS_BAD_VALUE,        /* argument out of range */
+    PS_STATUS_FAILED,           /* the daemon could not carry it out */
+    PS_STATUS_OVERRUN           /* events were dropped before this one */
+};
+
+/* state groups, used in subscription masks and PsResponse.events */
+
+enum
+{
+    PS_EVENT_LUX        = 1 << 0,
+    PS_EVENT_BRIGHTNESS = 1 << 1,
+    PS_EVENT_AUDIO      = 1 << 2,
+    PS_EVENT_AUTO_LIGHT = 1 << 3,
+    PS_EVENT_ALL        = 0x0f
+};
+
+enum
+{
+    PS_AUDIO_AUTO = -1,         /* follow the headset jack */
+    PS_AUDIO_SPEAKER = 0,
+    PS_AUDIO_HEADPHONE = 1
+};
+
+struct PsRequest
+{
+    uint8_t             version;            /* PS_PROTOCOL_VERSION */
+    uint8_t             op;
+    uint16_t            reserved;
+    int32_t             arg;
+};
+
+struct PsState
+{
+    int32_t             lux;                /* -1 = not sampled */
+    int32_t             brightness;         /* -1 = unknown */
+    int32_t             targetBrightness;
+    uint8_t             autoLight;
+    uint8_t             jackPlugged;
+    int8_t              audioRoute;         /* PS_AUDIO_SPEAKER/HEADPHONE */
+    int8_t              audioOverride;      /* a PS_AUDIO_* value */
+    uint32_t            timestampMs;        /* CLOCK_MONOTONIC, wraps */
+};
+
+struct PsResponse
+{
+    uint8_t             version;
+    uint8_t             op;
+    uint8_t             status;
+    uint8_t             events;             /* groups changed (PS_OP_EVENT) */
+    uint32_t            seq;                /* state sequence number */
+    struct PsState      state;
+};
+
+/* loop statistics, see PS_OP_GET_STATS. Stage timings are from the
+   start to the end of that stage; the latencies are from the wakeup that
+   brought the event in to the actuator write (for the backlight, the
+   first step of the ramp) or mixer switch that answered it */
+
+enum
+{
+    PS_STAT_LOOP,               /* one main loop iteration, after the wait */
+    PS_STAT_SENSOR_READ,        /* one sysfs sensor read */
+    PS_STAT_ACTUATOR_WRITE,     /* one sysfs actuator write */
+    PS_STAT_MIXER,              /* one mixer route switch */
+    PS_STAT_POLICY,             /* deciding what to do with new samples */
+    PS_STAT_BACKLIGHT_LATENCY,  /* light sample to backlight write */
+    PS_STAT_JACK_LATENCY,       /* jack change to mixer switched */
+    PS_NUM_STATS
+};
+
+/* running totals since the daemon started, kept whether or not
+   statistics are on */
+
+enum
+{
+    PS_COUNT_WAKEUPS,           /* main loop iterations */
+    PS_COUNT_SENSOR_READS,      /* sysfs sensor reads */
+    PS_COUNT_SENSOR_SKIPS,      /* samples skipped, the sensor not needed */
+    PS_COUNT_DECISIONS,         /* policy runs */
+    PS_COUNT_ACTUATOR_WRITES,
+    PS_COUNT_MIXER_SWITCHES,
+    PS_COUNT_SYSCALLS,          /* made by the main loop */
+    PS_COUNT_WRITES_COALESCED,  /* queued writes replaced in the same tick */
+    PS_COUNT_WRITES_DROPPED,    /* queued writes of the value already set */
+    PS_COUNT_SENSOR_TIMEOUTS,   /* sensor worker reads that hung */
+    PS_COUNT_OVERRIDES,         /* backlight levels set by someone else */
+    PS_NUM_COUNTS
+};
+
+struct PsStat
+{
+    uint64_t            count;
+    uint64_t            totalNs;
+    uint64_t            maxNs;
+    uint64_t            p50Ns;              /* percentiles are bucket upper */
+    uint64_t            p90Ns;              /* bounds, within 12.5% */
+    uint64_t            p99Ns;
+};
+
+struct PsStats
+{
+    uint8_t             enabled;
+    uint8_t             reserved[3];
+    uint32_t            elapsedMs;          /* since enabled or reset */
+    struct PsStat       stat[PS_NUM_STATS];
+    uint32_t            uptimeMs;           /* since the daemon started */
+    uint32_t            startupUs;          /* from main() to ready */
+    uint64_t            count[PS_NUM_COUNTS];
+};
+
+/*************************************************************************/
+/***************************************************************************
+
+   Telemetry ring
+
+    Every sample the daemon takes and every level it writes is published
+   as a PsRingRecord in a ring of PsRingHeader.capacity records mapped
+   from PS_RING_PATH. There is one writer (the daemon) and any number of
+   readers, which map the file read-only and never write to it, so they
+   cannot slow the daemon down or disturb each other.
+
+    Records are numbered from 0. header.head is the number of records
+   written so far, and record n lives in slot n % capacity, whose seq
+   field is n once the record is complete. A reader that falls more than
+   capacity records behind has been overrun: ps_ring_read skips it ahead
+   to the oldest record still in the ring and adds what it missed to
+   reader.lost.
+
+***************************************************************************/
+/*************************************************************************/
+
+#define PS_RING_PATH            "/var/run/prime-sensors/telemetry.ring"
+#define PS_RING_MAGIC           0x47525350u  /* "PSRG" */
+#define PS_RING_VERSION         1
+
+enum
+{
+    PS_RECORD_LUX = 1,          /* value = lux */
+    PS_RECORD_SAMPLE,           /* value = sample of sensor number source */
+    PS_RECORD_BRIGHTNESS,       /* value = level written, value2 = target */
+    PS_RECORD_JACK,             /* value = 1 plugged, 0 unplugged */
+    PS_RECORD_AUDIO_ROUTE,      /* value = PS_AUDIO_SPEAKER/HEADPHONE */
+    PS_RECORD_SWITCH            /* value = new PS_SWITCH_*, value2 = old */
+};
+
+/* the states of switch class devices (headset jack, HDMI, dock), as
+   the values of their samples and in PS_RECORD_SWITCH */
+
+enum
+{
+    PS_SWITCH_NONE = 0,         /* unplugged, undocked */
+    PS_SWITCH_HEADSET,          /* headphones with a microphone */
+    PS_SWITCH_HEADPHONE,
+    PS_SWITCH_HDMI,
+    PS_SWITCH_DESK_DOCK,
+    PS_SWITCH_CAR_DOCK,
+    PS_NUM_SWITCH_STATES
+};
+
+struct PsRingHeader
+{
+    uint32_t            magic;
+    uint16_t            version;
+    uint16_t            recordSize;
+    uint32_t            capacity;           /* a power of two */
+    uint32_t            writerPid;
+    uint64_t            head;               /* records written so far */
+    uint8_t             reserved[40];       /* pad to 64 bytes */
+};
+
+struct PsRingRecord
+{
+    uint64_t            seq;
+    uint64_t            timestampNs;        /* CLOCK_MONOTONIC */
+    uint16_t            type;               /* PS_RECORD_* */
+    uint16_t            source;             /* sensor/actuator number */
+    int32_t             value;
+    int32_t             value2;
+    int32_t             reserved;
+};
+
+struct PsRingReader
+{
+    const struct PsRingHeader *header;
+    const struct PsRingRecord *records;
+    size_t              mapSize;
+    uint64_t            pos;                /* next record to read */
+    uint64_t            lost;               /* records missed by overrun */
+};
+
+/* map the ring at path and start reading at the newest record. Returns 0
+   on success */
+
+static inline int ps_ring_open(struct PsRingReader *reader, const char *path)
+{
+    struct stat st;
+    void *map;
+    int fd;
+
+    memset(reader, 0, sizeof(*reader));
+
+    fd = open(path, O_RDONLY|O_CLOEXEC);
+    if(fd < 0)
+        return -1;
+    if(fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct PsRingHeader)){
+        close(fd);
+        return -1;
+    }
+
+    map = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+        return -1;
+
+    reader->header = (const struct PsRingHeader *)map;
+    reader->records = (const struct PsRingRecord *)(reader->header + 1);
+    reader->mapSize = st.st_size;
+
+    if(reader->header->magic != PS_RING_MAGIC ||
+       reader->header->version != PS_RING_VERSION ||
+       reader->header->recordSize != sizeof(struct PsRingRecord) ||
+       sizeof(struct PsRingHeader) +
+       (size_t)reader->header->capacity*sizeof(struct PsRingRecord) > reader->mapSize){
+        munmap(map, st.st_size);
+        memset(reader, 0, sizeof(*reader));
+        return -1;
+    }
+
+    reader->pos = __atomic_load_n(&reader->header->head, __ATOMIC_ACQUIRE);
+    return 0;
+}
+
+static inline void ps_ring_close(struct PsRingReader *reader)
+{
+    if(reader->header)
+        munmap((void *)reader->header, reader->mapSize);
+    memset(reader, 0, sizeof(*reader));
+}
+
+/* records written but not read yet */
+
+static inline uint64_t ps_ring_lag(const struct PsRingReader *reader)
+{
+    return __atomic_load_n(&reader->header->head, __ATOMIC_ACQUIRE) - reader->pos;
+}
+
+/* copy out the next record. Returns 1 if there was one, 0 if the reader
+   has caught up with the writer */
+
+static inline int ps_ring_read(struct PsRingReader *reader, struct PsRingRecord *record)
+{
+    uint32_t capacity = reader->header->capacity;
+
+    for(;;){
+        uint64_t head = __atomic_load_n(&reader->header->head, __ATOMIC_ACQUIRE);
+        const struct PsRingRecord *slot;
+
+        if(reader->pos >= head)
+            return 0;
+
+        if(head - reader->pos > capacity){
+            reader->lost += head - capacity - reader->pos;
+            reader->pos = head - capacity;
+        }
+
+        slot = &reader->records[reader->pos & (capacity - 1)];
+        if(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == reader->pos){
+            *record = *slot;
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if(__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == reader->pos){
+                reader->pos++;
+                return 1;
+            }
+        }
+
+        /* the writer reused the slot under us: we were overrun */
+        reader->lost++;
+        reader->pos++;
+    }
+}
+
+#endif /* PRIME_SENSORS_H */